@@ -1036,6 +1036,19 @@ static void blkio_update_blkg_policy(struct blkio_cgroup *blkcg,
 	}
 }
 
+/*
+ * weight_device rules are set through the proportional policy files but
+ * apply to fiops groups as well.
+ */
+static inline bool blkio_policy_node_applies(struct blkio_policy_node *pn,
+				struct blkio_group *blkg)
+{
+	if (pn->plid == blkg->plid)
+		return true;
+	return pn->plid == BLKIO_POLICY_PROP &&
+		blkg->plid == BLKIO_POLICY_FIOPS;
+}
+
 /*
  * A policy node rule has been updated. Propagate this update to all the
  * block groups which might be affected by this update.
@@ -1050,7 +1063,7 @@ static void blkio_update_policy_node_blkg(struct blkio_cgroup *blkcg,
 	spin_lock_irq(&blkcg->lock);
 
 	hlist_for_each_entry(blkg, n, &blkcg->blkg_list, blkcg_node) {
-		if (pn->dev != blkg->dev || pn->plid != blkg->plid)
+		if (pn->dev != blkg->dev || !blkio_policy_node_applies(pn, blkg))
 			continue;
 		blkio_update_blkg_policy(blkcg, blkg, pn);
 	}
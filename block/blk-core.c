@@ -33,6 +33,7 @@
 #include <trace/events/block.h>
 
 #include "blk.h"
+#include "blk-mq.h"
 #ifdef CONFIG_MMC_MUST_PREVENT_WP_VIOLATION
 #include <linux/mmc/card.h>
 #include <mach/devices_cmdline.h>
@@ -54,7 +55,7 @@ static struct workqueue_struct *kblockd_workqueue;
 
 extern atomic_t emmc_reboot;
 
-static void drive_stat_acct(struct request *rq, int new_io)
+void drive_stat_acct(struct request *rq, int new_io)
 {
 	struct hd_struct *part;
 	int rw = rq_data_dir(rq);
@@ -317,6 +318,8 @@ void blk_cleanup_queue(struct request_queue *q)
 
 	if (q->elevator)
 		blk_drain_queue(q, true);
+	if (q->mq_ops)
+		blk_mq_drain_queue(q);
 
 	
 	del_timer_sync(&q->backing_dev_info.laptop_mode_wb_timer);
@@ -379,9 +382,12 @@ struct request_queue *blk_alloc_queue_node(gfp_t gfp_mask, int node_id)
 	if (err)
 		goto fail_id;
 
-	if (blk_throtl_init(q))
+	if (blk_latency_init(q))
 		goto fail_bdi;
 
+	if (blk_throtl_init(q))
+		goto fail_lat;
+
 	setup_timer(&q->backing_dev_info.laptop_mode_wb_timer,
 		    laptop_mode_timer_fn, (unsigned long) q);
 	setup_timer(&q->timeout, blk_rq_timed_out_timer, (unsigned long) q);
@@ -401,6 +407,8 @@ struct request_queue *blk_alloc_queue_node(gfp_t gfp_mask, int node_id)
 
 	return q;
 
+fail_lat:
+	blk_latency_exit(q);
 fail_bdi:
 	bdi_destroy(&q->backing_dev_info);
 fail_id:
@@ -892,8 +900,8 @@ void blk_add_request_payload(struct request *rq, struct page *page,
 }
 EXPORT_SYMBOL_GPL(blk_add_request_payload);
 
-static bool bio_attempt_back_merge(struct request_queue *q, struct request *req,
-				   struct bio *bio)
+bool bio_attempt_back_merge(struct request_queue *q, struct request *req,
+			    struct bio *bio)
 {
 	const int ff = bio->bi_rw & REQ_FAILFAST_MASK;
 
@@ -914,8 +922,8 @@ static bool bio_attempt_back_merge(struct request_queue *q, struct request *req,
 	return true;
 }
 
-static bool bio_attempt_front_merge(struct request_queue *q,
-				    struct request *req, struct bio *bio)
+bool bio_attempt_front_merge(struct request_queue *q, struct request *req,
+			     struct bio *bio)
 {
 	const int ff = bio->bi_rw & REQ_FAILFAST_MASK;
 
@@ -1412,8 +1420,10 @@ static void blk_account_io_completion(struct request *req, unsigned int bytes)
 	}
 }
 
-static void blk_account_io_done(struct request *req)
+void blk_account_io_done(struct request *req)
 {
+	blk_account_latency(req);
+
 	if (blk_do_io_stat(req) && !(req->cmd_flags & REQ_FLUSH_SEQ)) {
 		unsigned long duration = jiffies - req->start_time;
 		const int rw = rq_data_dir(req);
@@ -0,0 +1,118 @@
+/*
+ * Per queue request latency histograms
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/blkdev.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/sched.h>
+
+#include "blk.h"
+
+int blk_latency_init(struct request_queue *q)
+{
+	q->lat_hist = alloc_percpu(struct blk_lat_hist);
+	if (!q->lat_hist)
+		return -ENOMEM;
+	return 0;
+}
+
+void blk_latency_exit(struct request_queue *q)
+{
+	free_percpu(q->lat_hist);
+	q->lat_hist = NULL;
+}
+
+/*
+ * Bucket 0 holds everything below 1 << BLK_LAT_SHIFT ns, bucket n > 0
+ * starts at 1 << (BLK_LAT_SHIFT + n - 1) ns and the last one is open ended.
+ * sched_clock() is not synchronized across cpus, negative deltas land in 0.
+ */
+static inline unsigned int blk_lat_bucket(s64 delta)
+{
+	unsigned int bucket;
+
+	if (delta < (1 << BLK_LAT_SHIFT))
+		return 0;
+
+	bucket = ilog2((u64)delta) - BLK_LAT_SHIFT + 1;
+	return min_t(unsigned int, bucket, BLK_LAT_BUCKETS - 1);
+}
+
+static inline u64 blk_lat_bucket_start_us(unsigned int bucket)
+{
+	if (!bucket)
+		return 0;
+	return div_u64(1ULL << (BLK_LAT_SHIFT + bucket - 1), NSEC_PER_USEC);
+}
+
+/*
+ * Called on completion. Only a per-cpu increment per histogram, so it is
+ * left on for every queue.
+ */
+void blk_account_latency(struct request *rq)
+{
+	struct blk_lat_hist __percpu *lat = rq->q->lat_hist;
+	const int sync = rq_is_sync(rq);
+	const int rw = rq_data_dir(rq);
+	u64 now;
+
+	if (!lat || rq->cmd_type != REQ_TYPE_FS ||
+	    (rq->cmd_flags & REQ_FLUSH_SEQ) || !rq->io_start_time_ns)
+		return;
+
+	now = sched_clock();
+
+	this_cpu_inc(lat->hist[BLK_LAT_QUEUE][sync][rw]
+		[blk_lat_bucket(rq->io_start_time_ns - rq->start_time_ns)]);
+	this_cpu_inc(lat->hist[BLK_LAT_SERVICE][sync][rw]
+		[blk_lat_bucket(now - rq->io_start_time_ns)]);
+}
+
+void blk_latency_reset(struct request_queue *q, int type)
+{
+	int cpu;
+
+	if (!q->lat_hist)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct blk_lat_hist *lat = per_cpu_ptr(q->lat_hist, cpu);
+
+		memset(lat->hist[type], 0, sizeof(lat->hist[type]));
+	}
+}
+
+ssize_t blk_latency_show(struct request_queue *q, int type, char *page)
+{
+	unsigned long sum[2][2];
+	ssize_t len;
+	int cpu, b, sync, rw;
+
+	if (!q->lat_hist)
+		return -ENODEV;
+
+	len = scnprintf(page, PAGE_SIZE, "%-10s %12s %12s %12s %12s\n",
+			"usecs", "read_sync", "read_async",
+			"write_sync", "write_async");
+
+	for (b = 0; b < BLK_LAT_BUCKETS; b++) {
+		memset(sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			struct blk_lat_hist *lat = per_cpu_ptr(q->lat_hist, cpu);
+
+			for (sync = 0; sync < 2; sync++)
+				for (rw = 0; rw < 2; rw++)
+					sum[sync][rw] += lat->hist[type][sync][rw][b];
+		}
+
+		len += scnprintf(page + len, PAGE_SIZE - len,
+				 "%-10llu %12lu %12lu %12lu %12lu\n",
+				 blk_lat_bucket_start_us(b),
+				 sum[1][READ], sum[0][READ],
+				 sum[1][WRITE], sum[0][WRITE]);
+	}
+
+	return len;
+}
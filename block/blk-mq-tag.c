@@ -0,0 +1,122 @@
+/*
+ * Tag allocation for the multiqueue block layer
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/blkdev.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+
+#include "blk-mq.h"
+
+/*
+ * Tags are bits in a shared map. Each cpu starts searching where its last
+ * allocation left off, so cpus mostly stay on different words of the map
+ * and only bounce cache lines once the queue is nearly full.
+ */
+struct blk_mq_tags {
+	unsigned int		nr_tags;
+	unsigned int __percpu	*last_tag;
+	wait_queue_head_t	wait;
+	unsigned long		map[0];
+};
+
+static int __blk_mq_get_tag_range(struct blk_mq_tags *tags,
+				  unsigned int start, unsigned int end)
+{
+	unsigned int tag = start;
+
+	while (1) {
+		tag = find_next_zero_bit(tags->map, end, tag);
+		if (tag >= end)
+			return -1;
+		if (!test_and_set_bit_lock(tag, tags->map))
+			return tag;
+	}
+}
+
+static int __blk_mq_get_tag(struct blk_mq_tags *tags)
+{
+	unsigned int start = this_cpu_read(*tags->last_tag);
+	int tag;
+
+	tag = __blk_mq_get_tag_range(tags, start, tags->nr_tags);
+	if (tag < 0 && start)
+		tag = __blk_mq_get_tag_range(tags, 0, start);
+	if (tag < 0)
+		return tag;
+
+	this_cpu_write(*tags->last_tag, tag + 1 < tags->nr_tags ? tag + 1 : 0);
+	return tag;
+}
+
+int blk_mq_get_tag(struct blk_mq_tags *tags, gfp_t gfp)
+{
+	DEFINE_WAIT(wait);
+	int tag;
+
+	tag = __blk_mq_get_tag(tags);
+	if (tag >= 0 || !(gfp & __GFP_WAIT))
+		return tag;
+
+	while (1) {
+		prepare_to_wait_exclusive(&tags->wait, &wait,
+					  TASK_UNINTERRUPTIBLE);
+		tag = __blk_mq_get_tag(tags);
+		if (tag >= 0)
+			break;
+		io_schedule();
+	}
+	finish_wait(&tags->wait, &wait);
+
+	return tag;
+}
+
+void blk_mq_put_tag(struct blk_mq_tags *tags, unsigned int tag)
+{
+	BUG_ON(tag >= tags->nr_tags);
+
+	clear_bit_unlock(tag, tags->map);
+	smp_mb__after_clear_bit();
+	if (waitqueue_active(&tags->wait))
+		wake_up(&tags->wait);
+}
+
+bool blk_mq_tags_busy(struct blk_mq_tags *tags)
+{
+	return find_first_bit(tags->map, tags->nr_tags) < tags->nr_tags;
+}
+
+struct blk_mq_tags *blk_mq_init_tags(unsigned int nr_tags, int node)
+{
+	struct blk_mq_tags *tags;
+	unsigned int cpu;
+
+	tags = kzalloc_node(sizeof(*tags) + BITS_TO_LONGS(nr_tags) *
+			    sizeof(unsigned long), GFP_KERNEL, node);
+	if (!tags)
+		return NULL;
+
+	tags->last_tag = alloc_percpu(unsigned int);
+	if (!tags->last_tag) {
+		kfree(tags);
+		return NULL;
+	}
+
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(tags->last_tag, cpu) = cpu * nr_tags / nr_cpu_ids;
+
+	tags->nr_tags = nr_tags;
+	init_waitqueue_head(&tags->wait);
+	return tags;
+}
+
+void blk_mq_free_tags(struct blk_mq_tags *tags)
+{
+	if (!tags)
+		return;
+
+	free_percpu(tags->last_tag);
+	kfree(tags);
+}
@@ -0,0 +1,465 @@
+/*
+ * Multiqueue block layer
+ *
+ * Requests are staged on a per-cpu software queue and handed to one of the
+ * driver's hardware queues, so submission never touches q->queue_lock or
+ * an elevator. Every request is preallocated and owned by a tag of the
+ * hardware queue it is dispatched on.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/delay.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "blk.h"
+#include "blk-mq.h"
+
+/* don't walk more than this many queued requests looking for a merge */
+#define BLK_MQ_MERGE_MAX	8
+
+struct blk_mq_hw_ctx *blk_mq_map_queue(struct request_queue *q, const int cpu)
+{
+	return q->queue_hw_ctx[q->mq_map[cpu]];
+}
+EXPORT_SYMBOL(blk_mq_map_queue);
+
+static struct request *blk_mq_tag_to_rq(struct blk_mq_hw_ctx *hctx,
+					unsigned int tag)
+{
+	return hctx->rq_mem + tag * hctx->rq_size;
+}
+
+static bool blk_mq_hctx_has_pending(struct blk_mq_hw_ctx *hctx)
+{
+	return find_first_bit(hctx->ctx_map, hctx->nr_ctx) < hctx->nr_ctx;
+}
+
+static struct request *blk_mq_alloc_request(struct blk_mq_hw_ctx *hctx,
+					    struct blk_mq_ctx *ctx)
+{
+	struct request *rq;
+	int tag;
+
+	tag = blk_mq_get_tag(hctx->tags, GFP_NOIO);
+	rq = blk_mq_tag_to_rq(hctx, tag);
+
+	blk_rq_init(hctx->queue, rq);
+	rq->tag = tag;
+	rq->mq_ctx = ctx;
+	return rq;
+}
+
+static void blk_mq_free_request(struct request *rq)
+{
+	struct request_queue *q = rq->q;
+	struct blk_mq_hw_ctx *hctx = q->mq_ops->map_queue(q, rq->mq_ctx->cpu);
+
+	rq->mq_ctx = NULL;
+	blk_mq_put_tag(hctx->tags, rq->tag);
+}
+
+/*
+ * May be called from interrupt context.
+ */
+void blk_mq_end_io(struct request *rq, int error)
+{
+	if (blk_update_request(rq, error, blk_rq_bytes(rq)))
+		BUG();
+
+	if (blk_queue_add_random(rq->q))
+		add_disk_randomness(rq->rq_disk);
+
+	blk_account_io_done(rq);
+	blk_mq_free_request(rq);
+}
+EXPORT_SYMBOL(blk_mq_end_io);
+
+static void __blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	struct request_queue *q = hctx->queue;
+	struct request *rq;
+	LIST_HEAD(rq_list);
+	int bit, ret;
+
+	/*
+	 * An insert racing with us either lands before the splice, or sets
+	 * its bit again and is picked up by the caller's recheck.
+	 */
+	for_each_set_bit(bit, hctx->ctx_map, hctx->nr_ctx) {
+		struct blk_mq_ctx *ctx = hctx->ctxs[bit];
+
+		clear_bit(bit, hctx->ctx_map);
+		spin_lock(&ctx->lock);
+		list_splice_tail_init(&ctx->rq_list, &rq_list);
+		spin_unlock(&ctx->lock);
+	}
+
+	/* requests the driver pushed back on an earlier run go first */
+	spin_lock(&hctx->lock);
+	list_splice_init(&hctx->dispatch, &rq_list);
+	spin_unlock(&hctx->lock);
+
+	while (!list_empty(&rq_list)) {
+		rq = list_first_entry(&rq_list, struct request, queuelist);
+		list_del_init(&rq->queuelist);
+
+		set_io_start_time_ns(rq);
+		ret = q->mq_ops->queue_rq(hctx, rq);
+		if (ret == BLK_MQ_RQ_QUEUE_OK)
+			continue;
+		if (ret == BLK_MQ_RQ_QUEUE_BUSY) {
+			list_add(&rq->queuelist, &rq_list);
+			break;
+		}
+
+		if (ret != BLK_MQ_RQ_QUEUE_ERROR)
+			pr_err("blk-mq: bad return on queue: %d\n", ret);
+		blk_mq_end_io(rq, -EIO);
+	}
+
+	if (!list_empty(&rq_list)) {
+		spin_lock(&hctx->lock);
+		list_splice(&rq_list, &hctx->dispatch);
+		spin_unlock(&hctx->lock);
+	}
+}
+
+void blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx, bool async)
+{
+	if (unlikely(test_bit(BLK_MQ_S_STOPPED, &hctx->state)))
+		return;
+
+	if (async) {
+		kblockd_schedule_work(hctx->queue, &hctx->run_work);
+		return;
+	}
+
+	/*
+	 * Only one context dispatches from a hardware queue at a time. Whoever
+	 * loses the race has already queued its request, the winner rechecks
+	 * the software queues after dropping the bit.
+	 */
+	while (!test_and_set_bit(BLK_MQ_S_RUNNING, &hctx->state)) {
+		__blk_mq_run_hw_queue(hctx);
+		clear_bit_unlock(BLK_MQ_S_RUNNING, &hctx->state);
+		smp_mb__after_clear_bit();
+
+		if (!blk_mq_hctx_has_pending(hctx) ||
+		    test_bit(BLK_MQ_S_STOPPED, &hctx->state))
+			break;
+	}
+}
+EXPORT_SYMBOL(blk_mq_run_hw_queue);
+
+void blk_mq_run_queues(struct request_queue *q, bool async)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i)
+		blk_mq_run_hw_queue(hctx, async);
+}
+EXPORT_SYMBOL(blk_mq_run_queues);
+
+void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	set_bit(BLK_MQ_S_STOPPED, &hctx->state);
+}
+EXPORT_SYMBOL(blk_mq_stop_hw_queue);
+
+void blk_mq_start_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	clear_bit(BLK_MQ_S_STOPPED, &hctx->state);
+	blk_mq_run_hw_queue(hctx, true);
+}
+EXPORT_SYMBOL(blk_mq_start_hw_queue);
+
+void blk_mq_start_stopped_hw_queues(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (!test_bit(BLK_MQ_S_STOPPED, &hctx->state))
+			continue;
+
+		blk_mq_start_hw_queue(hctx);
+	}
+}
+EXPORT_SYMBOL(blk_mq_start_stopped_hw_queues);
+
+static void blk_mq_run_work_fn(struct work_struct *work)
+{
+	struct blk_mq_hw_ctx *hctx;
+
+	hctx = container_of(work, struct blk_mq_hw_ctx, run_work);
+	blk_mq_run_hw_queue(hctx, false);
+}
+
+static bool blk_mq_attempt_merge(struct request_queue *q,
+				 struct blk_mq_ctx *ctx, struct bio *bio)
+{
+	struct request *rq;
+	int checked = BLK_MQ_MERGE_MAX;
+	bool merged = false;
+
+	spin_lock(&ctx->lock);
+	list_for_each_entry_reverse(rq, &ctx->rq_list, queuelist) {
+		if (!checked--)
+			break;
+
+		if (!blk_rq_merge_ok(rq, bio))
+			continue;
+
+		switch (blk_try_merge(rq, bio)) {
+		case ELEVATOR_BACK_MERGE:
+			merged = bio_attempt_back_merge(q, rq, bio);
+			break;
+		case ELEVATOR_FRONT_MERGE:
+			merged = bio_attempt_front_merge(q, rq, bio);
+			break;
+		}
+		if (merged)
+			break;
+	}
+	spin_unlock(&ctx->lock);
+
+	return merged;
+}
+
+static void blk_mq_make_request(struct request_queue *q, struct bio *bio)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	struct request *rq;
+	int cpu;
+
+	blk_queue_bounce(q, &bio);
+
+	if (unlikely(blk_queue_dead(q))) {
+		bio_endio(bio, -ENODEV);
+		return;
+	}
+
+	/*
+	 * The request may end up being inserted from another cpu if we sleep
+	 * for a tag, that is fine as the software queues are locked.
+	 */
+	cpu = get_cpu();
+	ctx = per_cpu_ptr(q->queue_ctx, cpu);
+	hctx = q->mq_ops->map_queue(q, cpu);
+	put_cpu();
+
+	if ((hctx->flags & BLK_MQ_F_SHOULD_MERGE) && !blk_queue_nomerges(q) &&
+	    blk_mq_attempt_merge(q, ctx, bio))
+		return;
+
+	rq = blk_mq_alloc_request(hctx, ctx);
+	init_request_from_bio(rq, bio);
+	if (blk_queue_io_stat(q))
+		rq->cmd_flags |= REQ_IO_STAT;
+	drive_stat_acct(rq, 1);
+
+	spin_lock(&ctx->lock);
+	list_add_tail(&rq->queuelist, &ctx->rq_list);
+	set_bit(ctx->index_hw, hctx->ctx_map);
+	spin_unlock(&ctx->lock);
+
+	blk_mq_run_hw_queue(hctx, false);
+}
+
+void blk_mq_drain_queue(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	while (true) {
+		bool busy = false;
+
+		queue_for_each_hw_ctx(q, hctx, i)
+			busy |= blk_mq_tags_busy(hctx->tags);
+
+		if (!busy)
+			break;
+		msleep(10);
+	}
+}
+
+static void blk_mq_free_hw_queues(struct request_queue *q,
+				  unsigned int nr_init)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (!hctx)
+			continue;
+
+		cancel_work_sync(&hctx->run_work);
+		if (i < nr_init && q->mq_ops->exit_hctx)
+			q->mq_ops->exit_hctx(hctx, i);
+
+		blk_mq_free_tags(hctx->tags);
+		kfree(hctx->rq_mem);
+		kfree(hctx->ctx_map);
+		kfree(hctx->ctxs);
+		kfree(hctx);
+	}
+
+	kfree(q->queue_hw_ctx);
+	q->queue_hw_ctx = NULL;
+}
+
+void blk_mq_free_queue(struct request_queue *q)
+{
+	blk_mq_free_hw_queues(q, q->nr_hw_queues);
+	free_percpu(q->queue_ctx);
+	kfree(q->mq_map);
+	q->mq_ops = NULL;
+}
+
+static int blk_mq_init_hw_queues(struct request_queue *q,
+				 struct blk_mq_reg *reg, void *driver_data,
+				 unsigned int *nr_init)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int node = reg->numa_node;
+	int i;
+
+	for (i = 0; i < reg->nr_hw_queues; i++) {
+		hctx = kzalloc_node(sizeof(*hctx), GFP_KERNEL, node);
+		if (!hctx)
+			return -ENOMEM;
+		q->queue_hw_ctx[i] = hctx;
+
+		spin_lock_init(&hctx->lock);
+		INIT_LIST_HEAD(&hctx->dispatch);
+		INIT_WORK(&hctx->run_work, blk_mq_run_work_fn);
+		hctx->queue = q;
+		hctx->queue_num = i;
+		hctx->flags = reg->flags;
+		hctx->queue_depth = reg->queue_depth;
+		hctx->rq_size = ALIGN(sizeof(struct request) + reg->cmd_size,
+				      cache_line_size());
+
+		hctx->ctxs = kmalloc_node(nr_cpu_ids * sizeof(void *),
+					  GFP_KERNEL, node);
+		hctx->ctx_map = kzalloc_node(BITS_TO_LONGS(nr_cpu_ids) *
+					     sizeof(unsigned long), GFP_KERNEL,
+					     node);
+		hctx->rq_mem = kzalloc_node(reg->queue_depth * hctx->rq_size,
+					    GFP_KERNEL, node);
+		hctx->tags = blk_mq_init_tags(reg->queue_depth, node);
+		if (!hctx->ctxs || !hctx->ctx_map || !hctx->rq_mem ||
+		    !hctx->tags)
+			return -ENOMEM;
+	}
+
+	for (i = 0; i < reg->nr_hw_queues; i++) {
+		hctx = q->queue_hw_ctx[i];
+		if (reg->ops->init_hctx &&
+		    reg->ops->init_hctx(hctx, driver_data, i))
+			return -ENOMEM;
+		*nr_init = i + 1;
+	}
+
+	return 0;
+}
+
+static void blk_mq_init_cpu_queues(struct request_queue *q,
+				   struct blk_mq_reg *reg)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	unsigned int cpu;
+
+	/*
+	 * Every possible cpu gets a software queue up front, an offline cpu
+	 * simply never queues anything on it.
+	 */
+	for_each_possible_cpu(cpu) {
+		ctx = per_cpu_ptr(q->queue_ctx, cpu);
+		spin_lock_init(&ctx->lock);
+		INIT_LIST_HEAD(&ctx->rq_list);
+		ctx->cpu = cpu;
+		ctx->queue = q;
+
+		hctx = reg->ops->map_queue(q, cpu);
+		ctx->index_hw = hctx->nr_ctx;
+		hctx->ctxs[hctx->nr_ctx++] = ctx;
+	}
+}
+
+/*
+ * Spread the cpus over the hardware queues in contiguous ranges, so that
+ * neighbouring cpus share a queue.
+ */
+static unsigned int *blk_mq_make_queue_map(struct blk_mq_reg *reg)
+{
+	unsigned int *map;
+	unsigned int cpu;
+
+	map = kzalloc_node(nr_cpu_ids * sizeof(*map), GFP_KERNEL,
+			   reg->numa_node);
+	if (!map)
+		return NULL;
+
+	for_each_possible_cpu(cpu)
+		map[cpu] = cpu * reg->nr_hw_queues / nr_cpu_ids;
+
+	return map;
+}
+
+struct request_queue *blk_mq_init_queue(struct blk_mq_reg *reg,
+					void *driver_data)
+{
+	struct request_queue *q;
+	unsigned int nr_init = 0;
+
+	if (!reg->nr_hw_queues || !reg->ops->queue_rq ||
+	    !reg->ops->map_queue || !reg->queue_depth ||
+	    reg->queue_depth > BLK_MQ_MAX_DEPTH)
+		return NULL;
+
+	q = blk_alloc_queue_node(GFP_KERNEL, reg->numa_node);
+	if (!q)
+		return NULL;
+
+	q->nr_hw_queues = reg->nr_hw_queues;
+	q->queue_hw_ctx = kzalloc_node(reg->nr_hw_queues *
+				       sizeof(struct blk_mq_hw_ctx *),
+				       GFP_KERNEL, reg->numa_node);
+	q->queue_ctx = alloc_percpu(struct blk_mq_ctx);
+	q->mq_map = blk_mq_make_queue_map(reg);
+	if (!q->queue_hw_ctx || !q->queue_ctx || !q->mq_map)
+		goto err_free;
+
+	q->mq_ops = reg->ops;
+	q->queuedata = driver_data;
+
+	if (blk_mq_init_hw_queues(q, reg, driver_data, &nr_init))
+		goto err_free;
+
+	blk_mq_init_cpu_queues(q, reg);
+
+	blk_queue_make_request(q, blk_mq_make_request);
+	q->nr_requests = reg->queue_depth;
+	blk_queue_congestion_threshold(q);
+
+	return q;
+
+err_free:
+	if (q->queue_hw_ctx)
+		blk_mq_free_hw_queues(q, nr_init);
+	free_percpu(q->queue_ctx);
+	kfree(q->mq_map);
+	q->mq_ops = NULL;
+	blk_cleanup_queue(q);
+	return NULL;
+}
+EXPORT_SYMBOL(blk_mq_init_queue);
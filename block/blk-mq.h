@@ -0,0 +1,28 @@
+#ifndef INT_BLK_MQ_H
+#define INT_BLK_MQ_H
+
+#include <linux/blk-mq.h>
+
+struct blk_mq_ctx {
+	spinlock_t		lock;
+	struct list_head	rq_list;
+
+	unsigned int		cpu;
+	unsigned int		index_hw;
+
+	struct request_queue	*queue;
+} ____cacheline_aligned_in_smp;
+
+void blk_mq_drain_queue(struct request_queue *q);
+void blk_mq_free_queue(struct request_queue *q);
+
+/*
+ * Tag allocation
+ */
+struct blk_mq_tags *blk_mq_init_tags(unsigned int nr_tags, int node);
+void blk_mq_free_tags(struct blk_mq_tags *tags);
+int blk_mq_get_tag(struct blk_mq_tags *tags, gfp_t gfp);
+void blk_mq_put_tag(struct blk_mq_tags *tags, unsigned int tag);
+bool blk_mq_tags_busy(struct blk_mq_tags *tags);
+
+#endif
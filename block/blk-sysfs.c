@@ -9,6 +9,7 @@
 #include <linux/blktrace_api.h>
 
 #include "blk.h"
+#include "blk-mq.h"
 
 struct queue_sysfs_entry {
 	struct attribute attr;
@@ -275,6 +276,43 @@ queue_rq_affinity_store(struct request_queue *q, const char *page, size_t count)
 	return ret;
 }
 
+static ssize_t queue_latency_store(struct request_queue *q, int type,
+				   const char *page, size_t count)
+{
+	unsigned long val;
+	ssize_t ret = queue_var_store(&val, page, count);
+
+	if (ret < 0)
+		return ret;
+	if (val)
+		return -EINVAL;
+
+	blk_latency_reset(q, type);
+	return ret;
+}
+
+static ssize_t queue_latency_queue_show(struct request_queue *q, char *page)
+{
+	return blk_latency_show(q, BLK_LAT_QUEUE, page);
+}
+
+static ssize_t queue_latency_queue_store(struct request_queue *q,
+					 const char *page, size_t count)
+{
+	return queue_latency_store(q, BLK_LAT_QUEUE, page, count);
+}
+
+static ssize_t queue_latency_service_show(struct request_queue *q, char *page)
+{
+	return blk_latency_show(q, BLK_LAT_SERVICE, page);
+}
+
+static ssize_t queue_latency_service_store(struct request_queue *q,
+					   const char *page, size_t count)
+{
+	return queue_latency_store(q, BLK_LAT_SERVICE, page, count);
+}
+
 static struct queue_sysfs_entry queue_requests_entry = {
 	.attr = {.name = "nr_requests", .mode = S_IRUGO | S_IWUSR },
 	.show = queue_requests_show,
@@ -389,6 +427,18 @@ static struct queue_sysfs_entry queue_random_entry = {
 	.store = queue_store_random,
 };
 
+static struct queue_sysfs_entry queue_latency_queue_entry = {
+	.attr = {.name = "latency_queue", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_latency_queue_show,
+	.store = queue_latency_queue_store,
+};
+
+static struct queue_sysfs_entry queue_latency_service_entry = {
+	.attr = {.name = "latency_service", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_latency_service_show,
+	.store = queue_latency_service_store,
+};
+
 static struct attribute *default_attrs[] = {
 	&queue_requests_entry.attr,
 	&queue_ra_entry.attr,
@@ -411,6 +461,8 @@ static struct attribute *default_attrs[] = {
 	&queue_rq_affinity_entry.attr,
 	&queue_iostats_entry.attr,
 	&queue_random_entry.attr,
+	&queue_latency_queue_entry.attr,
+	&queue_latency_service_entry.attr,
 	NULL,
 };
 
@@ -490,6 +542,11 @@ static void blk_release_queue(struct kobject *kobj)
 
 	blk_throtl_exit(q);
 
+	if (q->mq_ops)
+		blk_mq_free_queue(q);
+
+	blk_latency_exit(q);
+
 	if (rl->rq_pool)
 		mempool_destroy(rl->rq_pool);
 
@@ -139,6 +139,35 @@ void blk_recalc_rq_segments(struct request *rq);
 void blk_rq_set_mixed_merge(struct request *rq);
 bool blk_rq_merge_ok(struct request *rq, struct bio *bio);
 int blk_try_merge(struct request *rq, struct bio *bio);
+bool bio_attempt_back_merge(struct request_queue *q, struct request *req,
+			    struct bio *bio);
+bool bio_attempt_front_merge(struct request_queue *q, struct request *req,
+			     struct bio *bio);
+void drive_stat_acct(struct request *rq, int new_io);
+void blk_account_io_done(struct request *req);
+
+/*
+ * Request latency histograms, log2 buckets of nanoseconds starting at
+ * 1 << BLK_LAT_SHIFT, indexed [sync][data direction].
+ */
+#define BLK_LAT_SHIFT		10
+#define BLK_LAT_BUCKETS		24
+
+enum {
+	BLK_LAT_QUEUE = 0,	/* allocation to dispatch */
+	BLK_LAT_SERVICE,	/* dispatch to completion */
+	BLK_LAT_NR,
+};
+
+struct blk_lat_hist {
+	unsigned long		hist[BLK_LAT_NR][2][2][BLK_LAT_BUCKETS];
+};
+
+int blk_latency_init(struct request_queue *q);
+void blk_latency_exit(struct request_queue *q);
+void blk_account_latency(struct request *rq);
+void blk_latency_reset(struct request_queue *q, int type);
+ssize_t blk_latency_show(struct request_queue *q, int type, char *page);
 
 void blk_queue_congestion_threshold(struct request_queue *q);
 
@@ -1044,6 +1044,10 @@ static int elevator_switch(struct request_queue *q, struct elevator_type *new_e)
 	elevator_exit(old_elevator);
 	elv_quiesce_end(q);
 
+	/* start the new scheduler with clean latency histograms */
+	blk_latency_reset(q, BLK_LAT_QUEUE);
+	blk_latency_reset(q, BLK_LAT_SERVICE);
+
 	blk_add_trace_msg(q, "elv switch: %s", e->type->elevator_name);
 
 	return 0;
@@ -12,6 +12,7 @@
 #include <linux/ioprio.h>
 #include <linux/blktrace_api.h>
 #include "blk.h"
+#include "blk-cgroup.h"
 
 #define VIOS_SCALE_SHIFT 10
 #define VIOS_SCALE (1 << VIOS_SCALE_SHIFT)
@@ -39,10 +40,34 @@ enum wl_prio_t {
 	FIOPS_PRIO_NR,
 };
 
+struct fiops_group {
+	struct rb_node rb_node;
+	u64 vios; /* key in group_tree */
+
+	unsigned int weight;
+	unsigned int new_weight;
+	bool needs_update;
+
+	struct fiops_rb_root service_tree[FIOPS_PRIO_NR];
+	unsigned int busy_queues;
+
+	int ref;
+#ifdef CONFIG_FIOPS_GROUP_IOSCHED
+	struct hlist_node fiopsd_node;
+	struct blkio_group blkg;
+#endif
+};
+
 struct fiops_data {
 	struct request_queue *queue;
 
-	struct fiops_rb_root service_tree[FIOPS_PRIO_NR];
+	/* busy groups, sorted by their weight scaled vios */
+	struct fiops_rb_root group_tree;
+	struct fiops_group root_group;
+#ifdef CONFIG_FIOPS_GROUP_IOSCHED
+	struct hlist_head group_list;
+	unsigned int nr_blkcg_linked_grps;
+#endif
 
 	unsigned int busy_queues;
 	unsigned int in_flight[2];
@@ -63,6 +88,7 @@ struct fiops_ioc {
 	struct rb_node rb_node;
 	u64 vios; /* key in service_tree */
 	struct fiops_rb_root *service_tree;
+	struct fiops_group *group;
 
 	unsigned int in_flight;
 
@@ -74,12 +100,13 @@ struct fiops_ioc {
 	enum wl_prio_t wl_type;
 };
 
-#define ioc_service_tree(ioc) (&((ioc)->fiopsd->service_tree[(ioc)->wl_type]))
+#define ioc_service_tree(ioc) (&((ioc)->group->service_tree[(ioc)->wl_type]))
 #define RQ_CIC(rq)		icq_to_cic((rq)->elv.icq)
 
 enum ioc_state_flags {
 	FIOPS_IOC_FLAG_on_rr = 0,	/* on round-robin busy list */
 	FIOPS_IOC_FLAG_prio_changed,	/* task priority has changed */
+	FIOPS_IOC_FLAG_group_lookup,	/* group lookup failed, retry */
 };
 
 #define FIOPS_IOC_FNS(name)						\
@@ -98,6 +125,7 @@ static inline int fiops_ioc_##name(const struct fiops_ioc *ioc)	\
 
 FIOPS_IOC_FNS(on_rr);
 FIOPS_IOC_FNS(prio_changed);
+FIOPS_IOC_FNS(group_lookup);
 #undef FIOPS_IOC_FNS
 
 #define fiops_log_ioc(fiopsd, ioc, fmt, args...)	\
@@ -146,6 +174,20 @@ static struct fiops_ioc *fiops_rb_first(struct fiops_rb_root *root)
 	return NULL;
 }
 
+static struct fiops_group *fiops_rb_first_group(struct fiops_rb_root *root)
+{
+	if (!root->count)
+		return NULL;
+
+	if (!root->left)
+		root->left = rb_first(&root->rb);
+
+	if (root->left)
+		return rb_entry(root->left, struct fiops_group, rb_node);
+
+	return NULL;
+}
+
 static void rb_erase_init(struct rb_node *n, struct rb_root *root)
 {
 	rb_erase(n, root);
@@ -179,6 +221,294 @@ static void fiops_update_min_vios(struct fiops_rb_root *service_tree)
 	service_tree->min_vios = max_vios(service_tree->min_vios, ioc->vios);
 }
 
+static void fiops_update_group_min_vios(struct fiops_rb_root *group_tree)
+{
+	struct fiops_group *fiopsg;
+
+	fiopsg = fiops_rb_first_group(group_tree);
+	if (!fiopsg)
+		return;
+	group_tree->min_vios = max_vios(group_tree->min_vios, fiopsg->vios);
+}
+
+static void fiops_init_group(struct fiops_group *fiopsg)
+{
+	int i;
+
+	for (i = IDLE_WORKLOAD; i <= RT_WORKLOAD; i++)
+		fiopsg->service_tree[i] = FIOPS_RB_ROOT;
+	RB_CLEAR_NODE(&fiopsg->rb_node);
+}
+
+#ifdef CONFIG_FIOPS_GROUP_IOSCHED
+static inline struct fiops_group *fiopsg_of_blkg(struct blkio_group *blkg)
+{
+	if (blkg)
+		return container_of(blkg, struct fiops_group, blkg);
+	return NULL;
+}
+
+static void fiops_update_blkio_group_weight(void *key,
+		struct blkio_group *blkg, unsigned int weight)
+{
+	struct fiops_group *fiopsg = fiopsg_of_blkg(blkg);
+
+	fiopsg->new_weight = weight;
+	fiopsg->needs_update = true;
+}
+
+static void fiops_init_add_group_lists(struct fiops_data *fiopsd,
+		struct fiops_group *fiopsg, struct blkio_cgroup *blkcg)
+{
+	struct backing_dev_info *bdi = &fiopsd->queue->backing_dev_info;
+	unsigned int major, minor;
+
+	if (bdi->dev) {
+		sscanf(dev_name(bdi->dev), "%u:%u", &major, &minor);
+		blkiocg_add_blkio_group(blkcg, &fiopsg->blkg, (void *)fiopsd,
+					MKDEV(major, minor), BLKIO_POLICY_FIOPS);
+	} else
+		blkiocg_add_blkio_group(blkcg, &fiopsg->blkg, (void *)fiopsd,
+					0, BLKIO_POLICY_FIOPS);
+
+	fiopsd->nr_blkcg_linked_grps++;
+	fiopsg->weight = blkcg_get_weight(blkcg, fiopsg->blkg.dev);
+
+	hlist_add_head(&fiopsg->fiopsd_node, &fiopsd->group_list);
+}
+
+/*
+ * Should be called from sleepable context, alloc_percpu() may block.
+ */
+static struct fiops_group *fiops_alloc_group(struct fiops_data *fiopsd)
+{
+	struct fiops_group *fiopsg;
+
+	fiopsg = kzalloc_node(sizeof(*fiopsg), GFP_NOIO, fiopsd->queue->node);
+	if (!fiopsg)
+		return NULL;
+
+	fiops_init_group(fiopsg);
+
+	/* joint reference of the cgroup and the elevator, dropped on destroy */
+	fiopsg->ref = 1;
+
+	if (blkio_alloc_blkg_stats(&fiopsg->blkg)) {
+		kfree(fiopsg);
+		return NULL;
+	}
+
+	return fiopsg;
+}
+
+static struct fiops_group *
+fiops_find_group(struct fiops_data *fiopsd, struct blkio_cgroup *blkcg)
+{
+	struct fiops_group *fiopsg;
+	struct backing_dev_info *bdi = &fiopsd->queue->backing_dev_info;
+	unsigned int major, minor;
+
+	if (blkcg == &blkio_root_cgroup)
+		fiopsg = &fiopsd->root_group;
+	else
+		fiopsg = fiopsg_of_blkg(blkiocg_lookup_group(blkcg, fiopsd));
+
+	if (fiopsg && !fiopsg->blkg.dev && bdi->dev && dev_name(bdi->dev)) {
+		sscanf(dev_name(bdi->dev), "%u:%u", &major, &minor);
+		fiopsg->blkg.dev = MKDEV(major, minor);
+	}
+
+	return fiopsg;
+}
+
+/*
+ * Find the group current task belongs to, creating it if needed. Called
+ * with queue_lock held, which is dropped around the allocation. Returns
+ * NULL if the group doesn't exist and can't be allocated right now.
+ */
+static struct fiops_group *fiops_get_group(struct fiops_data *fiopsd,
+	gfp_t gfp_mask)
+{
+	struct request_queue *q = fiopsd->queue;
+	struct blkio_cgroup *blkcg;
+	struct fiops_group *fiopsg, *__fiopsg;
+
+	rcu_read_lock();
+	blkcg = task_blkio_cgroup(current);
+	fiopsg = fiops_find_group(fiopsd, blkcg);
+	rcu_read_unlock();
+	if (fiopsg)
+		return fiopsg;
+
+	if (!(gfp_mask & __GFP_WAIT))
+		return NULL;
+
+	spin_unlock_irq(q->queue_lock);
+	fiopsg = fiops_alloc_group(fiopsd);
+	spin_lock_irq(q->queue_lock);
+
+	rcu_read_lock();
+	blkcg = task_blkio_cgroup(current);
+
+	/* somebody else may have added the group while we slept */
+	__fiopsg = fiops_find_group(fiopsd, blkcg);
+	if (__fiopsg) {
+		if (fiopsg) {
+			free_percpu(fiopsg->blkg.stats_cpu);
+			kfree(fiopsg);
+		}
+		rcu_read_unlock();
+		return __fiopsg;
+	}
+
+	if (!fiopsg) {
+		rcu_read_unlock();
+		return NULL;
+	}
+
+	fiops_init_add_group_lists(fiopsd, fiopsg, blkcg);
+	rcu_read_unlock();
+	return fiopsg;
+}
+
+static inline struct fiops_group *fiops_ref_get_group(struct fiops_group *fiopsg)
+{
+	fiopsg->ref++;
+	return fiopsg;
+}
+
+static void fiops_put_group(struct fiops_group *fiopsg)
+{
+	int i;
+
+	BUG_ON(fiopsg->ref <= 0);
+	fiopsg->ref--;
+	if (fiopsg->ref)
+		return;
+	for (i = IDLE_WORKLOAD; i <= RT_WORKLOAD; i++)
+		BUG_ON(!RB_EMPTY_ROOT(&fiopsg->service_tree[i].rb));
+	free_percpu(fiopsg->blkg.stats_cpu);
+	kfree(fiopsg);
+}
+
+static void fiops_destroy_group(struct fiops_data *fiopsd,
+	struct fiops_group *fiopsg)
+{
+	BUG_ON(hlist_unhashed(&fiopsg->fiopsd_node));
+
+	hlist_del_init(&fiopsg->fiopsd_node);
+
+	BUG_ON(fiopsd->nr_blkcg_linked_grps <= 0);
+	fiopsd->nr_blkcg_linked_grps--;
+
+	fiops_put_group(fiopsg);
+}
+
+static void fiops_release_groups(struct fiops_data *fiopsd)
+{
+	struct hlist_node *pos, *n;
+	struct fiops_group *fiopsg;
+
+	hlist_for_each_entry_safe(fiopsg, pos, n, &fiopsd->group_list,
+				  fiopsd_node) {
+		/* cgroup removal got there first and destroys the group */
+		if (!blkiocg_del_blkio_group(&fiopsg->blkg))
+			fiops_destroy_group(fiopsd, fiopsg);
+	}
+}
+
+/*
+ * The cgroup is going away, no new IO will come in this group. Called
+ * under rcu_read_lock(), which keeps key valid.
+ */
+static void fiops_unlink_blkio_group(void *key, struct blkio_group *blkg)
+{
+	struct fiops_data *fiopsd = key;
+	unsigned long flags;
+
+	spin_lock_irqsave(fiopsd->queue->queue_lock, flags);
+	fiops_destroy_group(fiopsd, fiopsg_of_blkg(blkg));
+	spin_unlock_irqrestore(fiopsd->queue->queue_lock, flags);
+}
+
+#else /* CONFIG_FIOPS_GROUP_IOSCHED */
+static struct fiops_group *fiops_get_group(struct fiops_data *fiopsd,
+	gfp_t gfp_mask)
+{
+	return &fiopsd->root_group;
+}
+
+static inline struct fiops_group *fiops_ref_get_group(struct fiops_group *fiopsg)
+{
+	return fiopsg;
+}
+
+static inline void fiops_put_group(struct fiops_group *fiopsg) {}
+static void fiops_release_groups(struct fiops_data *fiopsd) {}
+#endif /* CONFIG_FIOPS_GROUP_IOSCHED */
+
+/*
+ * A group's vios advance inversely to its weight, so a group with twice
+ * the weight gets twice the IOPS of a competing one.
+ */
+static inline u64 fiops_group_scaled_vios(struct fiops_group *fiopsg, u64 vios)
+{
+	return div_u64(vios * BLKIO_WEIGHT_DEFAULT, fiopsg->weight);
+}
+
+static void fiops_group_service_tree_add(struct fiops_data *fiopsd,
+	struct fiops_group *fiopsg)
+{
+	struct fiops_rb_root *group_tree = &fiopsd->group_tree;
+	struct rb_node **p, *parent;
+	struct fiops_group *__fiopsg;
+	int left;
+
+	if (RB_EMPTY_NODE(&fiopsg->rb_node))
+		fiopsg->vios = max_vios(group_tree->min_vios, fiopsg->vios);
+	else
+		fiops_rb_erase(&fiopsg->rb_node, group_tree);
+
+	if (unlikely(fiopsg->needs_update)) {
+		fiopsg->weight = fiopsg->new_weight;
+		fiopsg->needs_update = false;
+	}
+
+	fiops_log(fiopsd, "group add, vios %lld weight %u", fiopsg->vios,
+		fiopsg->weight);
+
+	left = 1;
+	parent = NULL;
+	p = &group_tree->rb.rb_node;
+	while (*p) {
+		parent = *p;
+		__fiopsg = rb_entry(parent, struct fiops_group, rb_node);
+
+		if (fiopsg->vios < __fiopsg->vios)
+			p = &(*p)->rb_left;
+		else {
+			p = &(*p)->rb_right;
+			left = 0;
+		}
+	}
+
+	if (left)
+		group_tree->left = &fiopsg->rb_node;
+
+	rb_link_node(&fiopsg->rb_node, parent, p);
+	rb_insert_color(&fiopsg->rb_node, &group_tree->rb);
+	group_tree->count++;
+
+	fiops_update_group_min_vios(group_tree);
+}
+
+static void fiops_group_service_tree_del(struct fiops_data *fiopsd,
+	struct fiops_group *fiopsg)
+{
+	if (!RB_EMPTY_NODE(&fiopsg->rb_node))
+		fiops_rb_erase(&fiopsg->rb_node, &fiopsd->group_tree);
+}
+
 /*
  * The fiopsd->service_trees holds all pending fiops_ioc's that have
  * requests waiting to be processed. It is sorted in the order that
@@ -265,6 +595,8 @@ static void fiops_add_ioc_rr(struct fiops_data *fiopsd, struct fiops_ioc *ioc)
 	fiops_mark_ioc_on_rr(ioc);
 
 	fiopsd->busy_queues++;
+	if (ioc->group->busy_queues++ == 0)
+		fiops_group_service_tree_add(fiopsd, ioc->group);
 
 	fiops_resort_rr_list(fiopsd, ioc);
 }
@@ -285,6 +617,10 @@ static void fiops_del_ioc_rr(struct fiops_data *fiopsd, struct fiops_ioc *ioc)
 
 	BUG_ON(!fiopsd->busy_queues);
 	fiopsd->busy_queues--;
+
+	BUG_ON(!ioc->group->busy_queues);
+	if (--ioc->group->busy_queues == 0)
+		fiops_group_service_tree_del(fiopsd, ioc->group);
 }
 
 /*
@@ -356,20 +692,23 @@ static u64 fiops_dispatch_request(struct fiops_data *fiopsd,
 
 static int fiops_forced_dispatch(struct fiops_data *fiopsd)
 {
+	struct fiops_group *fiopsg;
 	struct fiops_ioc *ioc;
 	int dispatched = 0;
 	int i;
 
-	for (i = RT_WORKLOAD; i >= IDLE_WORKLOAD; i--) {
-		while (!RB_EMPTY_ROOT(&fiopsd->service_tree[i].rb)) {
-			ioc = fiops_rb_first(&fiopsd->service_tree[i]);
-
-			while (!list_empty(&ioc->fifo)) {
-				fiops_dispatch_request(fiopsd, ioc);
-				dispatched++;
+	while ((fiopsg = fiops_rb_first_group(&fiopsd->group_tree))) {
+		for (i = RT_WORKLOAD; i >= IDLE_WORKLOAD; i--) {
+			while (!RB_EMPTY_ROOT(&fiopsg->service_tree[i].rb)) {
+				ioc = fiops_rb_first(&fiopsg->service_tree[i]);
+
+				while (!list_empty(&ioc->fifo)) {
+					fiops_dispatch_request(fiopsd, ioc);
+					dispatched++;
+				}
+				if (fiops_ioc_on_rr(ioc))
+					fiops_del_ioc_rr(fiopsd, ioc);
 			}
-			if (fiops_ioc_on_rr(ioc))
-				fiops_del_ioc_rr(fiopsd, ioc);
 		}
 	}
 	return dispatched;
@@ -377,14 +716,20 @@ static int fiops_forced_dispatch(struct fiops_data *fiopsd)
 
 static struct fiops_ioc *fiops_select_ioc(struct fiops_data *fiopsd)
 {
+	struct fiops_group *fiopsg;
 	struct fiops_ioc *ioc;
 	struct fiops_rb_root *service_tree = NULL;
 	int i;
 	struct request *rq;
 
+	/* the group furthest behind its share first, then ioc inside it */
+	fiopsg = fiops_rb_first_group(&fiopsd->group_tree);
+	if (!fiopsg)
+		return NULL;
+
 	for (i = RT_WORKLOAD; i >= IDLE_WORKLOAD; i--) {
-		if (!RB_EMPTY_ROOT(&fiopsd->service_tree[i].rb)) {
-			service_tree = &fiopsd->service_tree[i];
+		if (!RB_EMPTY_ROOT(&fiopsg->service_tree[i].rb)) {
+			service_tree = &fiopsg->service_tree[i];
 			break;
 		}
 	}
@@ -401,6 +746,7 @@ static struct fiops_ioc *fiops_select_ioc(struct fiops_data *fiopsd)
 	 * to be starved, don't delay
 	 */
 	if (!rq_is_sync(rq) && fiopsd->in_flight[1] != 0 &&
+			fiopsd->group_tree.count == 1 &&
 			service_tree->count == 1) {
 		fiops_log_ioc(fiopsd, ioc,
 				"postpone async, in_flight async %d sync %d",
@@ -415,7 +761,10 @@ static void fiops_charge_vios(struct fiops_data *fiopsd,
 	struct fiops_ioc *ioc, u64 vios)
 {
 	struct fiops_rb_root *service_tree = ioc->service_tree;
+	struct fiops_group *fiopsg = ioc->group;
+
 	ioc->vios += vios;
+	fiopsg->vios += fiops_group_scaled_vios(fiopsg, vios);
 
 	fiops_log_ioc(fiopsd, ioc, "charge vios %lld, new vios %lld", vios, ioc->vios);
 
@@ -425,6 +774,9 @@ static void fiops_charge_vios(struct fiops_data *fiopsd,
 		fiops_resort_rr_list(fiopsd, ioc);
 
 	fiops_update_min_vios(service_tree);
+
+	if (!RB_EMPTY_NODE(&fiopsg->rb_node))
+		fiops_group_service_tree_add(fiopsd, fiopsg);
 }
 
 static int fiops_dispatch_requests(struct request_queue *q, int force)
@@ -483,6 +835,63 @@ static void fiops_init_prio_data(struct fiops_ioc *cic)
 	fiops_clear_ioc_prio_changed(cic);
 }
 
+/*
+ * Move ioc to the group its task now belongs to. It starts at the front
+ * of its new group rather than carrying over vios earned in the old one.
+ */
+static void fiops_ioc_set_group(struct fiops_data *fiopsd,
+	struct fiops_ioc *ioc, struct fiops_group *fiopsg)
+{
+	bool on_rr;
+
+	if (ioc->group == fiopsg)
+		return;
+
+	on_rr = fiops_ioc_on_rr(ioc);
+	if (on_rr)
+		fiops_del_ioc_rr(fiopsd, ioc);
+
+	if (ioc->group)
+		fiops_put_group(ioc->group);
+	ioc->group = fiops_ref_get_group(fiopsg);
+	ioc->vios = fiopsg->service_tree[ioc->wl_type].min_vios;
+
+	if (on_rr)
+		fiops_add_ioc_rr(fiopsd, ioc);
+}
+
+static int
+fiops_set_request(struct request_queue *q, struct request *rq, gfp_t gfp_mask)
+{
+	struct fiops_data *fiopsd = q->elevator->elevator_data;
+	struct fiops_ioc *ioc = RQ_CIC(rq);
+	unsigned int changed;
+
+	might_sleep_if(gfp_mask & __GFP_WAIT);
+
+	spin_lock_irq(q->queue_lock);
+
+	changed = icq_get_changed(&ioc->icq);
+	if (unlikely(changed & ICQ_IOPRIO_CHANGED))
+		fiops_mark_ioc_prio_changed(ioc);
+	if (unlikely(!ioc->group || fiops_ioc_group_lookup(ioc) ||
+		     (changed & ICQ_CGROUP_CHANGED))) {
+		struct fiops_group *fiopsg = fiops_get_group(fiopsd, gfp_mask);
+
+		/* park in the root group, look up again on the next request */
+		if (fiopsg)
+			fiops_clear_ioc_group_lookup(ioc);
+		else {
+			fiopsg = &fiopsd->root_group;
+			fiops_mark_ioc_group_lookup(ioc);
+		}
+		fiops_ioc_set_group(fiopsd, ioc, fiopsg);
+	}
+
+	spin_unlock_irq(q->queue_lock);
+	return 0;
+}
+
 static void fiops_insert_request(struct request_queue *q, struct request *rq)
 {
 	struct fiops_ioc *ioc = RQ_CIC(rq);
@@ -597,9 +1006,26 @@ static int fiops_allow_merge(struct request_queue *q, struct request *rq,
 static void fiops_exit_queue(struct elevator_queue *e)
 {
 	struct fiops_data *fiopsd = e->elevator_data;
+	struct request_queue *q = fiopsd->queue;
+	bool wait = false;
 
 	cancel_work_sync(&fiopsd->unplug_work);
 
+	spin_lock_irq(q->queue_lock);
+	fiops_release_groups(fiopsd);
+#ifdef CONFIG_FIOPS_GROUP_IOSCHED
+	/* groups the cgroup side unlinks may still be using fiopsd as key */
+	if (fiopsd->nr_blkcg_linked_grps)
+		wait = true;
+#endif
+	spin_unlock_irq(q->queue_lock);
+
+	if (wait)
+		synchronize_rcu();
+
+#ifdef CONFIG_FIOPS_GROUP_IOSCHED
+	free_percpu(fiopsd->root_group.blkg.stats_cpu);
+#endif
 	kfree(fiopsd);
 }
 
@@ -617,16 +1043,40 @@ static void fiops_kick_queue(struct work_struct *work)
 static void *fiops_init_queue(struct request_queue *q)
 {
 	struct fiops_data *fiopsd;
-	int i;
+	struct fiops_group *fiopsg;
 
 	fiopsd = kzalloc_node(sizeof(*fiopsd), GFP_KERNEL, q->node);
 	if (!fiopsd)
 		return NULL;
 
 	fiopsd->queue = q;
+	fiopsd->group_tree = FIOPS_RB_ROOT;
 
-	for (i = IDLE_WORKLOAD; i <= RT_WORKLOAD; i++)
-		fiopsd->service_tree[i] = FIOPS_RB_ROOT;
+	fiopsg = &fiopsd->root_group;
+	fiops_init_group(fiopsg);
+	fiopsg->weight = BLKIO_WEIGHT_DEFAULT;
+
+#ifdef CONFIG_FIOPS_GROUP_IOSCHED
+	/*
+	 * One reference is dropped when the group list is released on exit,
+	 * the other stays as the root group is embedded in fiopsd.
+	 */
+	fiopsg->ref = 2;
+
+	if (blkio_alloc_blkg_stats(&fiopsg->blkg)) {
+		kfree(fiopsd);
+		return NULL;
+	}
+
+	rcu_read_lock();
+	blkiocg_add_blkio_group(&blkio_root_cgroup, &fiopsg->blkg,
+				(void *)fiopsd, 0, BLKIO_POLICY_FIOPS);
+	rcu_read_unlock();
+	fiopsd->nr_blkcg_linked_grps++;
+	fiopsg->weight = blkcg_get_weight(&blkio_root_cgroup, 0);
+
+	hlist_add_head(&fiopsg->fiopsd_node, &fiopsd->group_list);
+#endif
 
 	INIT_WORK(&fiopsd->unplug_work, fiops_kick_queue);
 
@@ -653,6 +1103,16 @@ static void fiops_init_icq(struct io_cq *icq)
 	fiops_mark_ioc_prio_changed(ioc);
 }
 
+static void fiops_exit_icq(struct io_cq *icq)
+{
+	struct fiops_ioc *ioc = icq_to_cic(icq);
+
+	if (ioc->group) {
+		fiops_put_group(ioc->group);
+		ioc->group = NULL;
+	}
+}
+
 /*
  * sysfs parts below -->
  */
@@ -724,7 +1184,9 @@ static struct elevator_type iosched_fiops = {
 		.elevator_completed_req_fn =	fiops_completed_request,
 		.elevator_former_req_fn =	elv_rb_former_request,
 		.elevator_latter_req_fn =	elv_rb_latter_request,
+		.elevator_set_req_fn =		fiops_set_request,
 		.elevator_init_icq_fn =		fiops_init_icq,
+		.elevator_exit_icq_fn =		fiops_exit_icq,
 		.elevator_init_fn =		fiops_init_queue,
 		.elevator_exit_fn =		fiops_exit_queue,
 	},
@@ -735,13 +1197,36 @@ static struct elevator_type iosched_fiops = {
 	.elevator_owner =	THIS_MODULE,
 };
 
+#ifdef CONFIG_FIOPS_GROUP_IOSCHED
+static struct blkio_policy_type blkio_policy_fiops = {
+	.ops = {
+		.blkio_unlink_group_fn =	fiops_unlink_blkio_group,
+		.blkio_update_group_weight_fn =	fiops_update_blkio_group_weight,
+	},
+	.plid = BLKIO_POLICY_FIOPS,
+};
+#endif
+
 static int __init fiops_init(void)
 {
-	return elv_register(&iosched_fiops);
+	int ret;
+
+	ret = elv_register(&iosched_fiops);
+	if (ret)
+		return ret;
+
+#ifdef CONFIG_FIOPS_GROUP_IOSCHED
+	blkio_policy_register(&blkio_policy_fiops);
+#endif
+
+	return 0;
 }
 
 static void __exit fiops_exit(void)
 {
+#ifdef CONFIG_FIOPS_GROUP_IOSCHED
+	blkio_policy_unregister(&blkio_policy_fiops);
+#endif
 	elv_unregister(&iosched_fiops);
 }
 
@@ -61,9 +61,21 @@ static const struct row_queue_params row_queues_def[] = {
 #define ROW_IDLE_TIME_MSEC 10
 #define ROW_READ_FREQ_MSEC 25
 
+/*
+ * Fixed point running average, weighted 7/8 towards history, same as the
+ * cfq think time estimate.
+ */
+struct row_ewma {
+	u64			total;
+	unsigned long		samples;
+	u64			mean;
+};
+
 struct rowq_idling_data {
-	ktime_t			last_insert_time;
+	ktime_t			last_event_time;
 	bool			begin_idling;
+	/* gap between the queue's last insert/completion and the next insert */
+	struct row_ewma		ttime_us;
 };
 
 struct row_queue {
@@ -89,6 +101,9 @@ struct idling_data {
 	struct hrtimer			hr_timer;
 	struct work_struct		idle_work;
 	enum row_queue_prio		idling_queue_idx;
+
+	/* dispatch to completion time of all requests */
+	struct row_ewma			svc_time_us;
 };
 
 struct starvation_data {
@@ -194,6 +209,38 @@ static inline void __maybe_unused row_dump_reg_and_low_stat(struct row_data *rd)
 	rd->last_update_jiffies = jiffies;
 }
 
+static void row_ewma_add(struct row_ewma *ewma, u64 val)
+{
+	ewma->samples = (7 * ewma->samples + 256) / 8;
+	ewma->total = (7 * ewma->total + 256 * val) >> 3;
+	ewma->mean = div_u64(ewma->total + 128, ewma->samples);
+}
+
+/*
+ * Idling only pays off if the queue's next request is expected before the
+ * device would be done with a request from another queue. freq_ms still
+ * caps the think time that is considered for idling at all.
+ */
+static bool row_rowq_should_idle(struct row_data *rd,
+				 struct row_queue *rqueue)
+{
+	u64 ttime = rqueue->idle_data.ttime_us.mean;
+
+	if (ttime >= rd->rd_idle_data.freq_ms * USEC_PER_MSEC)
+		return false;
+	return ttime < rd->rd_idle_data.svc_time_us.mean;
+}
+
+/* expected think time plus half for jitter, at most idle_time_ms */
+static ktime_t row_idle_window(struct row_data *rd, enum row_queue_prio qnum)
+{
+	u64 window_us = (rd->row_queues[qnum].idle_data.ttime_us.mean * 3) >> 1;
+
+	window_us = min_t(u64, window_us,
+			  rd->rd_idle_data.idle_time_ms * USEC_PER_MSEC);
+	return ns_to_ktime(window_us * NSEC_PER_USEC);
+}
+
 static void kick_queue(struct work_struct *work)
 {
 	struct idling_data *read_data =
@@ -253,7 +300,7 @@ static void row_add_request(struct request_queue *q,
 {
 	struct row_data *rd = (struct row_data *)q->elevator->elevator_data;
 	struct row_queue *rqueue = RQ_ROWQ(rq);
-	s64 diff_ms;
+	s64 diff_us;
 	bool queue_was_empty = list_empty(&rqueue->fifo);
 
 	list_add_tail(&rq->queuelist, &rqueue->fifo);
@@ -279,24 +326,33 @@ static void row_add_request(struct request_queue *q,
 					ROWQ_MAX_PRIO;
 			}
 		}
-		diff_ms = ktime_to_ms(ktime_sub(ktime_get(),
-				rqueue->idle_data.last_insert_time));
-		if (unlikely(diff_ms < 0)) {
-			pr_err("%s(): time delta error: diff_ms < 0",
+		diff_us = ktime_us_delta(ktime_get(),
+				rqueue->idle_data.last_event_time);
+		if (unlikely(diff_us < 0)) {
+			pr_err("%s(): time delta error: diff_us < 0",
 				__func__);
 			rqueue->idle_data.begin_idling = false;
 			return;
 		}
-		if (diff_ms < rd->rd_idle_data.freq_ms) {
+		diff_us = min_t(s64, diff_us,
+				2 * rd->rd_idle_data.freq_ms * USEC_PER_MSEC);
+		row_ewma_add(&rqueue->idle_data.ttime_us, diff_us);
+
+		if (row_rowq_should_idle(rd, rqueue)) {
 			rqueue->idle_data.begin_idling = true;
-			row_log_rowq(rd, rqueue->prio, "Enable idling");
+			row_log_rowq(rd, rqueue->prio,
+				"Enable idling (ttime %lluus svc %lluus)",
+				rqueue->idle_data.ttime_us.mean,
+				rd->rd_idle_data.svc_time_us.mean);
 		} else {
 			rqueue->idle_data.begin_idling = false;
-			row_log_rowq(rd, rqueue->prio, "Disable idling (%ldms)",
-				(long)diff_ms);
+			row_log_rowq(rd, rqueue->prio,
+				"Disable idling (ttime %lluus svc %lluus)",
+				rqueue->idle_data.ttime_us.mean,
+				rd->rd_idle_data.svc_time_us.mean);
 		}
 
-		rqueue->idle_data.last_insert_time = ktime_get();
+		rqueue->idle_data.last_event_time = ktime_get();
 	}
 	if (row_queues_def[rqueue->prio].is_urgent &&
 	    !rd->pending_urgent_rq && !rd->urgent_in_flight) {
@@ -361,6 +417,17 @@ static int row_reinsert_req(struct request_queue *q,
 static void row_completed_req(struct request_queue *q, struct request *rq)
 {
 	struct row_data *rd = q->elevator->elevator_data;
+	struct row_queue *rqueue = RQ_ROWQ(rq);
+	ktime_t now = ktime_get();
+
+	/* dispatch stamp is truncated to unsigned long, wraps harmlessly */
+	if (rq->elv.priv[1])
+		row_ewma_add(&rd->rd_idle_data.svc_time_us,
+			(unsigned long)ktime_to_us(now) -
+			(unsigned long)rq->elv.priv[1]);
+
+	if (rqueue && row_queues_def[rqueue->prio].idling_enabled)
+		rqueue->idle_data.last_event_time = now;
 
 	 if (rq->cmd_flags & REQ_URGENT) {
 		if (!rd->urgent_in_flight) {
@@ -414,6 +481,7 @@ static void row_dispatch_insert(struct row_data *rd, struct request *rq)
 	struct row_queue *rqueue = RQ_ROWQ(rq);
 
 	row_remove_request(rd, rq);
+	rq->elv.priv[1] = (void *)(unsigned long)ktime_to_us(ktime_get());
 	elv_dispatch_sort(rd->dispatch_queue, rq);
 	if (rq->cmd_flags & REQ_URGENT) {
 		WARN_ON(rd->urgent_in_flight);
@@ -516,8 +584,7 @@ check_idling:
 	goto done;
 
 initiate_idling:
-	hrtimer_start(&rd->rd_idle_data.hr_timer,
-		ktime_set(0, rd->rd_idle_data.idle_time_ms * NSEC_PER_MSEC),
+	hrtimer_start(&rd->rd_idle_data.hr_timer, row_idle_window(rd, i),
 		HRTIMER_MODE_REL);
 
 	rd->rd_idle_data.idling_queue_idx = i;
@@ -690,7 +757,7 @@ static void *row_init_queue(struct request_queue *q)
 		rdata->row_queues[i].rdata = rdata;
 		rdata->row_queues[i].prio = i;
 		rdata->row_queues[i].idle_data.begin_idling = false;
-		rdata->row_queues[i].idle_data.last_insert_time =
+		rdata->row_queues[i].idle_data.last_event_time =
 			ktime_set(0, 0);
 	}
 
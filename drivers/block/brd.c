@@ -13,6 +13,7 @@
 #include <linux/moduleparam.h>
 #include <linux/major.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/bio.h>
 #include <linux/highmem.h>
 #include <linux/mutex.h>
@@ -361,6 +362,50 @@ out:
 	bio_endio(bio, err);
 }
 
+static int brd_queue_rq(struct blk_mq_hw_ctx *hctx, struct request *rq)
+{
+	struct brd_device *brd = hctx->queue->queuedata;
+	struct req_iterator iter;
+	struct bio_vec *bvec;
+	sector_t sector;
+	int err = -EIO;
+
+	sector = blk_rq_pos(rq);
+	if (sector + blk_rq_sectors(rq) > get_capacity(brd->brd_disk))
+		goto out;
+
+	if (unlikely(rq->cmd_flags & REQ_DISCARD)) {
+		err = 0;
+		discard_from_brd(brd, sector, blk_rq_bytes(rq));
+		goto out;
+	}
+
+	err = 0;
+	rq_for_each_segment(bvec, rq, iter) {
+		unsigned int len = bvec->bv_len;
+		err = brd_do_bvec(brd, bvec->bv_page, len,
+					bvec->bv_offset, rq_data_dir(rq), sector);
+		if (err)
+			break;
+		sector += len >> SECTOR_SHIFT;
+	}
+
+out:
+	blk_mq_end_io(rq, err);
+	return BLK_MQ_RQ_QUEUE_OK;
+}
+
+static struct blk_mq_ops brd_mq_ops = {
+	.queue_rq	= brd_queue_rq,
+	.map_queue	= blk_mq_map_queue,
+};
+
+static struct blk_mq_reg brd_mq_reg = {
+	.ops		= &brd_mq_ops,
+	.numa_node	= NUMA_NO_NODE,
+	.flags		= BLK_MQ_F_SHOULD_MERGE,
+};
+
 #ifdef CONFIG_BLK_DEV_XIP
 static int brd_direct_access(struct block_device *bdev, sector_t sector,
 			void **kaddr, unsigned long *pfn)
@@ -433,12 +478,21 @@ static int rd_nr;
 int rd_size = CONFIG_BLK_DEV_RAM_SIZE;
 static int max_part;
 static int part_shift;
+static bool rd_mq;
+static int rd_hw_queues = 1;
+static int rd_queue_depth = 64;
 module_param(rd_nr, int, S_IRUGO);
 MODULE_PARM_DESC(rd_nr, "Maximum number of brd devices");
 module_param(rd_size, int, S_IRUGO);
 MODULE_PARM_DESC(rd_size, "Size of each RAM disk in kbytes.");
 module_param(max_part, int, S_IRUGO);
 MODULE_PARM_DESC(max_part, "Maximum number of partitions per RAM disk");
+module_param(rd_mq, bool, S_IRUGO);
+MODULE_PARM_DESC(rd_mq, "Use the multiqueue block layer");
+module_param(rd_hw_queues, int, S_IRUGO);
+MODULE_PARM_DESC(rd_hw_queues, "Number of hardware queues in multiqueue mode");
+module_param(rd_queue_depth, int, S_IRUGO);
+MODULE_PARM_DESC(rd_queue_depth, "Queue depth of each hardware queue in multiqueue mode");
 MODULE_LICENSE("GPL");
 MODULE_ALIAS_BLOCKDEV_MAJOR(RAMDISK_MAJOR);
 MODULE_ALIAS("rd");
@@ -472,10 +526,16 @@ static struct brd_device *brd_alloc(int i)
 	spin_lock_init(&brd->brd_lock);
 	INIT_RADIX_TREE(&brd->brd_pages, GFP_ATOMIC);
 
-	brd->brd_queue = blk_alloc_queue(GFP_KERNEL);
+	if (rd_mq) {
+		brd->brd_queue = blk_mq_init_queue(&brd_mq_reg, brd);
+	} else {
+		brd->brd_queue = blk_alloc_queue(GFP_KERNEL);
+		if (brd->brd_queue)
+			blk_queue_make_request(brd->brd_queue,
+					       brd_make_request);
+	}
 	if (!brd->brd_queue)
 		goto out_free_dev;
-	blk_queue_make_request(brd->brd_queue, brd_make_request);
 	blk_queue_max_hw_sectors(brd->brd_queue, 1024);
 	blk_queue_bounce_limit(brd->brd_queue, BLK_BOUNCE_ANY);
 
@@ -595,6 +655,13 @@ static int __init brd_init(void)
 	if (rd_nr > 1UL << (MINORBITS - part_shift))
 		return -EINVAL;
 
+	if (rd_mq) {
+		brd_mq_reg.nr_hw_queues = clamp_t(int, rd_hw_queues, 1,
+						  nr_cpu_ids);
+		brd_mq_reg.queue_depth = clamp_t(int, rd_queue_depth, 1,
+						 BLK_MQ_MAX_DEPTH);
+	}
+
 	if (rd_nr) {
 		nr = rd_nr;
 		range = rd_nr << part_shift;
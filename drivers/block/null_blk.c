@@ -0,0 +1,623 @@
+/*
+ * Null block device driver
+ *
+ * Completes every request without moving any data, so what is measured is
+ * the cost of the block layer and the I/O scheduler rather than of storage.
+ * Bio based, request based (through the elevator) and multiqueue modes can
+ * be selected, and completions can be inline, from the block softirq or
+ * from an hrtimer after a configurable delay.
+ */
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/sched.h>
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/hrtimer.h>
+#include <linux/llist.h>
+#include <linux/log2.h>
+#include <linux/delay.h>
+#include <linux/wait.h>
+
+struct nullb_cmd {
+	struct llist_node ll_list;
+	struct request *rq;
+	struct bio *bio;
+	unsigned int tag;
+	struct nullb_queue *nq;
+};
+
+struct nullb_queue {
+	unsigned long *tag_map;
+	wait_queue_head_t wait;
+	unsigned int queue_depth;
+
+	struct nullb_cmd *cmds;
+};
+
+struct nullb {
+	struct list_head list;
+	unsigned int index;
+	struct request_queue *q;
+	struct gendisk *disk;
+	spinlock_t lock;
+
+	struct nullb_queue *queues;
+	unsigned int nr_queues;
+};
+
+struct completion_queue {
+	struct llist_head list;
+	struct hrtimer timer;
+};
+
+/* timer completions are batched per submitting cpu */
+static DEFINE_PER_CPU(struct completion_queue, completion_queues);
+
+static LIST_HEAD(nullb_list);
+static DEFINE_MUTEX(lock);
+static int null_major;
+static int nullb_indexes;
+
+enum {
+	NULL_IRQ_NONE		= 0,
+	NULL_IRQ_SOFTIRQ	= 1,
+	NULL_IRQ_TIMER		= 2,
+
+	NULL_Q_BIO		= 0,
+	NULL_Q_RQ		= 1,
+	NULL_Q_MQ		= 2,
+};
+
+static int submit_queues = 1;
+module_param(submit_queues, int, S_IRUGO);
+MODULE_PARM_DESC(submit_queues, "Number of submission queues");
+
+static int queue_mode = NULL_Q_MQ;
+module_param(queue_mode, int, S_IRUGO);
+MODULE_PARM_DESC(queue_mode, "Block interface to use (0=bio,1=rq,2=multiqueue)");
+
+static int gb = 250;
+module_param(gb, int, S_IRUGO);
+MODULE_PARM_DESC(gb, "Size in GB");
+
+static int bs = 512;
+module_param(bs, int, S_IRUGO);
+MODULE_PARM_DESC(bs, "Block size (in bytes)");
+
+static int nr_devices = 2;
+module_param(nr_devices, int, S_IRUGO);
+MODULE_PARM_DESC(nr_devices, "Number of devices to register");
+
+static int irqmode = NULL_IRQ_SOFTIRQ;
+module_param(irqmode, int, S_IRUGO);
+MODULE_PARM_DESC(irqmode, "IRQ completion handler. 0-none, 1-softirq, 2-timer");
+
+static int completion_nsec = 10000;
+module_param(completion_nsec, int, S_IRUGO);
+MODULE_PARM_DESC(completion_nsec, "Time in ns to complete a request in hardware. Default: 10,000ns");
+
+static int hw_queue_depth = 64;
+module_param(hw_queue_depth, int, S_IRUGO);
+MODULE_PARM_DESC(hw_queue_depth, "Queue depth for each hardware queue. Default: 64");
+
+static void put_tag(struct nullb_queue *nq, unsigned int tag)
+{
+	clear_bit_unlock(tag, nq->tag_map);
+	smp_mb__after_clear_bit();
+
+	if (waitqueue_active(&nq->wait))
+		wake_up(&nq->wait);
+}
+
+static unsigned int get_tag(struct nullb_queue *nq)
+{
+	unsigned int tag;
+
+	do {
+		tag = find_first_zero_bit(nq->tag_map, nq->queue_depth);
+		if (tag >= nq->queue_depth)
+			return -1U;
+	} while (test_and_set_bit_lock(tag, nq->tag_map));
+
+	return tag;
+}
+
+static void free_cmd(struct nullb_cmd *cmd)
+{
+	put_tag(cmd->nq, cmd->tag);
+}
+
+static struct nullb_cmd *__alloc_cmd(struct nullb_queue *nq)
+{
+	struct nullb_cmd *cmd;
+	unsigned int tag;
+
+	tag = get_tag(nq);
+	if (tag != -1U) {
+		cmd = &nq->cmds[tag];
+		cmd->tag = tag;
+		cmd->nq = nq;
+		return cmd;
+	}
+
+	return NULL;
+}
+
+static struct nullb_cmd *alloc_cmd(struct nullb_queue *nq, int can_wait)
+{
+	struct nullb_cmd *cmd;
+	DEFINE_WAIT(wait);
+
+	cmd = __alloc_cmd(nq);
+	if (cmd || !can_wait)
+		return cmd;
+
+	do {
+		prepare_to_wait(&nq->wait, &wait, TASK_UNINTERRUPTIBLE);
+		cmd = __alloc_cmd(nq);
+		if (cmd)
+			break;
+
+		io_schedule();
+	} while (1);
+
+	finish_wait(&nq->wait, &wait);
+	return cmd;
+}
+
+static void end_cmd(struct nullb_cmd *cmd)
+{
+	struct request_queue *q;
+	unsigned long flags;
+
+	switch (queue_mode) {
+	case NULL_Q_MQ:
+		blk_mq_end_io(cmd->rq, 0);
+		return;
+	case NULL_Q_RQ:
+		q = cmd->rq->q;
+		INIT_LIST_HEAD(&cmd->rq->queuelist);
+		blk_end_request_all(cmd->rq, 0);
+		free_cmd(cmd);
+
+		/* null_rq_prep_fn stopped the queue when it ran out of tags */
+		if (unlikely(blk_queue_stopped(q))) {
+			spin_lock_irqsave(q->queue_lock, flags);
+			queue_flag_clear(QUEUE_FLAG_STOPPED, q);
+			blk_run_queue_async(q);
+			spin_unlock_irqrestore(q->queue_lock, flags);
+		}
+		return;
+	case NULL_Q_BIO:
+		bio_endio(cmd->bio, 0);
+		break;
+	}
+
+	free_cmd(cmd);
+}
+
+static enum hrtimer_restart null_cmd_timer_expired(struct hrtimer *timer)
+{
+	struct completion_queue *cq;
+	struct llist_node *entry, *next;
+	struct nullb_cmd *cmd;
+
+	cq = container_of(timer, struct completion_queue, timer);
+	while ((entry = llist_del_all(&cq->list)) != NULL) {
+		do {
+			next = entry->next;
+			cmd = container_of(entry, struct nullb_cmd, ll_list);
+			end_cmd(cmd);
+			entry = next;
+		} while (entry);
+	}
+
+	return HRTIMER_NORESTART;
+}
+
+static void null_cmd_end_timer(struct nullb_cmd *cmd)
+{
+	struct completion_queue *cq = &per_cpu(completion_queues, get_cpu());
+
+	cmd->ll_list.next = NULL;
+	if (llist_add(&cmd->ll_list, &cq->list)) {
+		ktime_t kt = ktime_set(0, completion_nsec);
+
+		hrtimer_start(&cq->timer, kt, HRTIMER_MODE_REL);
+	}
+
+	put_cpu();
+}
+
+static void null_softirq_done_fn(struct request *rq)
+{
+	if (queue_mode == NULL_Q_MQ)
+		end_cmd(blk_mq_rq_to_pdu(rq));
+	else
+		end_cmd(rq->special);
+}
+
+static inline void null_handle_cmd(struct nullb_cmd *cmd)
+{
+	/* Complete IO by inline, softirq or timer */
+	switch (irqmode) {
+	case NULL_IRQ_SOFTIRQ:
+		switch (queue_mode) {
+		case NULL_Q_MQ:
+		case NULL_Q_RQ:
+			blk_complete_request(cmd->rq);
+			break;
+		case NULL_Q_BIO:
+			/* bios have no softirq completion path */
+			end_cmd(cmd);
+			break;
+		}
+		break;
+	case NULL_IRQ_NONE:
+		end_cmd(cmd);
+		break;
+	case NULL_IRQ_TIMER:
+		null_cmd_end_timer(cmd);
+		break;
+	}
+}
+
+static struct nullb_queue *nullb_to_queue(struct nullb *nullb)
+{
+	int index = 0;
+
+	if (nullb->nr_queues != 1)
+		index = raw_smp_processor_id() /
+			((nr_cpu_ids + nullb->nr_queues - 1) / nullb->nr_queues);
+
+	return &nullb->queues[index];
+}
+
+static void null_queue_bio(struct request_queue *q, struct bio *bio)
+{
+	struct nullb *nullb = q->queuedata;
+	struct nullb_queue *nq = nullb_to_queue(nullb);
+	struct nullb_cmd *cmd;
+
+	cmd = alloc_cmd(nq, 1);
+	cmd->bio = bio;
+
+	null_handle_cmd(cmd);
+}
+
+static int null_rq_prep_fn(struct request_queue *q, struct request *req)
+{
+	struct nullb *nullb = q->queuedata;
+	struct nullb_queue *nq = nullb_to_queue(nullb);
+	struct nullb_cmd *cmd;
+
+	cmd = alloc_cmd(nq, 0);
+	if (!cmd) {
+		/*
+		 * Stop the queue before trying again, so a command freed in
+		 * between either shows up here or sees the stopped queue.
+		 */
+		blk_stop_queue(q);
+		smp_mb();
+		cmd = alloc_cmd(nq, 0);
+		if (!cmd)
+			return BLKPREP_DEFER;
+		queue_flag_clear(QUEUE_FLAG_STOPPED, q);
+	}
+
+	cmd->rq = req;
+	req->special = cmd;
+	return BLKPREP_OK;
+}
+
+static void null_request_fn(struct request_queue *q)
+{
+	struct request *rq;
+
+	while ((rq = blk_fetch_request(q)) != NULL) {
+		struct nullb_cmd *cmd = rq->special;
+
+		spin_unlock_irq(q->queue_lock);
+		null_handle_cmd(cmd);
+		spin_lock_irq(q->queue_lock);
+	}
+}
+
+static int null_queue_rq(struct blk_mq_hw_ctx *hctx, struct request *rq)
+{
+	struct nullb_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	cmd->rq = rq;
+	cmd->nq = hctx->driver_data;
+
+	null_handle_cmd(cmd);
+	return BLK_MQ_RQ_QUEUE_OK;
+}
+
+static int null_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+			  unsigned int index)
+{
+	struct nullb *nullb = data;
+
+	hctx->driver_data = &nullb->queues[index];
+	return 0;
+}
+
+static struct blk_mq_ops null_mq_ops = {
+	.queue_rq	= null_queue_rq,
+	.map_queue	= blk_mq_map_queue,
+	.init_hctx	= null_init_hctx,
+};
+
+static struct blk_mq_reg null_mq_reg = {
+	.ops		= &null_mq_ops,
+	.queue_depth	= 64,
+	.cmd_size	= sizeof(struct nullb_cmd),
+	.numa_node	= NUMA_NO_NODE,
+	.flags		= BLK_MQ_F_SHOULD_MERGE,
+};
+
+static void null_cleanup_queue(struct nullb_queue *nq)
+{
+	kfree(nq->tag_map);
+	kfree(nq->cmds);
+}
+
+static void cleanup_queues(struct nullb *nullb)
+{
+	int i;
+
+	for (i = 0; i < nullb->nr_queues; i++)
+		null_cleanup_queue(&nullb->queues[i]);
+
+	kfree(nullb->queues);
+}
+
+static bool null_queue_busy(struct nullb_queue *nq)
+{
+	return nq->tag_map &&
+		find_first_bit(nq->tag_map, nq->queue_depth) < nq->queue_depth;
+}
+
+static void null_del_dev(struct nullb *nullb)
+{
+	int i;
+
+	list_del_init(&nullb->list);
+
+	del_gendisk(nullb->disk);
+	blk_cleanup_queue(nullb->q);
+
+	/* bios are not drained by the queue, wait for pending timers */
+	for (i = 0; i < nullb->nr_queues; i++)
+		while (null_queue_busy(&nullb->queues[i]))
+			msleep(10);
+
+	put_disk(nullb->disk);
+	cleanup_queues(nullb);
+	kfree(nullb);
+}
+
+static int null_open(struct block_device *bdev, fmode_t mode)
+{
+	return 0;
+}
+
+static int null_release(struct gendisk *disk, fmode_t mode)
+{
+	return 0;
+}
+
+static const struct block_device_operations null_fops = {
+	.owner =	THIS_MODULE,
+	.open =		null_open,
+	.release =	null_release,
+};
+
+static int setup_commands(struct nullb_queue *nq)
+{
+	int tag_size;
+
+	nq->cmds = kzalloc(nq->queue_depth * sizeof(struct nullb_cmd),
+			   GFP_KERNEL);
+	if (!nq->cmds)
+		return -ENOMEM;
+
+	tag_size = ALIGN(nq->queue_depth, BITS_PER_LONG) / BITS_PER_LONG;
+	nq->tag_map = kzalloc(tag_size * sizeof(unsigned long), GFP_KERNEL);
+	if (!nq->tag_map) {
+		kfree(nq->cmds);
+		nq->cmds = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static int setup_queues(struct nullb *nullb)
+{
+	int i;
+
+	nullb->queues = kzalloc(submit_queues * sizeof(struct nullb_queue),
+				GFP_KERNEL);
+	if (!nullb->queues)
+		return -ENOMEM;
+
+	nullb->nr_queues = submit_queues;
+
+	for (i = 0; i < submit_queues; i++) {
+		struct nullb_queue *nq = &nullb->queues[i];
+
+		init_waitqueue_head(&nq->wait);
+		nq->queue_depth = hw_queue_depth;
+
+		/* the multiqueue core owns the commands in that mode */
+		if (queue_mode == NULL_Q_MQ)
+			continue;
+
+		if (setup_commands(nq)) {
+			cleanup_queues(nullb);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static int null_add_dev(void)
+{
+	struct gendisk *disk;
+	struct nullb *nullb;
+	sector_t size;
+
+	nullb = kzalloc(sizeof(*nullb), GFP_KERNEL);
+	if (!nullb)
+		return -ENOMEM;
+
+	spin_lock_init(&nullb->lock);
+
+	if (setup_queues(nullb))
+		goto err;
+
+	if (queue_mode == NULL_Q_MQ) {
+		null_mq_reg.nr_hw_queues = submit_queues;
+		null_mq_reg.queue_depth = hw_queue_depth;
+
+		nullb->q = blk_mq_init_queue(&null_mq_reg, nullb);
+	} else if (queue_mode == NULL_Q_BIO) {
+		nullb->q = blk_alloc_queue(GFP_KERNEL);
+		if (nullb->q) {
+			blk_queue_make_request(nullb->q, null_queue_bio);
+			nullb->q->queuedata = nullb;
+		}
+	} else {
+		nullb->q = blk_init_queue(null_request_fn, &nullb->lock);
+		if (nullb->q) {
+			blk_queue_prep_rq(nullb->q, null_rq_prep_fn);
+			nullb->q->queuedata = nullb;
+		}
+	}
+	if (!nullb->q)
+		goto queue_fail;
+
+	if (queue_mode != NULL_Q_BIO)
+		blk_queue_softirq_done(nullb->q, null_softirq_done_fn);
+
+	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, nullb->q);
+
+	disk = nullb->disk = alloc_disk(1);
+	if (!disk)
+		goto disk_fail;
+
+	mutex_lock(&lock);
+	list_add_tail(&nullb->list, &nullb_list);
+	nullb->index = nullb_indexes++;
+	mutex_unlock(&lock);
+
+	blk_queue_logical_block_size(nullb->q, bs);
+	blk_queue_physical_block_size(nullb->q, bs);
+
+	size = gb * 1024 * 1024 * 1024ULL;
+	sector_div(size, bs);
+	set_capacity(disk, size * (bs >> 9));
+
+	disk->flags |= GENHD_FL_EXT_DEVT | GENHD_FL_SUPPRESS_PARTITION_INFO;
+	disk->major		= null_major;
+	disk->first_minor	= nullb->index;
+	disk->fops		= &null_fops;
+	disk->private_data	= nullb;
+	disk->queue		= nullb->q;
+	sprintf(disk->disk_name, "nullb%d", nullb->index);
+	add_disk(disk);
+	return 0;
+
+disk_fail:
+	blk_cleanup_queue(nullb->q);
+queue_fail:
+	cleanup_queues(nullb);
+err:
+	kfree(nullb);
+	return -ENOMEM;
+}
+
+static int __init null_init(void)
+{
+	unsigned int i;
+
+	if (bs > PAGE_SIZE || bs < 512 || !is_power_of_2(bs)) {
+		pr_warn("null_blk: invalid block size %d, using 512\n", bs);
+		bs = 512;
+	}
+
+	if (queue_mode < NULL_Q_BIO || queue_mode > NULL_Q_MQ)
+		queue_mode = NULL_Q_MQ;
+	if (irqmode < NULL_IRQ_NONE || irqmode > NULL_IRQ_TIMER)
+		irqmode = NULL_IRQ_SOFTIRQ;
+
+	hw_queue_depth = clamp_t(int, hw_queue_depth, 1, BLK_MQ_MAX_DEPTH);
+
+	if (submit_queues < 1)
+		submit_queues = 1;
+	else if (submit_queues > nr_cpu_ids)
+		submit_queues = nr_cpu_ids;
+
+	/* Initialize a separate list for each CPU for issuing softirqs */
+	for_each_possible_cpu(i) {
+		struct completion_queue *cq = &per_cpu(completion_queues, i);
+
+		init_llist_head(&cq->list);
+
+		if (irqmode != NULL_IRQ_TIMER)
+			continue;
+
+		hrtimer_init(&cq->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		cq->timer.function = null_cmd_timer_expired;
+	}
+
+	null_major = register_blkdev(0, "nullb");
+	if (null_major < 0)
+		return null_major;
+
+	for (i = 0; i < nr_devices; i++) {
+		if (null_add_dev())
+			goto err_dev;
+	}
+
+	pr_info("null: module loaded\n");
+	return 0;
+
+err_dev:
+	mutex_lock(&lock);
+	while (!list_empty(&nullb_list))
+		null_del_dev(list_entry(nullb_list.next, struct nullb, list));
+	mutex_unlock(&lock);
+	unregister_blkdev(null_major, "nullb");
+	return -ENOMEM;
+}
+
+static void __exit null_exit(void)
+{
+	struct nullb *nullb;
+	unsigned int cpu;
+
+	mutex_lock(&lock);
+	while (!list_empty(&nullb_list)) {
+		nullb = list_entry(nullb_list.next, struct nullb, list);
+		null_del_dev(nullb);
+	}
+	mutex_unlock(&lock);
+
+	unregister_blkdev(null_major, "nullb");
+
+	if (irqmode == NULL_IRQ_TIMER)
+		for_each_possible_cpu(cpu)
+			hrtimer_cancel(&per_cpu(completion_queues, cpu).timer);
+}
+
+module_init(null_init);
+module_exit(null_exit);
+
+MODULE_LICENSE("GPL");
@@ -13,12 +13,17 @@
 #include <linux/slab.h>
 #include <linux/wait.h>
 #include <linux/sched.h>
+#include <linux/cpu.h>
+#include <linux/percpu.h>
 
 #include "zcomp.h"
 #include "zcomp_lzo.h"
 #ifdef CONFIG_ZRAM_LZ4_COMPRESS
 #include "zcomp_lz4.h"
 #endif
+#ifdef CONFIG_ZRAM_LZ4HC_COMPRESS
+#include "zcomp_lz4hc.h"
+#endif
 
 /*
  * single zcomp_strm backend
@@ -40,13 +45,28 @@ struct zcomp_strm_multi {
 	int avail_strm;
 	/* list of available strms */
 	struct list_head idle_strm;
+	/* list of all allocated strms, for statistics */
+	struct list_head all_strm;
 	wait_queue_head_t strm_wait;
 };
 
+/*
+ * per-cpu zcomp_strm backend
+ */
+struct zcomp_strm_percpu {
+	/* stream of each online cpu, NULL for offline cpus */
+	struct zcomp_strm * __percpu *strm;
+	struct zcomp *comp;
+	struct notifier_block notifier;
+};
+
 static struct zcomp_backend *backends[] = {
 	&zcomp_lzo,
 #ifdef CONFIG_ZRAM_LZ4_COMPRESS
 	&zcomp_lz4,
+#endif
+#ifdef CONFIG_ZRAM_LZ4HC_COMPRESS
+	&zcomp_lz4hc,
 #endif
 	NULL
 };
@@ -76,7 +96,7 @@ static void zcomp_strm_free(struct zcomp *comp, struct zcomp_strm *zstrm)
  */
 static struct zcomp_strm *zcomp_strm_alloc(struct zcomp *comp)
 {
-	struct zcomp_strm *zstrm = kmalloc(sizeof(*zstrm), GFP_KERNEL);
+	struct zcomp_strm *zstrm = kzalloc(sizeof(*zstrm), GFP_KERNEL);
 	if (!zstrm)
 		return NULL;
 
@@ -101,6 +121,7 @@ static struct zcomp_strm *zcomp_strm_multi_find(struct zcomp *comp)
 {
 	struct zcomp_strm_multi *zs = comp->stream;
 	struct zcomp_strm *zstrm;
+	bool waited = false;
 
 	while (1) {
 		spin_lock(&zs->strm_lock);
@@ -109,11 +130,15 @@ static struct zcomp_strm *zcomp_strm_multi_find(struct zcomp *comp)
 					struct zcomp_strm, list);
 			list_del(&zstrm->list);
 			spin_unlock(&zs->strm_lock);
+			zstrm->found++;
+			if (waited)
+				zstrm->contended++;
 			return zstrm;
 		}
 		/* zstrm streams limit reached, wait for idle stream */
 		if (zs->avail_strm >= zs->max_strm) {
 			spin_unlock(&zs->strm_lock);
+			waited = true;
 			wait_event(zs->strm_wait, !list_empty(&zs->idle_strm));
 			continue;
 		}
@@ -126,11 +151,18 @@ static struct zcomp_strm *zcomp_strm_multi_find(struct zcomp *comp)
 			spin_lock(&zs->strm_lock);
 			zs->avail_strm--;
 			spin_unlock(&zs->strm_lock);
+			waited = true;
 			wait_event(zs->strm_wait, !list_empty(&zs->idle_strm));
 			continue;
 		}
+		spin_lock(&zs->strm_lock);
+		list_add(&zstrm->node, &zs->all_strm);
+		spin_unlock(&zs->strm_lock);
 		break;
 	}
+	zstrm->found++;
+	if (waited)
+		zstrm->contended++;
 	return zstrm;
 }
 
@@ -148,6 +180,7 @@ static void zcomp_strm_multi_release(struct zcomp *comp, struct zcomp_strm *zstr
 	}
 
 	zs->avail_strm--;
+	list_del(&zstrm->node);
 	spin_unlock(&zs->strm_lock);
 	zcomp_strm_free(comp, zstrm);
 }
@@ -168,6 +201,7 @@ static bool zcomp_strm_multi_set_max_streams(struct zcomp *comp, int num_strm)
 		zstrm = list_entry(zs->idle_strm.next,
 				struct zcomp_strm, list);
 		list_del(&zstrm->list);
+		list_del(&zstrm->node);
 		zcomp_strm_free(comp, zstrm);
 		zs->avail_strm--;
 	}
@@ -175,6 +209,21 @@ static bool zcomp_strm_multi_set_max_streams(struct zcomp *comp, int num_strm)
 	return true;
 }
 
+static ssize_t zcomp_strm_multi_stat_show(struct zcomp *comp, char *buf)
+{
+	struct zcomp_strm_multi *zs = comp->stream;
+	struct zcomp_strm *zstrm;
+	ssize_t sz = 0;
+	int i = 0;
+
+	spin_lock(&zs->strm_lock);
+	list_for_each_entry(zstrm, &zs->all_strm, node)
+		sz += scnprintf(buf + sz, PAGE_SIZE - sz, "%d %llu %llu\n",
+				i++, zstrm->found, zstrm->contended);
+	spin_unlock(&zs->strm_lock);
+	return sz;
+}
+
 static void zcomp_strm_multi_destroy(struct zcomp *comp)
 {
 	struct zcomp_strm_multi *zs = comp->stream;
@@ -198,6 +247,7 @@ static int zcomp_strm_multi_create(struct zcomp *comp, int max_strm)
 	comp->strm_find = zcomp_strm_multi_find;
 	comp->strm_release = zcomp_strm_multi_release;
 	comp->set_max_streams = zcomp_strm_multi_set_max_streams;
+	comp->stat_show = zcomp_strm_multi_stat_show;
 	zs = kmalloc(sizeof(struct zcomp_strm_multi), GFP_KERNEL);
 	if (!zs)
 		return -ENOMEM;
@@ -205,6 +255,7 @@ static int zcomp_strm_multi_create(struct zcomp *comp, int max_strm)
 	comp->stream = zs;
 	spin_lock_init(&zs->strm_lock);
 	INIT_LIST_HEAD(&zs->idle_strm);
+	INIT_LIST_HEAD(&zs->all_strm);
 	init_waitqueue_head(&zs->strm_wait);
 	zs->max_strm = max_strm;
 	zs->avail_strm = 1;
@@ -215,13 +266,19 @@ static int zcomp_strm_multi_create(struct zcomp *comp, int max_strm)
 		return -ENOMEM;
 	}
 	list_add(&zstrm->list, &zs->idle_strm);
+	list_add(&zstrm->node, &zs->all_strm);
 	return 0;
 }
 
 static struct zcomp_strm *zcomp_strm_single_find(struct zcomp *comp)
 {
 	struct zcomp_strm_single *zs = comp->stream;
-	mutex_lock(&zs->strm_lock);
+
+	if (!mutex_trylock(&zs->strm_lock)) {
+		mutex_lock(&zs->strm_lock);
+		zs->zstrm->contended++;
+	}
+	zs->zstrm->found++;
 	return zs->zstrm;
 }
 
@@ -238,6 +295,14 @@ static bool zcomp_strm_single_set_max_streams(struct zcomp *comp, int num_strm)
 	return false;
 }
 
+static ssize_t zcomp_strm_single_stat_show(struct zcomp *comp, char *buf)
+{
+	struct zcomp_strm_single *zs = comp->stream;
+
+	return scnprintf(buf, PAGE_SIZE, "0 %llu %llu\n",
+			zs->zstrm->found, zs->zstrm->contended);
+}
+
 static void zcomp_strm_single_destroy(struct zcomp *comp)
 {
 	struct zcomp_strm_single *zs = comp->stream;
@@ -253,6 +318,7 @@ static int zcomp_strm_single_create(struct zcomp *comp)
 	comp->strm_find = zcomp_strm_single_find;
 	comp->strm_release = zcomp_strm_single_release;
 	comp->set_max_streams = zcomp_strm_single_set_max_streams;
+	comp->stat_show = zcomp_strm_single_stat_show;
 	zs = kmalloc(sizeof(struct zcomp_strm_single), GFP_KERNEL);
 	if (!zs)
 		return -ENOMEM;
@@ -267,6 +333,136 @@ static int zcomp_strm_single_create(struct zcomp *comp)
 	return 0;
 }
 
+/*
+ * Each online cpu owns a stream, which is taken with preemption disabled.
+ * Callers must not sleep until zcomp_strm_release().
+ */
+static struct zcomp_strm *zcomp_strm_percpu_find(struct zcomp *comp)
+{
+	struct zcomp_strm_percpu *zs = comp->stream;
+	struct zcomp_strm *zstrm;
+
+	zstrm = *get_cpu_ptr(zs->strm);
+	zstrm->found++;
+	return zstrm;
+}
+
+static void zcomp_strm_percpu_release(struct zcomp *comp,
+		struct zcomp_strm *zstrm)
+{
+	struct zcomp_strm_percpu *zs = comp->stream;
+	put_cpu_ptr(zs->strm);
+}
+
+static bool zcomp_strm_percpu_set_max_streams(struct zcomp *comp, int num_strm)
+{
+	/* number of streams follows the number of online cpus */
+	return false;
+}
+
+static ssize_t zcomp_strm_percpu_stat_show(struct zcomp *comp, char *buf)
+{
+	struct zcomp_strm_percpu *zs = comp->stream;
+	struct zcomp_strm *zstrm;
+	ssize_t sz = 0;
+	int cpu;
+
+	get_online_cpus();
+	for_each_online_cpu(cpu) {
+		zstrm = *per_cpu_ptr(zs->strm, cpu);
+		if (!zstrm)
+			continue;
+		sz += scnprintf(buf + sz, PAGE_SIZE - sz, "%d %llu\n",
+				cpu, zstrm->found);
+	}
+	put_online_cpus();
+	return sz;
+}
+
+static int zcomp_strm_percpu_notifier(struct notifier_block *nb,
+		unsigned long action, void *pcpu)
+{
+	int cpu = (long)pcpu;
+	struct zcomp_strm_percpu *zs;
+	struct zcomp_strm **pstrm;
+
+	zs = container_of(nb, struct zcomp_strm_percpu, notifier);
+	pstrm = per_cpu_ptr(zs->strm, cpu);
+
+	switch (action & ~CPU_TASKS_FROZEN) {
+	case CPU_UP_PREPARE:
+		/* cpu may have come up while zcomp_strm_percpu_create() ran */
+		if (*pstrm)
+			break;
+		*pstrm = zcomp_strm_alloc(zs->comp);
+		if (!*pstrm)
+			return notifier_from_errno(-ENOMEM);
+		break;
+	case CPU_DEAD:
+	case CPU_UP_CANCELED:
+		if (*pstrm) {
+			zcomp_strm_free(zs->comp, *pstrm);
+			*pstrm = NULL;
+		}
+		break;
+	}
+
+	return NOTIFY_OK;
+}
+
+static void zcomp_strm_percpu_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm_percpu *zs = comp->stream;
+	int cpu;
+
+	unregister_cpu_notifier(&zs->notifier);
+	for_each_possible_cpu(cpu)
+		zcomp_strm_percpu_notifier(&zs->notifier, CPU_DEAD,
+				(void *)(long)cpu);
+	free_percpu(zs->strm);
+	kfree(zs);
+}
+
+static int zcomp_strm_percpu_create(struct zcomp *comp)
+{
+	struct zcomp_strm_percpu *zs;
+	int cpu, ret = 0;
+
+	comp->destroy = zcomp_strm_percpu_destroy;
+	comp->strm_find = zcomp_strm_percpu_find;
+	comp->strm_release = zcomp_strm_percpu_release;
+	comp->set_max_streams = zcomp_strm_percpu_set_max_streams;
+	comp->stat_show = zcomp_strm_percpu_stat_show;
+	zs = kzalloc(sizeof(struct zcomp_strm_percpu), GFP_KERNEL);
+	if (!zs)
+		return -ENOMEM;
+
+	zs->strm = alloc_percpu(struct zcomp_strm *);
+	if (!zs->strm) {
+		kfree(zs);
+		return -ENOMEM;
+	}
+	zs->comp = comp;
+	zs->notifier.notifier_call = zcomp_strm_percpu_notifier;
+	comp->stream = zs;
+
+	register_cpu_notifier(&zs->notifier);
+	get_online_cpus();
+	for_each_online_cpu(cpu) {
+		ret = zcomp_strm_percpu_notifier(&zs->notifier, CPU_UP_PREPARE,
+				(void *)(long)cpu);
+		if (notifier_to_errno(ret))
+			break;
+	}
+	put_online_cpus();
+
+	if (notifier_to_errno(ret)) {
+		zcomp_strm_percpu_destroy(comp);
+		return notifier_to_errno(ret);
+	}
+	return 0;
+}
+
 /* show available compressors */
 ssize_t zcomp_available_show(const char *comp, char *buf)
 {
@@ -291,6 +487,15 @@ bool zcomp_set_max_streams(struct zcomp *comp, int num_strm)
 	return comp->set_max_streams(comp, num_strm);
 }
 
+/*
+ * show per-stream "<id> <found> <contended>" usage statistics, per-cpu
+ * streams are never contended and only report "<cpu> <found>"
+ */
+ssize_t zcomp_stat_show(struct zcomp *comp, char *buf)
+{
+	return comp->stat_show(comp, buf);
+}
+
 struct zcomp_strm *zcomp_strm_find(struct zcomp *comp)
 {
 	return comp->strm_find(comp);
@@ -326,11 +531,16 @@ void zcomp_destroy(struct zcomp *comp)
  * backend pointer or ERR_PTR if things went bad. ERR_PTR(-EINVAL)
  * if requested algorithm is not supported, ERR_PTR(-ENOMEM) in
  * case of allocation error.
+ *
+ * @percpu selects one stream per online cpu and makes @max_strm
+ * meaningless; otherwise a single or multi stream backend is used
+ * depending on @max_strm.
  */
-struct zcomp *zcomp_create(const char *compress, int max_strm)
+struct zcomp *zcomp_create(const char *compress, int max_strm, bool percpu)
 {
 	struct zcomp *comp;
 	struct zcomp_backend *backend;
+	int ret;
 
 	backend = find_backend(compress);
 	if (!backend)
@@ -341,13 +551,15 @@ struct zcomp *zcomp_create(const char *compress, int max_strm)
 		return ERR_PTR(-ENOMEM);
 
 	comp->backend = backend;
-	if (max_strm > 1)
-		zcomp_strm_multi_create(comp, max_strm);
+	if (percpu)
+		ret = zcomp_strm_percpu_create(comp);
+	else if (max_strm > 1)
+		ret = zcomp_strm_multi_create(comp, max_strm);
 	else
-		zcomp_strm_single_create(comp);
-	if (!comp->stream) {
+		ret = zcomp_strm_single_create(comp);
+	if (ret) {
 		kfree(comp);
-		return ERR_PTR(-ENOMEM);
+		return ERR_PTR(ret);
 	}
 	return comp;
 }
@@ -23,6 +23,15 @@ struct zcomp_strm {
 	void *private;
 	/* used in multi stream backend, protected by backend strm_lock */
 	struct list_head list;
+	/* all streams of multi stream backend, protected by strm_lock */
+	struct list_head node;
+	/*
+	 * Usage statistics, only updated by the current owner of the
+	 * stream: number of times the stream was handed out and number
+	 * of times the caller had to wait for it
+	 */
+	u64 found;
+	u64 contended;
 };
 
 /* static compression backend */
@@ -47,12 +56,13 @@ struct zcomp {
 	struct zcomp_strm *(*strm_find)(struct zcomp *comp);
 	void (*strm_release)(struct zcomp *comp, struct zcomp_strm *zstrm);
 	bool (*set_max_streams)(struct zcomp *comp, int num_strm);
+	ssize_t (*stat_show)(struct zcomp *comp, char *buf);
 	void (*destroy)(struct zcomp *comp);
 };
 
 ssize_t zcomp_available_show(const char *comp, char *buf);
 
-struct zcomp *zcomp_create(const char *comp, int max_strm);
+struct zcomp *zcomp_create(const char *comp, int max_strm, bool percpu);
 void zcomp_destroy(struct zcomp *comp);
 
 struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
@@ -65,4 +75,5 @@ int zcomp_decompress(struct zcomp *comp, const unsigned char *src,
 		size_t src_len, unsigned char *dst);
 
 bool zcomp_set_max_streams(struct zcomp *comp, int num_strm);
+ssize_t zcomp_stat_show(struct zcomp *comp, char *buf);
 #endif /* _ZCOMP_H_ */
@@ -0,0 +1,148 @@
+/*
+ * Same content page deduplication for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zram_drv.h"
+
+static struct hlist_bl_head *zram_dedup_bucket(struct zram_meta *meta,
+		u32 checksum)
+{
+	return &meta->dedup_table[checksum & meta->dedup_mask];
+}
+
+u32 zram_dedup_checksum(unsigned char *mem)
+{
+	return jhash2((u32 *)mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+/* compare the object of @entry with @mem, using @buf to decompress it */
+static bool zram_dedup_match(struct zram *zram, struct zram_dedup_entry *entry,
+		unsigned char *mem, unsigned char *buf)
+{
+	struct zram_meta *meta = zram->meta;
+	unsigned char *cmem;
+	bool match = false;
+
+	cmem = zs_map_object(meta->mem_pool, entry->handle, ZS_MM_RO);
+	if (entry->len == PAGE_SIZE)
+		match = !memcmp(cmem, mem, PAGE_SIZE);
+	else if (!zcomp_decompress(zram->comp, cmem, entry->len, buf))
+		match = !memcmp(buf, mem, PAGE_SIZE);
+	zs_unmap_object(meta->mem_pool, entry->handle);
+
+	return match;
+}
+
+/*
+ * Look up a stored page with the same content as @mem. @buf must be able
+ * to hold a decompressed page. On success a reference to the returned
+ * entry is taken on behalf of the caller's slot. Does not sleep.
+ */
+struct zram_dedup_entry *zram_dedup_find(struct zram *zram,
+		unsigned char *mem, u32 checksum, unsigned char *buf)
+{
+	struct hlist_bl_head *head = zram_dedup_bucket(zram->meta, checksum);
+	struct hlist_bl_node *pos;
+	struct zram_dedup_entry *entry;
+
+	hlist_bl_lock(head);
+	hlist_bl_for_each_entry(entry, pos, head, node) {
+		if (entry->checksum != checksum)
+			continue;
+		if (!zram_dedup_match(zram, entry, mem, buf))
+			continue;
+
+		entry->refcount++;
+		hlist_bl_unlock(head);
+		atomic64_add(entry->len, &zram->stats.dedup_saved_bytes);
+		return entry;
+	}
+	hlist_bl_unlock(head);
+
+	return NULL;
+}
+
+/*
+ * Make a freshly stored object available for deduplication. Returns NULL
+ * if no entry could be allocated; the caller then keeps the plain handle.
+ */
+struct zram_dedup_entry *zram_dedup_insert(struct zram *zram,
+		unsigned long handle, size_t len, u32 checksum)
+{
+	struct hlist_bl_head *head = zram_dedup_bucket(zram->meta, checksum);
+	struct zram_dedup_entry *entry;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO | __GFP_NOWARN);
+	if (!entry)
+		return NULL;
+
+	entry->handle = handle;
+	entry->len = len;
+	entry->checksum = checksum;
+	entry->refcount = 1;
+
+	hlist_bl_lock(head);
+	hlist_bl_add_head(&entry->node, head);
+	hlist_bl_unlock(head);
+
+	return entry;
+}
+
+/* drop a slot's reference, freeing the object with the last one */
+void zram_dedup_put(struct zram *zram, struct zram_dedup_entry *entry)
+{
+	struct zram_meta *meta = zram->meta;
+	struct hlist_bl_head *head = zram_dedup_bucket(meta, entry->checksum);
+
+	hlist_bl_lock(head);
+	if (--entry->refcount) {
+		hlist_bl_unlock(head);
+		atomic64_sub(entry->len, &zram->stats.dedup_saved_bytes);
+		return;
+	}
+	hlist_bl_del(&entry->node);
+	hlist_bl_unlock(head);
+
+	zs_free(meta->mem_pool, entry->handle);
+	atomic64_sub(entry->len, &zram->stats.compr_data_size);
+	kfree(entry);
+}
+
+int zram_dedup_init(struct zram_meta *meta, size_t num_pages)
+{
+	size_t nr_buckets;
+
+	/* aim for a handful of stored pages per bucket */
+	nr_buckets = roundup_pow_of_two(max_t(size_t, num_pages / 4, 1));
+	meta->dedup_table = vzalloc(nr_buckets * sizeof(*meta->dedup_table));
+	if (!meta->dedup_table)
+		return -ENOMEM;
+
+	meta->dedup_mask = nr_buckets - 1;
+	return 0;
+}
+
+void zram_dedup_fini(struct zram_meta *meta)
+{
+	vfree(meta->dedup_table);
+	meta->dedup_table = NULL;
+}
+
+bool zram_dedup_enabled(struct zram_meta *meta)
+{
+	return meta->dedup_table != NULL;
+}
@@ -0,0 +1,66 @@
+/*
+ * Same content page deduplication for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ */
+
+#ifndef _ZRAM_DEDUP_H_
+#define _ZRAM_DEDUP_H_
+
+#include <linux/list_bl.h>
+
+struct zram;
+struct zram_meta;
+
+/*
+ * One compressed object shared by all slots holding the same content.
+ * Slots flagged ZRAM_DEDUP store a pointer to it in table[index].handle.
+ */
+struct zram_dedup_entry {
+	struct hlist_bl_node node;
+	unsigned long handle;	/* zs_pool handle of the compressed object */
+	size_t len;		/* compressed size */
+	u32 checksum;		/* checksum of the uncompressed page */
+	unsigned long refcount;	/* protected by the hash bucket lock */
+};
+
+#ifdef CONFIG_ZRAM_DEDUP
+u32 zram_dedup_checksum(unsigned char *mem);
+struct zram_dedup_entry *zram_dedup_find(struct zram *zram,
+		unsigned char *mem, u32 checksum, unsigned char *buf);
+struct zram_dedup_entry *zram_dedup_insert(struct zram *zram,
+		unsigned long handle, size_t len, u32 checksum);
+void zram_dedup_put(struct zram *zram, struct zram_dedup_entry *entry);
+
+int zram_dedup_init(struct zram_meta *meta, size_t num_pages);
+void zram_dedup_fini(struct zram_meta *meta);
+bool zram_dedup_enabled(struct zram_meta *meta);
+#else
+static inline u32 zram_dedup_checksum(unsigned char *mem) { return 0; }
+static inline struct zram_dedup_entry *zram_dedup_find(struct zram *zram,
+		unsigned char *mem, u32 checksum, unsigned char *buf)
+{
+	return NULL;
+}
+static inline struct zram_dedup_entry *zram_dedup_insert(struct zram *zram,
+		unsigned long handle, size_t len, u32 checksum)
+{
+	return NULL;
+}
+static inline void zram_dedup_put(struct zram *zram,
+		struct zram_dedup_entry *entry) { }
+
+static inline int zram_dedup_init(struct zram_meta *meta, size_t num_pages)
+{
+	return 0;
+}
+static inline void zram_dedup_fini(struct zram_meta *meta) { }
+static inline bool zram_dedup_enabled(struct zram_meta *meta) { return false; }
+#endif
+
+#endif /* _ZRAM_DEDUP_H_ */
@@ -26,6 +26,7 @@
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
@@ -33,12 +34,18 @@
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 #include <linux/err.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/uaccess.h>
 
 #include "zram_drv.h"
 
 /* Globals */
 static int zram_major;
 static struct zram *zram_devices;
+/* runs parallel compression of large write bios */
+static struct workqueue_struct *zram_wq;
 
 /* Module params (documentation at end) */
 static unsigned int num_devices = 1;
@@ -59,6 +66,18 @@ static inline int init_done(struct zram *zram)
 	return zram->meta != NULL;
 }
 
+/* pin meta for I/O, fails if the device is not (or no longer) initialised */
+static inline bool zram_meta_get(struct zram *zram)
+{
+	return atomic_inc_not_zero(&zram->refcount);
+}
+
+static inline void zram_meta_put(struct zram *zram)
+{
+	if (atomic_dec_and_test(&zram->refcount))
+		wake_up(&zram->io_done);
+}
+
 static inline struct zram *dev_to_zram(struct device *dev)
 {
 	return (struct zram *)dev_to_disk(dev)->private_data;
@@ -109,6 +128,40 @@ static ssize_t mem_used_total_show(struct device *dev,
 	return scnprintf(buf, PAGE_SIZE, "%llu\n", val);
 }
 
+static ssize_t pages_compacted_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zs_pool_stats pool_stats = { 0 };
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_meta *meta = zram->meta;
+
+	down_read(&zram->init_lock);
+	if (init_done(zram))
+		zs_pool_stats(meta->mem_pool, &pool_stats);
+	up_read(&zram->init_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%lu\n", pool_stats.pages_compacted);
+}
+
+/* move objects out of sparsely used zspages and free them */
+static ssize_t compact_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_meta *meta = zram->meta;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		up_read(&zram->init_lock);
+		return -EINVAL;
+	}
+
+	zs_compact(meta->mem_pool);
+	up_read(&zram->init_lock);
+
+	return len;
+}
+
 static ssize_t max_comp_streams_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -151,6 +204,116 @@ out:
 	return ret;
 }
 
+static ssize_t percpu_comp_streams_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	bool val;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	val = zram->percpu_comp_streams;
+	up_read(&zram->init_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", val);
+}
+
+static ssize_t percpu_comp_streams_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int val;
+	struct zram *zram = dev_to_zram(dev);
+	int ret;
+
+	ret = kstrtoint(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		up_write(&zram->init_lock);
+		pr_info("Can't change stream backend for initialized device\n");
+		return -EBUSY;
+	}
+	zram->percpu_comp_streams = !!val;
+	up_write(&zram->init_lock);
+	return len;
+}
+
+static ssize_t use_dedup_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	bool val;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	val = zram->use_dedup;
+	up_read(&zram->init_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", val);
+}
+
+static ssize_t use_dedup_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int val;
+	struct zram *zram = dev_to_zram(dev);
+	int ret;
+
+	ret = kstrtoint(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+	if (val && !IS_ENABLED(CONFIG_ZRAM_DEDUP))
+		return -EINVAL;
+
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		up_write(&zram->init_lock);
+		pr_info("Can't change dedup for initialized device\n");
+		return -EBUSY;
+	}
+	zram->use_dedup = !!val;
+	up_write(&zram->init_lock);
+	return len;
+}
+
+static ssize_t parallel_threshold_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n",
+			ACCESS_ONCE(zram->parallel_threshold));
+}
+
+static ssize_t parallel_threshold_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	unsigned int val;
+	struct zram *zram = dev_to_zram(dev);
+	int ret;
+
+	ret = kstrtouint(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+
+	ACCESS_ONCE(zram->parallel_threshold) = val;
+	return len;
+}
+
+static ssize_t comp_streams_stat_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	ssize_t sz = 0;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	if (init_done(zram))
+		sz = zcomp_stat_show(zram->comp, buf);
+	up_read(&zram->init_lock);
+
+	return sz;
+}
+
 static ssize_t comp_algorithm_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -179,6 +342,39 @@ static ssize_t comp_algorithm_store(struct device *dev,
 	return len;
 }
 
+static ssize_t recomp_algorithm_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	size_t sz;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	sz = zcomp_available_show(zram->recomp_compressor, buf);
+	up_read(&zram->init_lock);
+
+	return sz;
+}
+
+static ssize_t recomp_algorithm_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		up_write(&zram->init_lock);
+		pr_info("Can't change algorithm for initialized device\n");
+		return -EBUSY;
+	}
+	/* "none" disables recompression */
+	if (sysfs_streq(buf, "none"))
+		zram->recomp_compressor[0] = '\0';
+	else
+		strlcpy(zram->recomp_compressor, buf,
+				sizeof(zram->recomp_compressor));
+	up_write(&zram->init_lock);
+	return len;
+}
+
 /* flag operations needs meta->tb_lock */
 static int zram_test_flag(struct zram_meta *meta, u32 index,
 			enum zram_pageflags flag)
@@ -198,6 +394,19 @@ static void zram_clear_flag(struct zram_meta *meta, u32 index,
 	meta->table[index].value &= ~BIT(flag);
 }
 
+/* zs_pool handle of the object stored at @index, 0 if none */
+static unsigned long zram_get_handle(struct zram_meta *meta, u32 index)
+{
+	unsigned long handle = meta->table[index].handle;
+
+	if (zram_test_flag(meta, index, ZRAM_SAME) ||
+			zram_test_flag(meta, index, ZRAM_WB))
+		return 0;
+	if (handle && zram_test_flag(meta, index, ZRAM_DEDUP))
+		handle = ((struct zram_dedup_entry *)handle)->handle;
+	return handle;
+}
+
 static size_t zram_get_obj_size(struct zram_meta *meta, u32 index)
 {
 	return meta->table[index].value & (BIT(ZRAM_FLAG_SHIFT) - 1);
@@ -211,6 +420,22 @@ static void zram_set_obj_size(struct zram_meta *meta,
 	meta->table[index].value = (flags << ZRAM_FLAG_SHIFT) | size;
 }
 
+/* true if something is stored at @index, in memory or on backing device */
+static bool zram_allocated(struct zram_meta *meta, u32 index)
+{
+	return meta->table[index].handle ||
+		zram_test_flag(meta, index, ZRAM_SAME);
+}
+
+/* the page at @index was read or written, needs the slot lock */
+static void zram_accessed(struct zram_meta *meta, u32 index)
+{
+	zram_clear_flag(meta, index, ZRAM_IDLE);
+#ifdef CONFIG_ZRAM_MEMORY_TRACKING
+	meta->table[index].ac_time = jiffies;
+#endif
+}
+
 static inline int is_partial_io(struct bio_vec *bvec)
 {
 	return bvec->bv_len != PAGE_SIZE;
@@ -242,15 +467,16 @@ static inline int valid_io_request(struct zram *zram, struct bio *bio)
 
 static void zram_meta_free(struct zram_meta *meta)
 {
+	zram_dedup_fini(meta);
 	zs_destroy_pool(meta->mem_pool);
 	vfree(meta->table);
 	kfree(meta);
 }
 
-static struct zram_meta *zram_meta_alloc(u64 disksize)
+static struct zram_meta *zram_meta_alloc(const char *pool_name, u64 disksize)
 {
 	size_t num_pages;
-	struct zram_meta *meta = kmalloc(sizeof(*meta), GFP_KERNEL);
+	struct zram_meta *meta = kzalloc(sizeof(*meta), GFP_KERNEL);
 	if (!meta)
 		goto out;
 
@@ -261,7 +487,7 @@ static struct zram_meta *zram_meta_alloc(u64 disksize)
 		goto free_meta;
 	}
 
-	meta->mem_pool = zs_create_pool(GFP_NOIO | __GFP_HIGHMEM);
+	meta->mem_pool = zs_create_pool(pool_name, GFP_NOIO | __GFP_HIGHMEM);
 	if (!meta->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		goto free_table;
@@ -285,31 +511,58 @@ static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
 	*offset = (*offset + bvec->bv_len) % PAGE_SIZE;
 }
 
-static int page_zero_filled(void *ptr)
+/* check if the page is a single repeated word, returned in @element */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
+	unsigned long val;
 
 	page = (unsigned long *)ptr;
+	val = page[0];
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != val)
 			return 0;
 	}
 
+	*element = val;
 	return 1;
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+static void zram_fill_page(void *ptr, unsigned long element)
+{
+	unsigned int pos;
+	unsigned long *page;
+
+	if (!element) {
+		clear_page(ptr);
+		return;
+	}
+
+	page = (unsigned long *)ptr;
+	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++)
+		page[pos] = element;
+}
+
+static void handle_same_page(struct bio_vec *bvec, int offset,
+			unsigned long element)
 {
 	struct page *page = bvec->bv_page;
-	void *user_mem;
+	unsigned char *user_mem;
+	unsigned int i;
 
 	user_mem = kmap_atomic(page);
-	if (is_partial_io(bvec))
+	if (!is_partial_io(bvec)) {
+		zram_fill_page(user_mem, element);
+	} else if (!element) {
 		memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
-	else
-		clear_page(user_mem);
+	} else {
+		/* keep the word phase of the zram page, @offset is in it */
+		for (i = 0; i < bvec->bv_len; i++)
+			user_mem[bvec->bv_offset + i] = ((unsigned char *)
+				&element)[(offset + i) % sizeof(element)];
+	}
 	kunmap_atomic(user_mem);
 
 	flush_dcache_page(page);
@@ -317,97 +570,492 @@ static void handle_zero_page(struct bio_vec *bvec)
 
 
 /*
- * To protect concurrent access to the same index entry,
- * caller should hold this table index entry's bit_spinlock to
- * indicate this index entry is accessing.
+ * Completion tracking of a bio whose pages are partly read asynchronously
+ * from the backing device: the bio is ended once the last reference,
+ * held by __zram_make_request() and by every backing device read, is gone.
  */
-static void zram_free_page(struct zram *zram, size_t index)
-{
-	struct zram_meta *meta = zram->meta;
-	unsigned long handle = meta->table[index].handle;
+struct zram_bio_ctx {
+	struct zram *zram;	/* pinned until the bio is ended */
+	struct bio *parent;
+	atomic_t pending;
+	int error;
+};
 
-	if (unlikely(!handle)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(meta, index, ZRAM_ZERO)) {
-			zram_clear_flag(meta, index, ZRAM_ZERO);
-			atomic64_dec(&zram->stats.zero_pages);
-		}
+static void zram_bio_ctx_put(struct zram_bio_ctx *ctx)
+{
+	if (!atomic_dec_and_test(&ctx->pending))
 		return;
+
+	if (ctx->error) {
+		bio_io_error(ctx->parent);
+	} else {
+		set_bit(BIO_UPTODATE, &ctx->parent->bi_flags);
+		bio_endio(ctx->parent, 0);
 	}
+	zram_meta_put(ctx->zram);
+	kfree(ctx);
+}
 
-	zs_free(meta->mem_pool, handle);
+#ifdef CONFIG_ZRAM_WRITEBACK
+static void reset_bdev(struct zram *zram)
+{
+	if (!zram->backing_dev)
+		return;
 
-	atomic64_sub(zram_get_obj_size(meta, index),
-			&zram->stats.compr_data_size);
-	atomic64_dec(&zram->stats.pages_stored);
+	/* hope filp_close flushes all of IO */
+	set_blocksize(zram->bdev, zram->old_block_size);
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	filp_close(zram->backing_dev, NULL);
+	zram->backing_dev = NULL;
+	zram->bdev = NULL;
+	zram->old_block_size = 0;
+
+	vfree(zram->bitmap);
+	zram->bitmap = NULL;
+	zram->read_bitmap = NULL;
+	zram->free_bitmap = NULL;
+	zram->nr_pages = 0;
+}
 
-	meta->table[index].handle = 0;
-	zram_set_obj_size(meta, index, 0);
+/* returns 0 if the backing device is full */
+static unsigned long alloc_block_bdev(struct zram *zram)
+{
+	unsigned long blk_idx;
+
+retry:
+	/* skip bit 0 to avoid confusion with the "no block" value */
+	blk_idx = find_next_zero_bit(zram->bitmap, zram->nr_pages, 1);
+	if (blk_idx >= zram->nr_pages)
+		return 0;
+
+	if (test_and_set_bit(blk_idx, zram->bitmap))
+		goto retry;
+
+	atomic64_inc(&zram->stats.bd_count);
+	return blk_idx;
 }
 
-static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
+static void __free_block_bdev(struct zram *zram, unsigned long blk_idx)
 {
-	int ret = 0;
-	unsigned char *cmem;
-	struct zram_meta *meta = zram->meta;
-	unsigned long handle;
-	size_t size;
+	int was_set;
 
-	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
-	handle = meta->table[index].handle;
-	size = zram_get_obj_size(meta, index);
+	was_set = test_and_clear_bit(blk_idx, zram->bitmap);
+	WARN_ON_ONCE(!was_set);
+	atomic64_dec(&zram->stats.bd_count);
+}
 
-	if (!handle || zram_test_flag(meta, index, ZRAM_ZERO)) {
-		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
-		clear_page(mem);
-		return 0;
-	}
+/*
+ * A block still being read must not be handed to another page before the
+ * read ends, whoever of the two clears its free_bitmap bit releases it.
+ */
+static void free_block_bdev(struct zram *zram, unsigned long blk_idx)
+{
+	set_bit(blk_idx, zram->free_bitmap);
+	smp_mb();
+	if (test_bit(blk_idx, zram->read_bitmap))
+		return;
+	if (test_and_clear_bit(blk_idx, zram->free_bitmap))
+		__free_block_bdev(zram, blk_idx);
+}
 
-	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_RO);
-	if (size == PAGE_SIZE)
-		copy_page(mem, cmem);
-	else
-		ret = zcomp_decompress(zram->comp, cmem, size, mem);
-	zs_unmap_object(meta->mem_pool, handle);
-	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+/*
+ * Pin @blk_idx until zram_bdev_read_put(), the caller holds the lock of
+ * the slot that owns it. Fails if another read of the block is in flight.
+ */
+static bool zram_bdev_read_get(struct zram *zram, unsigned long blk_idx)
+{
+	return !test_and_set_bit(blk_idx, zram->read_bitmap);
+}
 
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		return ret;
-	}
+static void zram_bdev_read_put(struct zram *zram, unsigned long blk_idx)
+{
+	clear_bit(blk_idx, zram->read_bitmap);
+	smp_mb__after_clear_bit();
+	if (test_and_clear_bit(blk_idx, zram->free_bitmap))
+		__free_block_bdev(zram, blk_idx);
+	wake_up_bit(zram->read_bitmap, blk_idx);
+}
 
+static int zram_bdev_read_wait_action(void *word)
+{
+	io_schedule();
 	return 0;
 }
 
-static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
-			  u32 index, int offset, struct bio *bio)
+static void zram_bdev_read_wait(struct zram *zram, unsigned long blk_idx)
 {
-	int ret;
-	struct page *page;
-	unsigned char *user_mem, *uncmem = NULL;
-	struct zram_meta *meta = zram->meta;
-	page = bvec->bv_page;
+	wait_on_bit(zram->read_bitmap, blk_idx, zram_bdev_read_wait_action,
+			TASK_UNINTERRUPTIBLE);
+}
 
-	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
-	if (unlikely(!meta->table[index].handle) ||
-			zram_test_flag(meta, index, ZRAM_ZERO)) {
-		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
-		handle_zero_page(bvec);
-		return 0;
-	}
-	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+struct zram_bio_wait {
+	struct completion done;
+	int error;
+};
 
-	if (is_partial_io(bvec))
-		/* Use  a temporary buffer to decompress the page */
-		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
+static void zram_bdev_sync_endio(struct bio *bio, int err)
+{
+	struct zram_bio_wait *wait = bio->bi_private;
 
-	user_mem = kmap_atomic(page);
-	if (!is_partial_io(bvec))
-		uncmem = user_mem;
+	if (!err && !test_bit(BIO_UPTODATE, &bio->bi_flags))
+		err = -EIO;
+	wait->error = err;
+	complete(&wait->done);
+}
+
+/* synchronously read or write a whole page at backing device @blk_idx */
+static int zram_bdev_sync_rw(struct zram *zram, struct page *page,
+			unsigned long blk_idx, int rw)
+{
+	struct zram_bio_wait wait;
+	struct bio *bio;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_sector = blk_idx << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_bdev = zram->bdev;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	init_completion(&wait.done);
+	wait.error = 0;
+	bio->bi_end_io = zram_bdev_sync_endio;
+	bio->bi_private = &wait;
+	submit_bio(rw, bio);
+	wait_for_completion(&wait.done);
+	bio_put(bio);
+
+	return wait.error;
+}
+
+/* a backing device read of a full page, the block is pinned until it ends */
+struct zram_bdev_read {
+	struct zram_bio_ctx *ctx;
+	unsigned long blk_idx;
+};
+
+static void zram_bdev_async_endio(struct bio *bio, int err)
+{
+	struct zram_bdev_read *rd = bio->bi_private;
+	struct zram_bio_ctx *ctx = rd->ctx;
+
+	if (!err && !test_bit(BIO_UPTODATE, &bio->bi_flags))
+		err = -EIO;
+	if (err)
+		ctx->error = err;
+	else
+		flush_dcache_page(bio->bi_io_vec[0].bv_page);
+	bio_put(bio);
+	zram_bdev_read_put(ctx->zram, rd->blk_idx);
+	kfree(rd);
+	zram_bio_ctx_put(ctx);
+}
+
+/* read a full page into @bvec without waiting for the I/O */
+static int read_from_bdev_async(struct zram *zram, struct bio_vec *bvec,
+			unsigned long blk_idx, struct bio *parent,
+			struct zram_bio_ctx **pctx)
+{
+	struct zram_bio_ctx *ctx = *pctx;
+	struct zram_bdev_read *rd;
+	struct bio *bio;
+
+	if (!ctx) {
+		ctx = kmalloc(sizeof(*ctx), GFP_NOIO);
+		if (!ctx)
+			return -ENOMEM;
+		ctx->zram = zram;
+		/* the caller's reference is dropped before the reads end */
+		atomic_inc(&zram->refcount);
+		ctx->parent = parent;
+		ctx->error = 0;
+		/* reference of __zram_make_request() */
+		atomic_set(&ctx->pending, 1);
+		*pctx = ctx;
+	}
+
+	rd = kmalloc(sizeof(*rd), GFP_NOIO);
+	if (!rd)
+		return -ENOMEM;
+	rd->ctx = ctx;
+	rd->blk_idx = blk_idx;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio) {
+		kfree(rd);
+		return -ENOMEM;
+	}
+
+	bio->bi_sector = blk_idx << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_bdev = zram->bdev;
+	if (!bio_add_page(bio, bvec->bv_page, bvec->bv_len,
+				bvec->bv_offset)) {
+		bio_put(bio);
+		kfree(rd);
+		return -EIO;
+	}
+
+	bio->bi_end_io = zram_bdev_async_endio;
+	bio->bi_private = rd;
+	atomic_inc(&ctx->pending);
+	submit_bio(READ, bio);
+	return 0;
+}
+
+/* read the page at @blk_idx into @mem and unpin the block, may sleep */
+static int read_from_bdev_sync(struct zram *zram, char *mem,
+			unsigned long blk_idx)
+{
+	struct page *page;
+	int ret;
+
+	page = alloc_page(GFP_NOIO);
+	if (!page) {
+		zram_bdev_read_put(zram, blk_idx);
+		return -ENOMEM;
+	}
+
+	ret = zram_bdev_sync_rw(zram, page, blk_idx, READ);
+	zram_bdev_read_put(zram, blk_idx);
+	if (!ret) {
+		void *src = kmap_atomic(page);
+
+		copy_page(mem, src);
+		kunmap_atomic(src);
+	}
+	__free_page(page);
+	return ret;
+}
+
+static int read_from_bdev(struct zram *zram, struct bio_vec *bvec,
+			unsigned long blk_idx, int offset, struct bio *parent,
+			struct zram_bio_ctx **pctx)
+{
+	unsigned char *user_mem, *uncmem;
+	int ret;
+
+	atomic64_inc(&zram->stats.bd_reads);
+	if (!is_partial_io(bvec)) {
+		ret = read_from_bdev_async(zram, bvec, blk_idx, parent, pctx);
+		if (ret)
+			zram_bdev_read_put(zram, blk_idx);
+		return ret;
+	}
+
+	uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
+	if (!uncmem) {
+		zram_bdev_read_put(zram, blk_idx);
+		return -ENOMEM;
+	}
+
+	ret = read_from_bdev_sync(zram, uncmem, blk_idx);
+	if (!ret) {
+		user_mem = kmap_atomic(bvec->bv_page);
+		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
+				bvec->bv_len);
+		kunmap_atomic(user_mem);
+		flush_dcache_page(bvec->bv_page);
+	}
+	kfree(uncmem);
+	return ret;
+}
+#else
+static inline void reset_bdev(struct zram *zram) { }
+static inline void free_block_bdev(struct zram *zram, unsigned long blk_idx) { }
+static inline bool zram_bdev_read_get(struct zram *zram, unsigned long blk_idx)
+{
+	return true;
+}
+static inline void zram_bdev_read_wait(struct zram *zram,
+			unsigned long blk_idx) { }
+static inline int read_from_bdev_sync(struct zram *zram, char *mem,
+			unsigned long blk_idx)
+{
+	return -EIO;
+}
+static inline int read_from_bdev(struct zram *zram, struct bio_vec *bvec,
+			unsigned long blk_idx, int offset, struct bio *parent,
+			struct zram_bio_ctx **pctx)
+{
+	return -EIO;
+}
+#endif
+
+/*
+ * To protect concurrent access to the same index entry,
+ * caller should hold this table index entry's bit_spinlock to
+ * indicate this index entry is accessing.
+ */
+static void zram_free_page(struct zram *zram, size_t index)
+{
+	struct zram_meta *meta = zram->meta;
+	unsigned long handle = meta->table[index].handle;
+
+	zram_clear_flag(meta, index, ZRAM_IDLE);
+
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		zram_clear_flag(meta, index, ZRAM_WB);
+		free_block_bdev(zram, meta->table[index].blk_idx);
+		meta->table[index].blk_idx = 0;
+		atomic64_dec(&zram->stats.pages_stored);
+		return;
+	}
+
+	/*
+	 * No memory is allocated for same element filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(meta, index, ZRAM_SAME)) {
+		zram_clear_flag(meta, index, ZRAM_SAME);
+		if (!meta->table[index].element)
+			atomic64_dec(&zram->stats.zero_pages);
+		atomic64_dec(&zram->stats.same_pages);
+		meta->table[index].element = 0;
+		return;
+	}
+
+	if (unlikely(!handle))
+		return;
+
+	if (zram_test_flag(meta, index, ZRAM_DEDUP)) {
+		zram_dedup_put(zram, (struct zram_dedup_entry *)handle);
+		zram_clear_flag(meta, index, ZRAM_DEDUP);
+	} else {
+		zs_free(meta->mem_pool, handle);
+		atomic64_sub(zram_get_obj_size(meta, index),
+				&zram->stats.compr_data_size);
+	}
+	zram_clear_flag(meta, index, ZRAM_HUGE);
+	zram_clear_flag(meta, index, ZRAM_RECOMP);
+	atomic64_dec(&zram->stats.pages_stored);
+
+	meta->table[index].handle = 0;
+	zram_set_obj_size(meta, index, 0);
+}
+
+/*
+ * Reading a page of the backing device sleeps, without @may_sleep it is
+ * left to the caller and -EAGAIN is returned.
+ */
+static int __zram_decompress_page(struct zram *zram, char *mem, u32 index,
+			bool may_sleep)
+{
+	int ret = 0;
+	unsigned char *cmem;
+	struct zram_meta *meta = zram->meta;
+	unsigned long handle;
+	size_t size;
+
+retry:
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	handle = zram_get_handle(meta, index);
+	size = zram_get_obj_size(meta, index);
+
+	if (zram_test_flag(meta, index, ZRAM_SAME)) {
+		unsigned long element = meta->table[index].element;
+
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		zram_fill_page(mem, element);
+		return 0;
+	}
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		unsigned long blk_idx = meta->table[index].blk_idx;
+
+		if (!may_sleep) {
+			bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+			return -EAGAIN;
+		}
+		if (!zram_bdev_read_get(zram, blk_idx)) {
+			bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+			zram_bdev_read_wait(zram, blk_idx);
+			goto retry;
+		}
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		return read_from_bdev_sync(zram, mem, blk_idx);
+	}
+	if (!handle) {
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		clear_page(mem);
+		return 0;
+	}
+
+	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_RO);
+	if (size == PAGE_SIZE)
+		copy_page(mem, cmem);
+	else if (zram_test_flag(meta, index, ZRAM_RECOMP))
+		ret = zcomp_decompress(zram->recomp, cmem, size, mem);
+	else
+		ret = zcomp_decompress(zram->comp, cmem, size, mem);
+	zs_unmap_object(meta->mem_pool, handle);
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
+		return ret;
+	}
+
+	return 0;
+}
+
+static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
+{
+	return __zram_decompress_page(zram, mem, index, true);
+}
+
+/*
+ * Pages written back to the backing device are read asynchronously when
+ * possible, *pctx then tracks the completion of @bio.
+ */
+static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
+			  u32 index, int offset, struct bio *bio,
+			  struct zram_bio_ctx **pctx)
+{
+	int ret;
+	struct page *page;
+	unsigned char *user_mem, *uncmem = NULL;
+	struct zram_meta *meta = zram->meta;
+	page = bvec->bv_page;
+
+retry:
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	zram_accessed(meta, index);
+	if (zram_test_flag(meta, index, ZRAM_SAME)) {
+		unsigned long element = meta->table[index].element;
+
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		handle_same_page(bvec, offset, element);
+		return 0;
+	}
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		unsigned long blk_idx = meta->table[index].blk_idx;
+
+		if (!zram_bdev_read_get(zram, blk_idx)) {
+			bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+			zram_bdev_read_wait(zram, blk_idx);
+			goto retry;
+		}
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		return read_from_bdev(zram, bvec, blk_idx, offset, bio, pctx);
+	}
+	if (unlikely(!meta->table[index].handle)) {
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		handle_same_page(bvec, offset, 0);
+		return 0;
+	}
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+
+	if (is_partial_io(bvec))
+		/* Use  a temporary buffer to decompress the page */
+		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
+
+	user_mem = kmap_atomic(page);
+	if (!is_partial_io(bvec))
+		uncmem = user_mem;
 
 	if (!uncmem) {
 		pr_info("Unable to allocate temp memory\n");
@@ -415,7 +1063,8 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 		goto out_cleanup;
 	}
 
-	ret = zram_decompress_page(zram, uncmem, index);
+	/* the page may have been written back since the check above */
+	ret = __zram_decompress_page(zram, uncmem, index, false);
 	/* Should NEVER happen. Return bio error if it does. */
 	if (unlikely(ret))
 		goto out_cleanup;
@@ -430,6 +1079,10 @@ out_cleanup:
 	kunmap_atomic(user_mem);
 	if (is_partial_io(bvec))
 		kfree(uncmem);
+	if (ret == -EAGAIN) {
+		uncmem = NULL;
+		goto retry;
+	}
 	return ret;
 }
 
@@ -437,8 +1090,11 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
 	int ret = 0;
-	size_t clen;
-	unsigned long handle;
+	size_t clen, alloced_clen = 0;
+	unsigned long handle = 0;
+	u32 checksum = 0;
+	unsigned long element;
+	struct zram_dedup_entry *entry = NULL;
 	struct page *page;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 	struct zram_meta *meta = zram->meta;
@@ -446,7 +1102,6 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	bool locked = false;
 
 	page = bvec->bv_page;
-	src = meta->compress_buffer;
 
 	if (is_partial_io(bvec)) {
 		/*
@@ -463,6 +1118,7 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			goto out;
 	}
 
+compress_again:
 	zstrm = zcomp_strm_find(zram->comp);
 	locked = true;
 	user_mem = kmap_atomic(page);
@@ -476,15 +1132,46 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		uncmem = user_mem;
 	}
 
-	if (page_zero_filled(uncmem)) {
-		kunmap_atomic(user_mem);
+	if (page_same_filled(uncmem, &element)) {
+		if (user_mem)
+			kunmap_atomic(user_mem);
+		/* drop the allocation of a previous pass, if any */
+		zs_free(meta->mem_pool, handle);
 		/* Free memory associated with this sector now. */
 		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
 		zram_free_page(zram, index);
-		zram_set_flag(meta, index, ZRAM_ZERO);
+		meta->table[index].element = element;
+		zram_set_flag(meta, index, ZRAM_SAME);
+		zram_accessed(meta, index);
 		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 
-		atomic64_inc(&zram->stats.zero_pages);
+		if (!element)
+			atomic64_inc(&zram->stats.zero_pages);
+		atomic64_inc(&zram->stats.same_pages);
+		ret = 0;
+		goto out;
+	}
+
+	if (zram_dedup_enabled(meta)) {
+		checksum = zram_dedup_checksum(uncmem);
+		/* stream buffer is free until we compress, use it to compare */
+		entry = zram_dedup_find(zram, uncmem, checksum, zstrm->buffer);
+	}
+	if (entry) {
+		if (user_mem)
+			kunmap_atomic(user_mem);
+		zs_free(meta->mem_pool, handle);
+
+		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		zram_free_page(zram, index);
+		meta->table[index].handle = (unsigned long)entry;
+		zram_set_flag(meta, index, ZRAM_DEDUP);
+		zram_set_obj_size(meta, index, entry->len);
+		zram_accessed(meta, index);
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+
+		atomic64_inc(&zram->stats.dedup_hits);
+		atomic64_inc(&zram->stats.pages_stored);
 		ret = 0;
 		goto out;
 	}
@@ -496,123 +1183,582 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		uncmem = NULL;
 	}
 
-	if (unlikely(ret)) {
-		pr_err("Compression failed! err=%d\n", ret);
-		goto out;
-	}
-	
-	src = zstrm->buffer;
-	if (unlikely(clen > max_zpage_size)) {
-		clen = PAGE_SIZE;
-		src = NULL;
-		if (is_partial_io(bvec))
-			src = uncmem;
+	if (unlikely(ret)) {
+		pr_err("Compression failed! err=%d\n", ret);
+		zs_free(meta->mem_pool, handle);
+		goto out;
+	}
+
+	src = zstrm->buffer;
+	if (unlikely(clen > max_zpage_size)) {
+		clen = PAGE_SIZE;
+		src = NULL;
+		if (is_partial_io(bvec))
+			src = uncmem;
+	}
+
+	/* page content changed while we were allocating, size may differ */
+	if (handle && clen != alloced_clen) {
+		zs_free(meta->mem_pool, handle);
+		handle = 0;
+	}
+
+	/*
+	 * A per-cpu stream is held with preemption disabled, so we must not
+	 * sleep here. Try a non-blocking allocation first and, if that fails,
+	 * drop the stream, allocate with the pool flags and compress again
+	 * since somebody else may have used the stream buffer meanwhile.
+	 * The other backends may sleep while holding their stream.
+	 */
+	if (!handle)
+		handle = zs_malloc(meta->mem_pool, clen,
+				zram->percpu_comp_streams ?
+				GFP_NOWAIT | __GFP_HIGHMEM | __GFP_NOWARN :
+				zs_pool_gfp(meta->mem_pool));
+	if (!handle && !zram->percpu_comp_streams) {
+		pr_info("Error allocating memory for compressed page: %u, size=%zu\n",
+			index, clen);
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (!handle) {
+		zcomp_strm_release(zram->comp, zstrm);
+		locked = false;
+		handle = zs_malloc(meta->mem_pool, clen,
+				zs_pool_gfp(meta->mem_pool));
+		if (handle) {
+			alloced_clen = clen;
+			goto compress_again;
+		}
+		pr_info("Error allocating memory for compressed page: %u, size=%zu\n",
+			index, clen);
+		ret = -ENOMEM;
+		goto out;
+	}
+	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_WO);
+
+	if ((clen == PAGE_SIZE) && !is_partial_io(bvec)) {
+		src = kmap_atomic(page);
+		copy_page(cmem, src);
+		kunmap_atomic(src);
+	} else {
+		memcpy(cmem, src, clen);
+	}
+
+	zcomp_strm_release(zram->comp, zstrm);
+	locked = false;
+	zs_unmap_object(meta->mem_pool, handle);
+
+	if (zram_dedup_enabled(meta))
+		entry = zram_dedup_insert(zram, handle, clen, checksum);
+
+	/*
+	 * Free memory associated with this sector
+	 * before overwriting unused sectors.
+	 */
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	zram_free_page(zram, index);
+
+	if (entry) {
+		meta->table[index].handle = (unsigned long)entry;
+		zram_set_flag(meta, index, ZRAM_DEDUP);
+	} else {
+		meta->table[index].handle = handle;
+	}
+	if (clen == PAGE_SIZE)
+		zram_set_flag(meta, index, ZRAM_HUGE);
+	zram_set_obj_size(meta, index, clen);
+	zram_accessed(meta, index);
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+
+	/* Update stats */
+	atomic64_add(clen, &zram->stats.compr_data_size);
+	atomic64_inc(&zram->stats.pages_stored);
+out:
+	if (locked)
+		zcomp_strm_release(zram->comp, zstrm);
+	if (is_partial_io(bvec))
+		kfree(uncmem);
+
+	return ret;
+}
+
+static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
+			int offset, struct bio *bio, struct zram_bio_ctx **pctx)
+{
+	int ret;
+	int rw = bio_data_dir(bio);
+
+	if (rw == READ) {
+		atomic64_inc(&zram->stats.num_reads);
+		ret = zram_bvec_read(zram, bvec, index, offset, bio, pctx);
+	} else {
+		atomic64_inc(&zram->stats.num_writes);
+		ret = zram_bvec_write(zram, bvec, index, offset);
+	}
+
+	if (unlikely(ret)) {
+		if (rw == READ)
+			atomic64_inc(&zram->stats.failed_reads);
+		else
+			atomic64_inc(&zram->stats.failed_writes);
+	}
+
+	return ret;
+}
+
+/*
+ * zram_bio_discard - handler on discard request
+ * @index: physical block index in PAGE_SIZE units
+ * @offset: byte offset within physical block
+ */
+static void zram_bio_discard(struct zram *zram, u32 index,
+			     int offset, struct bio *bio)
+{
+	size_t n = bio->bi_size;
+	struct zram_meta *meta = zram->meta;
+
+	/*
+	 * zram manages data in physical block size units. Because logical block
+	 * size isn't identical with physical block size on some arch, we
+	 * could get a discard request pointing to a specific offset within a
+	 * certain physical block.  Although we can handle this request by
+	 * reading that physiclal block and decompressing and partially zeroing
+	 * and re-compressing and then re-storing it, this isn't reasonable
+	 * because our intent with a discard request is to save memory.  So
+	 * skipping this logical block is appropriate here.
+	 */
+	if (offset) {
+		if (n <= (PAGE_SIZE - offset))
+			return;
+
+		n -= (PAGE_SIZE - offset);
+		index++;
+	}
+
+	while (n >= PAGE_SIZE) {
+		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		zram_free_page(zram, index);
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		index++;
+		n -= PAGE_SIZE;
+	}
+}
+
+/*
+ * Mark stored pages idle, any later access clears the mark. "all" marks
+ * every page, with CONFIG_ZRAM_MEMORY_TRACKING a number marks only the
+ * pages not accessed within that many seconds.
+ */
+static ssize_t idle_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_meta *meta;
+	size_t index, nr_pages;
+	unsigned long age = 0;
+
+	if (!sysfs_streq(buf, "all")) {
+		if (!IS_ENABLED(CONFIG_ZRAM_MEMORY_TRACKING) ||
+				kstrtoul(buf, 10, &age) || !age)
+			return -EINVAL;
+		if (age > MAX_JIFFY_OFFSET / HZ)
+			age = MAX_JIFFY_OFFSET / HZ;
+		age *= HZ;
+	}
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		up_read(&zram->init_lock);
+		return -EINVAL;
+	}
+
+	meta = zram->meta;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages; index++) {
+		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		if (!zram_allocated(meta, index))
+			goto next;
+#ifdef CONFIG_ZRAM_MEMORY_TRACKING
+		if (age && time_before(jiffies,
+				meta->table[index].ac_time + age))
+			goto next;
+#endif
+		zram_set_flag(meta, index, ZRAM_IDLE);
+next:
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+	}
+	up_read(&zram->init_lock);
+
+	return len;
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+static ssize_t backing_dev_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct file *file;
+	char *p;
+	ssize_t ret;
+
+	down_read(&zram->init_lock);
+	file = zram->backing_dev;
+	if (!file) {
+		up_read(&zram->init_lock);
+		return scnprintf(buf, PAGE_SIZE, "none\n");
+	}
+
+	p = d_path(&file->f_path, buf, PAGE_SIZE - 1);
+	if (IS_ERR(p)) {
+		ret = PTR_ERR(p);
+		goto out;
+	}
+
+	ret = strlen(p);
+	memmove(buf, p, ret);
+	buf[ret++] = '\n';
+out:
+	up_read(&zram->init_lock);
+	return ret;
+}
+
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct file *backing_dev = NULL;
+	struct block_device *bdev = NULL;
+	struct inode *inode;
+	unsigned long nr_pages, *bitmap = NULL;
+	unsigned int old_block_size = 0;
+	char *file_name;
+	size_t sz;
+	int err;
+
+	file_name = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!file_name)
+		return -ENOMEM;
+
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		pr_info("Can't setup backing device for initialized device\n");
+		err = -EBUSY;
+		goto out;
+	}
+
+	strlcpy(file_name, buf, PATH_MAX);
+	/* ignore trailing newline */
+	sz = strlen(file_name);
+	if (sz > 0 && file_name[sz - 1] == '\n')
+		file_name[sz - 1] = 0x00;
+
+	backing_dev = filp_open(file_name, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(backing_dev)) {
+		err = PTR_ERR(backing_dev);
+		backing_dev = NULL;
+		goto out;
+	}
+
+	/* files are supported through a loop device */
+	inode = backing_dev->f_mapping->host;
+	if (!S_ISBLK(inode->i_mode)) {
+		err = -ENOTBLK;
+		goto out;
+	}
+
+	bdev = bdgrab(I_BDEV(inode));
+	err = blkdev_get(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (err < 0) {
+		bdev = NULL;
+		goto out;
+	}
+
+	nr_pages = i_size_read(inode) >> PAGE_SHIFT;
+	/* allocated, read and free pending blocks, in one allocation */
+	bitmap = vzalloc(3 * BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	old_block_size = block_size(bdev);
+	err = set_blocksize(bdev, PAGE_SIZE);
+	if (err)
+		goto out;
+
+	reset_bdev(zram);
+
+	zram->old_block_size = old_block_size;
+	zram->bdev = bdev;
+	zram->backing_dev = backing_dev;
+	zram->bitmap = bitmap;
+	zram->read_bitmap = bitmap + BITS_TO_LONGS(nr_pages);
+	zram->free_bitmap = bitmap + 2 * BITS_TO_LONGS(nr_pages);
+	zram->nr_pages = nr_pages;
+	up_write(&zram->init_lock);
+
+	pr_info("setup backing device %s\n", file_name);
+	kfree(file_name);
+
+	return len;
+out:
+	vfree(bitmap);
+
+	if (bdev)
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+
+	if (backing_dev)
+		filp_close(backing_dev, NULL);
+
+	up_write(&zram->init_lock);
+	kfree(file_name);
+
+	return err;
+}
+
+static bool zram_wb_candidate(struct zram_meta *meta, size_t index, bool huge)
+{
+	if (!meta->table[index].handle ||
+			zram_test_flag(meta, index, ZRAM_SAME) ||
+			zram_test_flag(meta, index, ZRAM_WB) ||
+			zram_test_flag(meta, index, ZRAM_DEDUP))
+		return false;
+
+	if (huge)
+		return zram_test_flag(meta, index, ZRAM_HUGE);
+	return zram_test_flag(meta, index, ZRAM_IDLE);
+}
+
+/*
+ * Write "idle" pages or "huge" (incompressible) pages to the backing
+ * device and free their memory.
+ */
+static ssize_t writeback_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_meta *meta;
+	unsigned long handle, blk_idx;
+	size_t index, nr_pages;
+	struct page *page;
+	ssize_t ret;
+	bool huge;
+
+	if (sysfs_streq(buf, "idle"))
+		huge = false;
+	else if (sysfs_streq(buf, "huge"))
+		huge = true;
+	else
+		return -EINVAL;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		ret = -EINVAL;
+		goto release_init_lock;
+	}
+
+	if (!zram->backing_dev) {
+		ret = -ENODEV;
+		goto release_init_lock;
 	}
 
-	handle = zs_malloc(meta->mem_pool, clen);
-	if (!handle) {
-		pr_info("Error allocating memory for compressed page: %u, size=%zu\n",
-			index, clen);
+	page = alloc_page(GFP_KERNEL);
+	if (!page) {
 		ret = -ENOMEM;
-		goto out;
+		goto release_init_lock;
 	}
-	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_WO);
 
-	if ((clen == PAGE_SIZE) && !is_partial_io(bvec)) {
-		src = kmap_atomic(page);
-		copy_page(cmem, src);
-		kunmap_atomic(src);
-	} else {
-		memcpy(cmem, src, clen);
-	}
+	ret = len;
+	meta = zram->meta;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages; index++) {
+		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		if (!zram_wb_candidate(meta, index, huge)) {
+			bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+			continue;
+		}
+		/*
+		 * Any access from now on clears ZRAM_IDLE, which tells us
+		 * below that the written back copy is stale.
+		 */
+		zram_set_flag(meta, index, ZRAM_IDLE);
+		handle = meta->table[index].handle;
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 
-	zcomp_strm_release(zram->comp, zstrm);
-	locked = false;
-	zs_unmap_object(meta->mem_pool, handle);
+		blk_idx = alloc_block_bdev(zram);
+		if (!blk_idx) {
+			ret = -ENOSPC;
+			break;
+		}
 
-	/*
-	 * Free memory associated with this sector
-	 * before overwriting unused sectors.
-	 */
-	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
-	zram_free_page(zram, index);
+		if (zram_decompress_page(zram, page_address(page), index) ||
+				zram_bdev_sync_rw(zram, page, blk_idx, WRITE)) {
+			free_block_bdev(zram, blk_idx);
+			continue;
+		}
 
-	meta->table[index].handle = handle;
-	zram_set_obj_size(meta, index, clen);
-	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		if (!zram_test_flag(meta, index, ZRAM_IDLE) ||
+				meta->table[index].handle != handle ||
+				!zram_wb_candidate(meta, index, huge)) {
+			bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+			free_block_bdev(zram, blk_idx);
+			continue;
+		}
 
-	/* Update stats */
-	atomic64_add(clen, &zram->stats.compr_data_size);
-	atomic64_inc(&zram->stats.pages_stored);
-out:
-	if (locked)
-		zcomp_strm_release(zram->comp, zstrm);
-	if (is_partial_io(bvec))
-		kfree(uncmem);
+		zram_free_page(zram, index);
+		zram_set_flag(meta, index, ZRAM_WB);
+		meta->table[index].blk_idx = blk_idx;
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 
+		atomic64_inc(&zram->stats.pages_stored);
+		atomic64_inc(&zram->stats.bd_writes);
+	}
+	__free_page(page);
+
+release_init_lock:
+	up_read(&zram->init_lock);
 	return ret;
 }
+#endif
+
+static bool zram_recomp_candidate(struct zram_meta *meta, size_t index,
+		bool huge)
+{
+	if (!meta->table[index].handle ||
+			zram_test_flag(meta, index, ZRAM_SAME) ||
+			zram_test_flag(meta, index, ZRAM_WB) ||
+			zram_test_flag(meta, index, ZRAM_DEDUP) ||
+			zram_test_flag(meta, index, ZRAM_RECOMP))
+		return false;
+
+	if (huge)
+		return zram_test_flag(meta, index, ZRAM_HUGE);
+	return zram_test_flag(meta, index, ZRAM_IDLE);
+}
 
-static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
-			int offset, struct bio *bio)
+/*
+ * Compress the page at @index again with the recompression backend and
+ * keep the result if it is smaller. @mem is a page sized buffer.
+ */
+static int zram_recompress_page(struct zram *zram, size_t index, bool huge,
+		unsigned char *mem)
 {
+	struct zram_meta *meta = zram->meta;
+	struct zcomp_strm *zstrm;
+	unsigned long handle, new_handle;
+	size_t size, clen;
+	unsigned char *cmem;
 	int ret;
-	int rw = bio_data_dir(bio);
 
-	if (rw == READ) {
-		atomic64_inc(&zram->stats.num_reads);
-		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-	} else {
-		atomic64_inc(&zram->stats.num_writes);
-		ret = zram_bvec_write(zram, bvec, index, offset);
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	if (!zram_recomp_candidate(meta, index, huge)) {
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		return 0;
 	}
+	/*
+	 * Any access from now on clears ZRAM_IDLE, which tells us
+	 * below that the recompressed copy is stale.
+	 */
+	zram_set_flag(meta, index, ZRAM_IDLE);
+	handle = meta->table[index].handle;
+	size = zram_get_obj_size(meta, index);
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 
-	if (unlikely(ret)) {
-		if (rw == READ)
-			atomic64_inc(&zram->stats.failed_reads);
-		else
-			atomic64_inc(&zram->stats.failed_writes);
+	ret = zram_decompress_page(zram, mem, index);
+	if (ret)
+		return ret;
+
+	/* the recompression backend is single stream, we may sleep */
+	zstrm = zcomp_strm_find(zram->recomp);
+	ret = zcomp_compress(zram->recomp, zstrm, mem, &clen);
+	if (ret || clen >= size || clen > max_zpage_size) {
+		zcomp_strm_release(zram->recomp, zstrm);
+		return ret;
 	}
 
-	return ret;
+	new_handle = zs_malloc(meta->mem_pool, clen,
+			zs_pool_gfp(meta->mem_pool));
+	if (!new_handle) {
+		zcomp_strm_release(zram->recomp, zstrm);
+		return -ENOMEM;
+	}
+	cmem = zs_map_object(meta->mem_pool, new_handle, ZS_MM_WO);
+	memcpy(cmem, zstrm->buffer, clen);
+	zs_unmap_object(meta->mem_pool, new_handle);
+	zcomp_strm_release(zram->recomp, zstrm);
+
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	if (!zram_test_flag(meta, index, ZRAM_IDLE) ||
+			meta->table[index].handle != handle ||
+			!zram_recomp_candidate(meta, index, huge)) {
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		zs_free(meta->mem_pool, new_handle);
+		return 0;
+	}
+
+	zs_free(meta->mem_pool, handle);
+	meta->table[index].handle = new_handle;
+	zram_clear_flag(meta, index, ZRAM_HUGE);
+	zram_set_flag(meta, index, ZRAM_RECOMP);
+	zram_set_obj_size(meta, index, clen);
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+
+	atomic64_sub(size - clen, &zram->stats.compr_data_size);
+	atomic64_add(size - clen, &zram->stats.recomp_saved_bytes);
+	atomic64_inc(&zram->stats.recomp_pages);
+	return 0;
 }
 
 /*
- * zram_bio_discard - handler on discard request
- * @index: physical block index in PAGE_SIZE units
- * @offset: byte offset within physical block
+ * Recompress "idle" pages or "huge" (incompressible) pages with the
+ * recompression backend, keeping the primary one on the write path.
  */
-static void zram_bio_discard(struct zram *zram, u32 index,
-			     int offset, struct bio *bio)
+static ssize_t recompress_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
 {
-	size_t n = bio->bi_size;
-	struct zram_meta *meta = zram->meta;
+	struct zram *zram = dev_to_zram(dev);
+	size_t index, nr_pages;
+	unsigned char *mem;
+	ssize_t ret;
+	bool huge;
+
+	if (sysfs_streq(buf, "idle"))
+		huge = false;
+	else if (sysfs_streq(buf, "huge"))
+		huge = true;
+	else
+		return -EINVAL;
 
-	/*
-	 * zram manages data in physical block size units. Because logical block
-	 * size isn't identical with physical block size on some arch, we
-	 * could get a discard request pointing to a specific offset within a
-	 * certain physical block.  Although we can handle this request by
-	 * reading that physiclal block and decompressing and partially zeroing
-	 * and re-compressing and then re-storing it, this isn't reasonable
-	 * because our intent with a discard request is to save memory.  So
-	 * skipping this logical block is appropriate here.
-	 */
-	if (offset) {
-		if (n <= (PAGE_SIZE - offset))
-			return;
+	down_read(&zram->init_lock);
+	if (!init_done(zram) || !zram->recomp) {
+		ret = -EINVAL;
+		goto release_init_lock;
+	}
 
-		n -= (PAGE_SIZE - offset);
-		index++;
+	mem = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!mem) {
+		ret = -ENOMEM;
+		goto release_init_lock;
 	}
 
-	while (n >= PAGE_SIZE) {
-		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
-		zram_free_page(zram, index);
-		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
-		index++;
-		n -= PAGE_SIZE;
+	ret = len;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages; index++) {
+		int err = zram_recompress_page(zram, index, huge, mem);
+
+		if (err == -ENOMEM) {
+			ret = err;
+			break;
+		}
+		cond_resched();
 	}
+	kfree(mem);
+
+release_init_lock:
+	up_read(&zram->init_lock);
+	return ret;
 }
 
 static void zram_reset_device(struct zram *zram, bool reset_capacity)
@@ -622,25 +1768,38 @@ static void zram_reset_device(struct zram *zram, bool reset_capacity)
 
 	down_write(&zram->init_lock);
 	if (!init_done(zram)) {
+		reset_bdev(zram);
 		up_write(&zram->init_lock);
 		return;
 	}
 
+	/* Wait for I/O in flight, new I/O fails from now on */
+	zram_meta_put(zram);
+	wait_event(zram->io_done, !atomic_read(&zram->refcount));
+
 	meta = zram->meta;
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
 		unsigned long handle = meta->table[index].handle;
-		if (!handle)
+		if (!handle || zram_test_flag(meta, index, ZRAM_SAME) ||
+				zram_test_flag(meta, index, ZRAM_WB))
 			continue;
 
-		zs_free(meta->mem_pool, handle);
+		if (zram_test_flag(meta, index, ZRAM_DEDUP))
+			zram_dedup_put(zram, (struct zram_dedup_entry *)handle);
+		else
+			zs_free(meta->mem_pool, handle);
 	}
 
 	zcomp_destroy(zram->comp);
+	if (zram->recomp)
+		zcomp_destroy(zram->recomp);
+	zram->recomp = NULL;
 	zram->max_comp_streams = 1;
 
 	zram_meta_free(zram->meta);
 	zram->meta = NULL;
+	reset_bdev(zram);
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
 
@@ -663,7 +1822,7 @@ static ssize_t disksize_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t len)
 {
 	u64 disksize;
-	struct zcomp *comp;
+	struct zcomp *comp, *recomp = NULL;
 	struct zram_meta *meta;
 	struct zram *zram = dev_to_zram(dev);
 	int err;
@@ -673,11 +1832,20 @@ static ssize_t disksize_store(struct device *dev,
 		return -EINVAL;
 
 	disksize = PAGE_ALIGN(disksize);
-	meta = zram_meta_alloc(disksize);
+	meta = zram_meta_alloc(zram->disk->disk_name, disksize);
 	if (!meta)
 		return -ENOMEM;
 
-	comp = zcomp_create(zram->compressor, zram->max_comp_streams);
+	if (zram->use_dedup) {
+		err = zram_dedup_init(meta, disksize >> PAGE_SHIFT);
+		if (err) {
+			pr_err("Error allocating dedup index\n");
+			goto out_free_meta;
+		}
+	}
+
+	comp = zcomp_create(zram->compressor, zram->max_comp_streams,
+			zram->percpu_comp_streams);
 	if (IS_ERR(comp)) {
 		pr_info("Cannot initialise %s compressing backend\n",
 				zram->compressor);
@@ -685,6 +1853,17 @@ static ssize_t disksize_store(struct device *dev,
 		goto out_free_meta;
 	}
 
+	if (zram->recomp_compressor[0]) {
+		recomp = zcomp_create(zram->recomp_compressor, 1, false);
+		if (IS_ERR(recomp)) {
+			pr_info("Cannot initialise %s recompressing backend\n",
+					zram->recomp_compressor);
+			err = PTR_ERR(recomp);
+			recomp = NULL;
+			goto out_free_comp;
+		}
+	}
+
 	down_write(&zram->init_lock);
 	if (init_done(zram)) {
 		pr_info("Cannot change disksize for initialized device\n");
@@ -694,7 +1873,11 @@ static ssize_t disksize_store(struct device *dev,
 
 	zram->meta = meta;
 	zram->comp = comp;
+	zram->recomp = recomp;
 	zram->disksize = disksize;
+	/* publish the above to zram_meta_get() */
+	smp_wmb();
+	atomic_set(&zram->refcount, 1);
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 	up_write(&zram->init_lock);
 	
@@ -709,6 +1892,9 @@ static ssize_t disksize_store(struct device *dev,
 	
 out_destroy_comp:
 	up_write(&zram->init_lock);
+out_free_comp:
+	if (recomp)
+		zcomp_destroy(recomp);
 	zcomp_destroy(comp);
 out_free_meta:
 	zram_meta_free(meta);
@@ -756,11 +1942,115 @@ out:
 	return ret;
 }
 
+/* a slice of a write bio compressed by one worker */
+struct zram_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct bio *bio;
+	u32 index;	/* zram page of segment @first */
+	int first;	/* segments [first, last) of bio */
+	int last;
+	int error;
+	atomic_t *pending;
+	struct completion *done;
+};
+
+static void zram_work_fn(struct work_struct *work)
+{
+	struct zram_work *zw = container_of(work, struct zram_work, work);
+	u32 index = zw->index;
+	int i, ret;
+
+	for (i = zw->first; i < zw->last; i++) {
+		ret = zram_bvec_rw(zw->zram, bio_iovec_idx(zw->bio, i),
+				index++, 0, zw->bio, NULL);
+		if (ret < 0) {
+			zw->error = ret;
+			break;
+		}
+	}
+
+	if (atomic_dec_and_test(zw->pending))
+		complete(zw->done);
+}
+
+/* parallel compression only deals with page aligned, full page writes */
+static bool zram_parallel_ok(struct zram *zram, struct bio *bio, int offset)
+{
+	unsigned int threshold = ACCESS_ONCE(zram->parallel_threshold);
+	struct bio_vec *bvec;
+	int i;
+
+	if (!threshold || bio_data_dir(bio) != WRITE || offset ||
+			bio_segments(bio) < threshold || num_online_cpus() < 2)
+		return false;
+
+	bio_for_each_segment(bvec, bio, i) {
+		if (bvec->bv_len != PAGE_SIZE)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Split the segments of @bio over up to one worker per online cpu, the
+ * submitter compressing the first slice itself, and wait until all pages
+ * are stored. Returns -EAGAIN if the caller should fall back to serial
+ * processing.
+ */
+static int zram_parallel_write(struct zram *zram, struct bio *bio, u32 index)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct zram_work *zw;
+	atomic_t pending;
+	int nr_segs = bio_segments(bio);
+	int nr_works, per_work, i, ret = 0;
+
+	nr_works = min_t(int, num_online_cpus(), nr_segs);
+	per_work = DIV_ROUND_UP(nr_segs, nr_works);
+	nr_works = DIV_ROUND_UP(nr_segs, per_work);
+
+	zw = kmalloc(nr_works * sizeof(*zw), GFP_NOIO | __GFP_NOWARN);
+	if (!zw)
+		return -EAGAIN;
+
+	atomic_set(&pending, nr_works);
+	for (i = 0; i < nr_works; i++) {
+		INIT_WORK(&zw[i].work, zram_work_fn);
+		zw[i].zram = zram;
+		zw[i].bio = bio;
+		zw[i].index = index + i * per_work;
+		zw[i].first = bio->bi_idx + i * per_work;
+		zw[i].last = min_t(int, zw[i].first + per_work, bio->bi_vcnt);
+		zw[i].error = 0;
+		zw[i].pending = &pending;
+		zw[i].done = &done;
+		if (i)
+			queue_work(zram_wq, &zw[i].work);
+	}
+
+	zram_work_fn(&zw[0].work);
+	wait_for_completion(&done);
+
+	for (i = 0; i < nr_works; i++) {
+		if (zw[i].error)
+			ret = zw[i].error;
+	}
+	kfree(zw);
+
+	if (!ret) {
+		atomic64_inc(&zram->stats.parallel_bios);
+		atomic64_add(nr_segs, &zram->stats.parallel_pages);
+	}
+	return ret;
+}
+
 static void __zram_make_request(struct zram *zram, struct bio *bio)
 {
 	int i, offset;
 	u32 index;
 	struct bio_vec *bvec;
+	struct zram_bio_ctx *ctx = NULL;
 
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 	offset = (bio->bi_sector & (SECTORS_PER_PAGE - 1)) << SECTOR_SHIFT;
@@ -771,6 +2061,18 @@ static void __zram_make_request(struct zram *zram, struct bio *bio)
 		return;
 	}
 
+	if (zram_parallel_ok(zram, bio, offset)) {
+		int ret = zram_parallel_write(zram, bio, index);
+
+		if (ret != -EAGAIN) {
+			if (ret)
+				goto out;
+			set_bit(BIO_UPTODATE, &bio->bi_flags);
+			bio_endio(bio, 0);
+			return;
+		}
+	}
+
 	bio_for_each_segment(bvec, bio, i) {
 		int max_transfer_size = PAGE_SIZE - offset;
 
@@ -785,25 +2087,39 @@ static void __zram_make_request(struct zram *zram, struct bio *bio)
 			bv.bv_len = max_transfer_size;
 			bv.bv_offset = bvec->bv_offset;
 
-			if (zram_bvec_rw(zram, &bv, index, offset, bio) < 0)
+			if (zram_bvec_rw(zram, &bv, index, offset, bio,
+						&ctx) < 0)
 				goto out;
 
 			bv.bv_len = bvec->bv_len - max_transfer_size;
 			bv.bv_offset += max_transfer_size;
-			if (zram_bvec_rw(zram, &bv, index + 1, 0, bio) < 0)
+			if (zram_bvec_rw(zram, &bv, index + 1, 0, bio,
+						&ctx) < 0)
 				goto out;
 		} else
-			if (zram_bvec_rw(zram, bvec, index, offset, bio) < 0)
+			if (zram_bvec_rw(zram, bvec, index, offset, bio,
+						&ctx) < 0)
 				goto out;
 
 		update_position(&index, &offset, bvec);
 	}
 
+	/* backing device reads in flight end the bio when they complete */
+	if (ctx) {
+		zram_bio_ctx_put(ctx);
+		return;
+	}
+
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return;
 
 out:
+	if (ctx) {
+		ctx->error = -EIO;
+		zram_bio_ctx_put(ctx);
+		return;
+	}
 	bio_io_error(bio);
 }
 
@@ -814,22 +2130,22 @@ static void zram_make_request(struct request_queue *queue, struct bio *bio)
 {
 	struct zram *zram = queue->queuedata;
 
-	down_read(&zram->init_lock);
-	if (unlikely(!init_done(zram)))
+	if (unlikely(!zram_meta_get(zram)))
 		goto error;
 
 	if (!valid_io_request(zram, bio)) {
 		atomic64_inc(&zram->stats.invalid_io);
-		goto error;
+		goto put_zram;
 	}
 
 	__zram_make_request(zram, bio);
-	up_read(&zram->init_lock);
+	zram_meta_put(zram);
 
 	return;
 
+put_zram:
+	zram_meta_put(zram);
 error:
-	up_read(&zram->init_lock);
 	bio_io_error(bio);
 }
 
@@ -840,12 +2156,16 @@ static void zram_slot_free_notify(struct block_device *bdev,
 	struct zram_meta *meta;
 
 	zram = bdev->bd_disk->private_data;
+	/* called under swap_lock, so this can't wait for anything */
+	if (unlikely(!zram_meta_get(zram)))
+		return;
 	meta = zram->meta;
 
 	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
 	zram_free_page(zram, index);
 	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
 	atomic64_inc(&zram->stats.notify_free);
+	zram_meta_put(zram);
 }
 
 static const struct block_device_operations zram_devops = {
@@ -859,8 +2179,26 @@ static DEVICE_ATTR(initstate, S_IRUGO, initstate_show, NULL);
 static DEVICE_ATTR(reset, S_IWUSR, NULL, reset_store);
 static DEVICE_ATTR(orig_data_size, S_IRUGO, orig_data_size_show, NULL);
 static DEVICE_ATTR(mem_used_total, S_IRUGO, mem_used_total_show, NULL);
+static DEVICE_ATTR(compact, S_IWUSR, NULL, compact_store);
+static DEVICE_ATTR(pages_compacted, S_IRUGO, pages_compacted_show, NULL);
 static DEVICE_ATTR(max_comp_streams, S_IRUGO | S_IWUSR,
 		max_comp_streams_show, max_comp_streams_store);
+static DEVICE_ATTR(percpu_comp_streams, S_IRUGO | S_IWUSR,
+		percpu_comp_streams_show, percpu_comp_streams_store);
+static DEVICE_ATTR(parallel_threshold, S_IRUGO | S_IWUSR,
+		parallel_threshold_show, parallel_threshold_store);
+static DEVICE_ATTR(comp_streams_stat, S_IRUGO, comp_streams_stat_show, NULL);
+static DEVICE_ATTR(use_dedup, S_IRUGO | S_IWUSR,
+		use_dedup_show, use_dedup_store);
+static DEVICE_ATTR(recomp_algorithm, S_IRUGO | S_IWUSR,
+		recomp_algorithm_show, recomp_algorithm_store);
+static DEVICE_ATTR(recompress, S_IWUSR, NULL, recompress_store);
+static DEVICE_ATTR(idle, S_IWUSR, NULL, idle_store);
+#ifdef CONFIG_ZRAM_WRITEBACK
+static DEVICE_ATTR(backing_dev, S_IRUGO | S_IWUSR,
+		backing_dev_show, backing_dev_store);
+static DEVICE_ATTR(writeback, S_IWUSR, NULL, writeback_store);
+#endif
 static DEVICE_ATTR(comp_algorithm, S_IRUGO | S_IWUSR,
 		comp_algorithm_show, comp_algorithm_store);
 
@@ -871,7 +2209,19 @@ ZRAM_ATTR_RO(failed_writes);
 ZRAM_ATTR_RO(invalid_io);
 ZRAM_ATTR_RO(notify_free);
 ZRAM_ATTR_RO(zero_pages);
+ZRAM_ATTR_RO(same_pages);
+ZRAM_ATTR_RO(dedup_hits);
+ZRAM_ATTR_RO(dedup_saved_bytes);
 ZRAM_ATTR_RO(compr_data_size);
+ZRAM_ATTR_RO(recomp_pages);
+ZRAM_ATTR_RO(parallel_bios);
+ZRAM_ATTR_RO(parallel_pages);
+ZRAM_ATTR_RO(recomp_saved_bytes);
+#ifdef CONFIG_ZRAM_WRITEBACK
+ZRAM_ATTR_RO(bd_count);
+ZRAM_ATTR_RO(bd_reads);
+ZRAM_ATTR_RO(bd_writes);
+#endif
 
 static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_disksize.attr,
@@ -884,11 +2234,34 @@ static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_invalid_io.attr,
 	&dev_attr_notify_free.attr,
 	&dev_attr_zero_pages.attr,
+	&dev_attr_same_pages.attr,
+	&dev_attr_dedup_hits.attr,
+	&dev_attr_dedup_saved_bytes.attr,
 	&dev_attr_orig_data_size.attr,
 	&dev_attr_compr_data_size.attr,
 	&dev_attr_mem_used_total.attr,
+	&dev_attr_compact.attr,
+	&dev_attr_pages_compacted.attr,
 	&dev_attr_max_comp_streams.attr,
+	&dev_attr_percpu_comp_streams.attr,
+	&dev_attr_comp_streams_stat.attr,
+	&dev_attr_parallel_threshold.attr,
+	&dev_attr_parallel_bios.attr,
+	&dev_attr_parallel_pages.attr,
 	&dev_attr_comp_algorithm.attr,
+	&dev_attr_use_dedup.attr,
+	&dev_attr_idle.attr,
+	&dev_attr_recomp_algorithm.attr,
+	&dev_attr_recompress.attr,
+	&dev_attr_recomp_pages.attr,
+	&dev_attr_recomp_saved_bytes.attr,
+#ifdef CONFIG_ZRAM_WRITEBACK
+	&dev_attr_backing_dev.attr,
+	&dev_attr_writeback.attr,
+	&dev_attr_bd_count.attr,
+	&dev_attr_bd_reads.attr,
+	&dev_attr_bd_writes.attr,
+#endif
 	NULL,
 };
 
@@ -896,11 +2269,123 @@ static struct attribute_group zram_disk_attr_group = {
 	.attrs = zram_disk_attrs,
 };
 
+#ifdef CONFIG_ZRAM_MEMORY_TRACKING
+static struct dentry *zram_debugfs_root;
+
+/*
+ * One line per stored block: index, object size, seconds since last
+ * access and flags (s: same filled, w: written back, h: huge, i: idle,
+ * d: deduplicated, r: recompressed). *ppos is the next block index.
+ */
+static ssize_t read_block_state(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct zram *zram = file->private_data;
+	struct zram_meta *meta;
+	size_t index, nr_pages;
+	ssize_t written = 0;
+	char *kbuf;
+
+	if (count > PAGE_SIZE)
+		count = PAGE_SIZE;
+	kbuf = kmalloc(count, GFP_KERNEL);
+	if (!kbuf)
+		return -ENOMEM;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		up_read(&zram->init_lock);
+		kfree(kbuf);
+		return -EINVAL;
+	}
+
+	meta = zram->meta;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = *ppos; index < nr_pages; index++) {
+		int copied;
+
+		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		if (!zram_allocated(meta, index))
+			goto next;
+
+		copied = snprintf(kbuf + written, count,
+			"%12zu %6zu %10lu %c%c%c%c%c%c\n",
+			index, zram_get_obj_size(meta, index),
+			(jiffies - meta->table[index].ac_time) / HZ,
+			zram_test_flag(meta, index, ZRAM_SAME) ? 's' : '.',
+			zram_test_flag(meta, index, ZRAM_WB) ? 'w' : '.',
+			zram_test_flag(meta, index, ZRAM_HUGE) ? 'h' : '.',
+			zram_test_flag(meta, index, ZRAM_IDLE) ? 'i' : '.',
+			zram_test_flag(meta, index, ZRAM_DEDUP) ? 'd' : '.',
+			zram_test_flag(meta, index, ZRAM_RECOMP) ? 'r' : '.');
+		if (copied >= count) {
+			/* no room for this line, stop before it */
+			bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+			/* a buffer too short for a single line is not EOF */
+			if (!written)
+				written = -EINVAL;
+			break;
+		}
+		written += copied;
+		count -= copied;
+next:
+		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		*ppos += 1;
+	}
+	up_read(&zram->init_lock);
+
+	if (written > 0 && copy_to_user(buf, kbuf, written))
+		written = -EFAULT;
+	kfree(kbuf);
+
+	return written;
+}
+
+static const struct file_operations zram_block_state_fops = {
+	.open = simple_open,
+	.read = read_block_state,
+	.llseek = default_llseek,
+};
+
+static void zram_debugfs_create(void)
+{
+	zram_debugfs_root = debugfs_create_dir("zram", NULL);
+}
+
+static void zram_debugfs_destroy(void)
+{
+	debugfs_remove_recursive(zram_debugfs_root);
+}
+
+static void zram_debugfs_register(struct zram *zram)
+{
+	if (IS_ERR_OR_NULL(zram_debugfs_root))
+		return;
+
+	zram->debugfs_dir = debugfs_create_dir(zram->disk->disk_name,
+						zram_debugfs_root);
+	debugfs_create_file("block_state", S_IRUSR, zram->debugfs_dir,
+			    zram, &zram_block_state_fops);
+}
+
+static void zram_debugfs_unregister(struct zram *zram)
+{
+	debugfs_remove_recursive(zram->debugfs_dir);
+}
+#else
+static void zram_debugfs_create(void) { }
+static void zram_debugfs_destroy(void) { }
+static void zram_debugfs_register(struct zram *zram) { }
+static void zram_debugfs_unregister(struct zram *zram) { }
+#endif
+
 static int create_device(struct zram *zram, int device_id)
 {
 	int ret = -ENOMEM;
 
 	init_rwsem(&zram->init_lock);
+	atomic_set(&zram->refcount, 0);
+	init_waitqueue_head(&zram->io_done);
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -968,6 +2453,7 @@ static int create_device(struct zram *zram, int device_id)
 	strlcpy(zram->compressor, default_compressor, sizeof(zram->compressor));
 	zram->meta = NULL;
 	zram->max_comp_streams = 1;
+	zram_debugfs_register(zram);
 	return 0;
 
 out_free_disk:
@@ -981,6 +2467,7 @@ out:
 
 static void destroy_device(struct zram *zram)
 {
+	zram_debugfs_unregister(zram);
 	sysfs_remove_group(&disk_to_dev(zram->disk)->kobj,
 			&zram_disk_attr_group);
 
@@ -1001,13 +2488,22 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	/* swap out goes through zram_wq, it must make forward progress */
+	zram_wq = alloc_workqueue("zram", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!zram_wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warn("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto destroy_wq;
 	}
 
+	zram_debugfs_create();
+
 	/* Allocate the device array and initialize each one */
 	zram_devices = kzalloc(num_devices * sizeof(struct zram), GFP_KERNEL);
 	if (!zram_devices) {
@@ -1030,7 +2526,10 @@ free_devices:
 		destroy_device(&zram_devices[--dev_id]);
 	kfree(zram_devices);
 unregister:
+	zram_debugfs_destroy();
 	unregister_blkdev(zram_major, "zram");
+destroy_wq:
+	destroy_workqueue(zram_wq);
 out:
 	return ret;
 }
@@ -1051,7 +2550,9 @@ static void __exit zram_exit(void)
 		zram_reset_device(zram, false);
 	}
 
+	zram_debugfs_destroy();
 	unregister_blkdev(zram_major, "zram");
+	destroy_workqueue(zram_wq);
 
 	kfree(zram_devices);
 	pr_debug("Cleanup done!\n");
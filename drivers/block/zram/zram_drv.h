@@ -16,10 +16,12 @@
 #define _ZRAM_DRV_H_
 
 #include <linux/spinlock.h>
+#include <linux/wait.h>
 
 #include <linux/zsmalloc.h>
 
 #include "zcomp.h"
+#include "zram_dedup.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -66,9 +68,15 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /* Flags for zram pages (table[page_no].value) */
 enum zram_pageflags {
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO = ZRAM_FLAG_SHIFT + 1,
+	/* Page consists of a single repeated word, kept in table.element */
+	ZRAM_SAME = ZRAM_FLAG_SHIFT + 1,
 	ZRAM_ACCESS,	/* page in now accessed */
+	/* handle points to a shared struct zram_dedup_entry */
+	ZRAM_DEDUP,
+	ZRAM_WB,	/* page is stored on backing device at table.blk_idx */
+	ZRAM_IDLE,	/* page not accessed since last idle marking */
+	ZRAM_HUGE,	/* incompressible page, stored as is */
+	ZRAM_RECOMP,	/* object compressed with the recompression backend */
 
 	__NR_ZRAM_PAGEFLAGS,
 };
@@ -77,8 +85,15 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct zram_table_entry {
-	unsigned long handle;
+	union {
+		unsigned long handle;
+		unsigned long element;	/* fill word of ZRAM_SAME pages */
+		unsigned long blk_idx;	/* backing device block of ZRAM_WB */
+	};
 	unsigned long value;
+#ifdef CONFIG_ZRAM_MEMORY_TRACKING
+	unsigned long ac_time;	/* jiffies of last read or write */
+#endif
 };
 
 struct zram_stats {
@@ -90,12 +105,27 @@ struct zram_stats {
 	atomic64_t invalid_io;	/* non-page-aligned I/O requests */
 	atomic64_t notify_free;	/* no. of swap slot free notifications */
 	atomic64_t zero_pages;		/* no. of zero filled pages */
+	atomic64_t same_pages;		/* no. of same word filled pages */
 	atomic64_t pages_stored;	/* no. of pages currently stored */
+	atomic64_t dedup_hits;		/* no. of writes served by dedup */
+	atomic64_t dedup_saved_bytes;	/* compressed bytes shared by dedup */
+	atomic64_t recomp_pages;	/* no. of pages recompressed */
+	atomic64_t recomp_saved_bytes;	/* bytes reclaimed by recompression */
+	atomic64_t parallel_bios;	/* no. of bios compressed in parallel */
+	atomic64_t parallel_pages;	/* no. of pages of such bios */
+	atomic64_t bd_count;		/* no. of pages in backing device */
+	atomic64_t bd_reads;		/* no. of reads from backing device */
+	atomic64_t bd_writes;		/* no. of writes to backing device */
 };
 
 struct zram_meta {
 	struct zram_table_entry *table;
 	struct zs_pool *mem_pool;
+#ifdef CONFIG_ZRAM_DEDUP
+	/* content checksum index of stored objects, NULL if disabled */
+	struct hlist_bl_head *dedup_table;
+	u32 dedup_mask;
+#endif
 };
 
 struct zram {
@@ -103,16 +133,51 @@ struct zram {
 	struct request_queue *queue;
 	struct gendisk *disk;
 	struct zcomp *comp;
-	
-	/* Prevent concurrent execution of device init, reset and R/W request */
+	/* secondary backend for pages staying long in zram, or NULL */
+	struct zcomp *recomp;
+
+	/*
+	 * Prevent concurrent execution of device init, reset and sysfs
+	 * operations walking the table. I/O requests don't take it, they
+	 * pin meta with refcount and only serialize on per-slot locks.
+	 */
 	struct rw_semaphore init_lock;
+	/* 1 + no. of I/O in flight while initialised, 0 otherwise */
+	atomic_t refcount;
+	/* reset waits here for refcount to drop to 0 */
+	wait_queue_head_t io_done;
 	/*
 	 * This is the limit on amount of *uncompressed* worth of data
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
 	int max_comp_streams;
+	/* use one compression stream per cpu instead of max_comp_streams */
+	bool percpu_comp_streams;
+	/* share compressed objects between identical pages */
+	bool use_dedup;
+	/*
+	 * Write bios of at least this many full pages are compressed in
+	 * parallel on several CPUs, 0 disables parallel compression.
+	 */
+	unsigned int parallel_threshold;
 	struct zram_stats stats;
 	char compressor[10];
+	char recomp_compressor[10];
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* block device pages are written back to, NULL if none */
+	struct file *backing_dev;
+	struct block_device *bdev;
+	unsigned int old_block_size;
+	/* allocated PAGE_SIZE blocks of bdev, bit 0 is never used */
+	unsigned long *bitmap;
+	/* blocks being read, their free is deferred to the read end */
+	unsigned long *read_bitmap;
+	unsigned long *free_bitmap;
+	unsigned long nr_pages;
+#endif
+#ifdef CONFIG_ZRAM_MEMORY_TRACKING
+	struct dentry *debugfs_dir;
+#endif
 };
 #endif
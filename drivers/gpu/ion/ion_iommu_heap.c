@@ -467,6 +467,8 @@ static int ion_iommu_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 							heap);
 	int i;
 	unsigned long total = 0;
+	unsigned long hits, misses;
+	int pcp_count;
 
 	seq_printf(s, "Cached Pools:\n");
 	for (i = 0; i < num_orders; i++) {
@@ -477,9 +479,12 @@ static int ion_iommu_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 		seq_printf(s, "%d order %u lowmem pages in pool = %lx total\n",
 			   pool->low_count, pool->order,
 			   (1 << pool->order) * PAGE_SIZE * pool->low_count);
+		ion_page_pool_stats(pool, &hits, &misses, &pcp_count);
+		seq_printf(s, "%d order %u pages in per cpu caches, %lu hits %lu misses\n",
+			   pcp_count, pool->order, hits, misses);
 
 		total += (1 << pool->order) * PAGE_SIZE *
-			  (pool->low_count + pool->high_count);
+			  (pool->low_count + pool->high_count + pcp_count);
 	}
 
 	seq_printf(s, "Uncached Pools:\n");
@@ -491,9 +496,12 @@ static int ion_iommu_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 		seq_printf(s, "%d order %u lowmem pages in pool = %lx total\n",
 			   pool->low_count, pool->order,
 			   (1 << pool->order) * PAGE_SIZE * pool->low_count);
+		ion_page_pool_stats(pool, &hits, &misses, &pcp_count);
+		seq_printf(s, "%d order %u pages in per cpu caches, %lu hits %lu misses\n",
+			   pcp_count, pool->order, hits, misses);
 
 		total += (1 << pool->order) * PAGE_SIZE *
-			  (pool->low_count + pool->high_count);
+			  (pool->low_count + pool->high_count + pcp_count);
 	}
 	seq_printf(s, "Total bytes in pool: %lx\n", total);
 	return 0;
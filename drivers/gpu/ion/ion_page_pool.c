@@ -20,32 +20,27 @@
 #include <linux/fs.h>
 #include <linux/list.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
 #include <linux/slab.h>
 #include <linux/swap.h>
 #include <linux/vmalloc.h>
 #include "ion_priv.h"
 
-#define IONPOOL_MAGIC 0x1F3D5B79
+/* pages each per cpu cache may hold, orders above 6 bypass the caches */
+#define ION_POOL_PCP_PAGES	64
 
-struct ion_page_pool_item {
-	unsigned int guard;
-	unsigned int magic;
-	struct page *page;
-	struct list_head list;
-	unsigned long ts;
-};
-
-
-static void *ion_page_pool_alloc_pages(struct ion_page_pool *pool)
+static void *ion_page_pool_alloc_pages(struct ion_page_pool *pool,
+				       gfp_t extra_gfp)
 {
 	struct page *page;
 	struct scatterlist sg;
 	const bool high_order = pool->order > 4;
+	gfp_t gfp_mask = pool->gfp_mask | extra_gfp;
 
 	if (high_order)
-		page = alloc_pages(pool->gfp_mask & ~__GFP_ZERO, pool->order);
+		page = alloc_pages(gfp_mask & ~__GFP_ZERO, pool->order);
 	else
-		page = alloc_pages(pool->gfp_mask, pool->order);
+		page = alloc_pages(gfp_mask, pool->order);
 
 	if (!page)
 		return NULL;
@@ -73,88 +68,122 @@ static void ion_page_pool_free_pages(struct ion_page_pool *pool,
 	__free_pages(page, pool->order);
 }
 
-static int ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
+static void ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
 {
-	struct ion_page_pool_item *item;
-
-	item = kmalloc(sizeof(struct ion_page_pool_item), GFP_KERNEL);
-	if (!item)
-		return -ENOMEM;
-
-	mutex_lock(&pool->mutex);
-	item->guard = 0x0;
-	item->magic = IONPOOL_MAGIC;
-	item->ts = jiffies;
-
-	item->page = page;
+	spin_lock(&pool->lock);
 	if (PageHighMem(page)) {
-		list_add_tail(&item->list, &pool->high_items);
+		list_add_tail(&page->lru, &pool->high_items);
 		pool->high_count++;
 	} else {
-		list_add_tail(&item->list, &pool->low_items);
+		list_add_tail(&page->lru, &pool->low_items);
 		pool->low_count++;
 	}
-	mutex_unlock(&pool->mutex);
-	return 0;
+	spin_unlock(&pool->lock);
 }
 
 static struct page *ion_page_pool_remove(struct ion_page_pool *pool, bool high)
 {
-	struct ion_page_pool_item *item;
 	struct page *page;
 
 	if (high) {
 		BUG_ON(!pool->high_count);
-		item = list_first_entry(&pool->high_items,
-					struct ion_page_pool_item, list);
+		page = list_first_entry(&pool->high_items, struct page, lru);
 		pool->high_count--;
 	} else {
 		BUG_ON(!pool->low_count);
-		item = list_first_entry(&pool->low_items,
-					struct ion_page_pool_item, list);
+		page = list_first_entry(&pool->low_items, struct page, lru);
 		pool->low_count--;
 	}
 
-	if (item->guard || (item->magic != IONPOOL_MAGIC)) {
-		pr_warn("[WARN] %s: possible memory corruption detected. \n", __func__);
-		pr_warn("  pool(%p)={order=%d, count=%d/%d, mask=0x%x}\n",
-			pool, pool->order, pool->high_count, pool->low_count, pool->gfp_mask);
-		pr_warn("  item(%p)={0x%x, 0x%08x, %p, %lu} was created since %d msec ago.\n",
-			item, item->guard, item->magic, item->page, item->ts,
-			jiffies_to_msecs(jiffies - item->ts));
-	}
-	list_del(&item->list);
-	page = item->page;
-	item->magic = ~IONPOOL_MAGIC;
-	kfree(item);
+	list_del(&page->lru);
 	return page;
 }
 
+static bool ion_page_pool_needs_refill(struct ion_page_pool *pool)
+{
+	return pool->high_count + pool->low_count < pool->refill_target;
+}
+
+static void ion_page_pool_refill(struct work_struct *work)
+{
+	struct ion_page_pool *pool = container_of(work, struct ion_page_pool,
+						  refill_work);
+	struct page *page;
+
+	while (ion_page_pool_needs_refill(pool)) {
+		/* a refill is not worth pushing the system into reclaim */
+		page = ion_page_pool_alloc_pages(pool,
+					__GFP_NORETRY | __GFP_NOWARN);
+		if (!page)
+			break;
+		ion_page_pool_add(pool, page);
+	}
+}
+
 void *ion_page_pool_alloc(struct ion_page_pool *pool)
 {
+	struct ion_page_pool_cpu *pcp;
 	struct page *page = NULL;
 
 	BUG_ON(!pool);
 
-	mutex_lock(&pool->mutex);
-	if (pool->high_count)
-		page = ion_page_pool_remove(pool, true);
-	else if (pool->low_count)
-		page = ion_page_pool_remove(pool, false);
-	mutex_unlock(&pool->mutex);
+	pcp = get_cpu_ptr(pool->cpu);
+	spin_lock(&pcp->lock);
+	if (pcp->count) {
+		page = list_first_entry(&pcp->pages, struct page, lru);
+		list_del(&page->lru);
+		pcp->count--;
+	}
+	spin_unlock(&pcp->lock);
+	put_cpu_ptr(pool->cpu);
 
-	if (!page)
-		page = ion_page_pool_alloc_pages(pool);
+	if (!page) {
+		spin_lock(&pool->lock);
+		if (pool->high_count)
+			page = ion_page_pool_remove(pool, true);
+		else if (pool->low_count)
+			page = ion_page_pool_remove(pool, false);
+		spin_unlock(&pool->lock);
+	}
+
+	if (page) {
+		this_cpu_inc(pool->cpu->hits);
+	} else {
+		this_cpu_inc(pool->cpu->misses);
+		page = ion_page_pool_alloc_pages(pool, 0);
+	}
+
+	if (ion_page_pool_needs_refill(pool))
+		schedule_work(&pool->refill_work);
 	return page;
 }
 
 void ion_page_pool_free(struct ion_page_pool *pool, struct page* page)
 {
-	int ret;
+	struct ion_page_pool_cpu *pcp;
+
+	pcp = get_cpu_ptr(pool->cpu);
+	spin_lock(&pcp->lock);
+	if (pcp->count < pool->pcp_high) {
+		list_add(&page->lru, &pcp->pages);
+		pcp->count++;
+		page = NULL;
+	}
+	spin_unlock(&pcp->lock);
+	put_cpu_ptr(pool->cpu);
 
-	ret = ion_page_pool_add(pool, page);
-	if (ret)
-		ion_page_pool_free_pages(pool, page);
+	if (page)
+		ion_page_pool_add(pool, page);
+}
+
+static int ion_page_pool_pcp_count(struct ion_page_pool *pool)
+{
+	int cpu;
+	int count = 0;
+
+	for_each_possible_cpu(cpu)
+		count += per_cpu_ptr(pool->cpu, cpu)->count;
+	return count;
 }
 
 static int ion_page_pool_total(struct ion_page_pool *pool, bool high)
@@ -164,9 +193,42 @@ static int ion_page_pool_total(struct ion_page_pool *pool, bool high)
 	total += high ? (pool->high_count + pool->low_count) *
 		(1 << pool->order) :
 			pool->low_count * (1 << pool->order);
+	total += ion_page_pool_pcp_count(pool) * (1 << pool->order);
 	return total;
 }
 
+/* Frees up to nr_to_scan pages from the per cpu caches */
+static int ion_page_pool_drain_cpus(struct ion_page_pool *pool, bool high,
+				    int nr_to_scan)
+{
+	struct page *page, *tmp;
+	LIST_HEAD(pages);
+	int nr = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct ion_page_pool_cpu *pcp = per_cpu_ptr(pool->cpu, cpu);
+
+		spin_lock(&pcp->lock);
+		list_for_each_entry_safe(page, tmp, &pcp->pages, lru) {
+			if (nr >= nr_to_scan)
+				break;
+			if (!high && PageHighMem(page))
+				continue;
+			list_move(&page->lru, &pages);
+			pcp->count--;
+			nr++;
+		}
+		spin_unlock(&pcp->lock);
+	}
+
+	list_for_each_entry_safe(page, tmp, &pages, lru) {
+		list_del(&page->lru);
+		ion_page_pool_free_pages(pool, page);
+	}
+	return nr;
+}
+
 int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
 				int nr_to_scan)
 {
@@ -185,36 +247,78 @@ int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
 	for (i = 0; i < nr_to_scan; i++) {
 		struct page *page;
 
-		mutex_lock(&pool->mutex);
+		spin_lock(&pool->lock);
 		if (pool->low_count) {
 			page = ion_page_pool_remove(pool, false);
 		} else if (high && pool->high_count) {
 			page = ion_page_pool_remove(pool, true);
 		} else {
-			mutex_unlock(&pool->mutex);
+			spin_unlock(&pool->lock);
 			break;
 		}
-		mutex_unlock(&pool->mutex);
+		spin_unlock(&pool->lock);
 		ion_page_pool_free_pages(pool, page);
 		nr_freed += (1 << pool->order);
 	}
 
+	if (i < nr_to_scan)
+		nr_freed += ion_page_pool_drain_cpus(pool, high,
+						     nr_to_scan - i) <<
+			pool->order;
+
 	return nr_freed;
 }
 
+void ion_page_pool_set_refill(struct ion_page_pool *pool, int nr_pages)
+{
+	pool->refill_target = nr_pages >> pool->order;
+}
+
+void ion_page_pool_stats(struct ion_page_pool *pool, unsigned long *hits,
+			 unsigned long *misses, int *pcp_count)
+{
+	int cpu;
+
+	*hits = 0;
+	*misses = 0;
+	for_each_possible_cpu(cpu) {
+		struct ion_page_pool_cpu *pcp = per_cpu_ptr(pool->cpu, cpu);
+
+		*hits += pcp->hits;
+		*misses += pcp->misses;
+	}
+	*pcp_count = ion_page_pool_pcp_count(pool);
+}
+
 struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
 {
 	struct ion_page_pool *pool = kmalloc(sizeof(struct ion_page_pool),
 					     GFP_KERNEL);
+	int cpu;
+
 	if (!pool)
 		return NULL;
+	pool->cpu = alloc_percpu(struct ion_page_pool_cpu);
+	if (!pool->cpu) {
+		kfree(pool);
+		return NULL;
+	}
+	for_each_possible_cpu(cpu) {
+		struct ion_page_pool_cpu *pcp = per_cpu_ptr(pool->cpu, cpu);
+
+		spin_lock_init(&pcp->lock);
+		INIT_LIST_HEAD(&pcp->pages);
+	}
+	pool->pcp_high = ION_POOL_PCP_PAGES >> order;
+	pool->refill_target = 0;
+	INIT_WORK(&pool->refill_work, ion_page_pool_refill);
 	pool->high_count = 0;
 	pool->low_count = 0;
 	INIT_LIST_HEAD(&pool->low_items);
 	INIT_LIST_HEAD(&pool->high_items);
 	pool->gfp_mask = gfp_mask;
 	pool->order = order;
-	mutex_init(&pool->mutex);
+	spin_lock_init(&pool->lock);
 	plist_node_init(&pool->list, order);
 
 	return pool;
@@ -222,6 +326,27 @@ struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
 
 void ion_page_pool_destroy(struct ion_page_pool *pool)
 {
+	struct page *page, *tmp;
+	int cpu;
+
+	cancel_work_sync(&pool->refill_work);
+	for_each_possible_cpu(cpu) {
+		struct ion_page_pool_cpu *pcp = per_cpu_ptr(pool->cpu, cpu);
+
+		list_for_each_entry_safe(page, tmp, &pcp->pages, lru) {
+			list_del(&page->lru);
+			ion_page_pool_free_pages(pool, page);
+		}
+	}
+	list_for_each_entry_safe(page, tmp, &pool->high_items, lru) {
+		list_del(&page->lru);
+		ion_page_pool_free_pages(pool, page);
+	}
+	list_for_each_entry_safe(page, tmp, &pool->low_items, lru) {
+		list_del(&page->lru);
+		ion_page_pool_free_pages(pool, page);
+	}
+	free_percpu(pool->cpu);
 	kfree(pool);
 }
 
@@ -22,6 +22,7 @@
 #include <linux/kref.h>
 #include <linux/mm_types.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
 #include <linux/rbtree.h>
 #include <linux/seq_file.h>
 
@@ -29,6 +30,7 @@
 #include <linux/sched.h>
 #include <linux/shrinker.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 
 struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
 
@@ -163,21 +165,41 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
 #define ION_CARVEOUT_ALLOCATE_FAIL -1
 
 
+/* per cpu cache in front of a pool, the lock is only contended by the shrinker */
+struct ion_page_pool_cpu {
+	spinlock_t lock;
+	int count;
+	struct list_head pages;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+/*
+ * Pooled pages are linked through page->lru. refill_work tops the shared
+ * lists up to refill_target pages after an allocation drained them.
+ */
 struct ion_page_pool {
 	int high_count;
 	int low_count;
 	struct list_head high_items;
 	struct list_head low_items;
-	struct mutex mutex;
+	spinlock_t lock;
 	gfp_t gfp_mask;
 	unsigned int order;
 	struct plist_node list;
+	struct ion_page_pool_cpu __percpu *cpu;
+	int pcp_high;
+	int refill_target;
+	struct work_struct refill_work;
 };
 
 struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
 void ion_page_pool_destroy(struct ion_page_pool *);
 void *ion_page_pool_alloc(struct ion_page_pool *);
 void ion_page_pool_free(struct ion_page_pool *, struct page *);
+void ion_page_pool_set_refill(struct ion_page_pool *pool, int nr_pages);
+void ion_page_pool_stats(struct ion_page_pool *pool, unsigned long *hits,
+			 unsigned long *misses, int *pcp_count);
 
 int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
 			  int nr_to_scan);
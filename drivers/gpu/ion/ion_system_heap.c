@@ -36,6 +36,8 @@ static unsigned int low_order_gfp_flags  = (GFP_HIGHUSER | __GFP_ZERO |
 					 __GFP_NOWARN);
 static const unsigned int orders[] = {9, 8, 4, 0};
 static const int num_orders = ARRAY_SIZE(orders);
+/* each pool is refilled in the background to hold about 1MB */
+#define ION_SYSTEM_POOL_REFILL_PAGES	256
 static int order_to_index(unsigned int order)
 {
 	int i;
@@ -312,6 +314,9 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 							heap);
 	int i;
 	unsigned long total_pages = 0;
+	unsigned long hits, misses;
+	int pcp_count;
+
 	for (i = 0; i < num_orders; i++) {
 		struct ion_page_pool *pool = sys_heap->uncached_pools[i];
 		seq_printf(s,
@@ -322,7 +327,12 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 			"%d order %u lowmem pages in uncached pool = %lu total\n",
 			pool->low_count, pool->order,
 			(1 << pool->order) * PAGE_SIZE * pool->low_count);
-		total_pages += (1 << pool->order) * (pool->high_count + pool->low_count);
+		ion_page_pool_stats(pool, &hits, &misses, &pcp_count);
+		seq_printf(s,
+			"%d order %u pages in uncached per cpu caches, %lu hits %lu misses\n",
+			pcp_count, pool->order, hits, misses);
+		total_pages += (1 << pool->order) *
+			(pool->high_count + pool->low_count + pcp_count);
 	}
 
 	for (i = 0; i < num_orders; i++) {
@@ -335,7 +345,12 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 			"%d order %u lowmem pages in cached pool = %lu total\n",
 			pool->low_count, pool->order,
 			(1 << pool->order) * PAGE_SIZE * pool->low_count);
-		total_pages += (1 << pool->order) * (pool->high_count + pool->low_count);
+		ion_page_pool_stats(pool, &hits, &misses, &pcp_count);
+		seq_printf(s,
+			"%d order %u pages in cached per cpu caches, %lu hits %lu misses\n",
+			pcp_count, pool->order, hits, misses);
+		total_pages += (1 << pool->order) *
+			(pool->high_count + pool->low_count + pcp_count);
 	}
 
 	seq_printf(s,
@@ -367,6 +382,7 @@ static int ion_system_heap_create_pools(struct ion_page_pool **pools)
 		pool = ion_page_pool_create(gfp_flags, orders[i]);
 		if (!pool)
 			goto err_create_pool;
+		ion_page_pool_set_refill(pool, ION_SYSTEM_POOL_REFILL_PAGES);
 		pools[i] = pool;
 	}
 	return 0;
@@ -27,6 +27,8 @@
 #include <linux/personality.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/wait.h>
 #include <linux/shmem_fs.h>
 #include <linux/ashmem.h>
 #include <asm/cacheflush.h>
@@ -37,7 +39,7 @@
 
 struct ashmem_area {
 	char name[ASHMEM_FULL_NAME_LEN]; 
-	struct list_head unpinned_list;	 
+	struct rb_root unpinned_root;	 
 	struct file *file;		 
 	size_t size;			 
 	unsigned long vm_start;		 
@@ -46,7 +48,7 @@ struct ashmem_area {
 
 struct ashmem_range {
 	struct list_head lru;		
-	struct list_head unpinned;	
+	struct rb_node unpinned;	
 	struct ashmem_area *asma;	
 	size_t pgstart;			
 	size_t pgend;			
@@ -59,6 +61,17 @@ static unsigned long lru_count;
 
 static DEFINE_MUTEX(ashmem_mutex);
 
+/*
+ * Purge batches truncating without ashmem_mutex. Pinning waits for them
+ * with the mutex held, so a range cannot be pinned and written between
+ * being marked purged and being truncated.
+ */
+static atomic_t ashmem_shrink_inflight = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(ashmem_shrink_wait);
+
+/* ranges purged per hold of ashmem_mutex */
+#define ASHMEM_PURGE_BATCH	16
+
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
@@ -98,8 +111,65 @@ static inline void lru_del(struct ashmem_range *range)
 	lru_count -= range_size(range);
 }
 
-static int range_alloc(struct ashmem_area *asma,
-		       struct ashmem_range *prev_range, unsigned int purged,
+/*
+ * The unpinned ranges of an area never overlap, so ordering them by
+ * pgstart orders them by pgend as well and the tree works as an interval
+ * index.
+ */
+static void range_insert(struct ashmem_area *asma, struct ashmem_range *range)
+{
+	struct rb_node **p = &asma->unpinned_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct ashmem_range *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct ashmem_range, unpinned);
+
+		if (range->pgstart < entry->pgstart)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&range->unpinned, parent, p);
+	rb_insert_color(&range->unpinned, &asma->unpinned_root);
+}
+
+/* Returns the lowest unpinned range overlapping [pgstart, pgend], or NULL */
+static struct ashmem_range *range_first_overlap(struct ashmem_area *asma,
+						size_t pgstart, size_t pgend)
+{
+	struct rb_node *n = asma->unpinned_root.rb_node;
+	struct ashmem_range *range, *found = NULL;
+
+	while (n) {
+		range = rb_entry(n, struct ashmem_range, unpinned);
+
+		if (range_before_page(range, pgstart)) {
+			n = n->rb_right;
+		} else {
+			found = range;
+			n = n->rb_left;
+		}
+	}
+	if (found && found->pgstart > pgend)
+		return NULL;
+	return found;
+}
+
+/* Returns the range after range if it still overlaps [.., pgend] */
+static struct ashmem_range *range_next_overlap(struct ashmem_range *range,
+					       size_t pgend)
+{
+	struct rb_node *n = rb_next(&range->unpinned);
+
+	if (!n)
+		return NULL;
+	range = rb_entry(n, struct ashmem_range, unpinned);
+	return range->pgstart <= pgend ? range : NULL;
+}
+
+static int range_alloc(struct ashmem_area *asma, unsigned int purged,
 		       size_t start, size_t end)
 {
 	struct ashmem_range *range;
@@ -117,7 +187,7 @@ static int range_alloc(struct ashmem_area *asma,
 	range->pgend = end;
 	range->purged = purged;
 
-	list_add_tail(&range->unpinned, &prev_range->unpinned);
+	range_insert(asma, range);
 
 	if (range_on_lru(range))
 		lru_add(range);
@@ -127,7 +197,7 @@ static int range_alloc(struct ashmem_area *asma,
 
 static void range_del(struct ashmem_range *range)
 {
-	list_del(&range->unpinned);
+	rb_erase(&range->unpinned, &range->asma->unpinned_root);
 	if (range_on_lru(range))
 		lru_del(range);
 	kmem_cache_free(ashmem_range_cachep, range);
@@ -162,7 +232,7 @@ static int ashmem_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 	}
 
-	INIT_LIST_HEAD(&asma->unpinned_list);
+	asma->unpinned_root = RB_ROOT;
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
 	file->private_data = asma;
@@ -173,11 +243,11 @@ static int ashmem_open(struct inode *inode, struct file *file)
 static int ashmem_release(struct inode *ignored, struct file *file)
 {
 	struct ashmem_area *asma = file->private_data;
-	struct ashmem_range *range, *next;
+	struct rb_node *n;
 
 	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
-		range_del(range);
+	while ((n = rb_first(&asma->unpinned_root)))
+		range_del(rb_entry(n, struct ashmem_range, unpinned));
 	mutex_unlock(&ashmem_mutex);
 
 	if (asma->file)
@@ -307,9 +377,23 @@ out:
 	return ret;
 }
 
+struct ashmem_purge {
+	struct file *file;
+	loff_t start;
+	loff_t end;
+};
+
+/*
+ * Ranges are taken off the lru and marked purged ASHMEM_PURGE_BATCH at a
+ * time under ashmem_mutex, then truncated with the mutex dropped so pin
+ * and unpin of other areas are not held up behind the truncation.
+ */
 static int ashmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
+	struct ashmem_purge batch[ASHMEM_PURGE_BATCH];
 	struct ashmem_range *range, *next;
+	long nr_to_scan = sc->nr_to_scan;
+	int i, nr;
 
 	
 	if (sc->nr_to_scan && !(sc->gfp_mask & __GFP_FS))
@@ -320,18 +404,35 @@ static int ashmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	if (!mutex_trylock(&ashmem_mutex))
 		return -1;
 
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
+	while (nr_to_scan > 0 && !list_empty(&ashmem_lru_list)) {
+		nr = 0;
+		list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
+			batch[nr].file = range->asma->file;
+			batch[nr].start = range->pgstart * PAGE_SIZE;
+			batch[nr].end = (range->pgend + 1) * PAGE_SIZE - 1;
+			get_file(batch[nr].file);
+			nr++;
+
+			range->purged = ASHMEM_WAS_PURGED;
+			lru_del(range);
+
+			nr_to_scan -= range_size(range);
+			if (nr_to_scan <= 0 || nr == ASHMEM_PURGE_BATCH)
+				break;
+		}
+		atomic_inc(&ashmem_shrink_inflight);
+		mutex_unlock(&ashmem_mutex);
 
-		vmtruncate_range(inode, start, end);
-		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
+		for (i = 0; i < nr; i++) {
+			vmtruncate_range(batch[i].file->f_dentry->d_inode,
+					 batch[i].start, batch[i].end);
+			fput(batch[i].file);
+		}
 
-		sc->nr_to_scan -= range_size(range);
-		if (sc->nr_to_scan <= 0)
-			break;
+		if (atomic_dec_and_test(&ashmem_shrink_inflight))
+			wake_up_all(&ashmem_shrink_wait);
+		if (!mutex_trylock(&ashmem_mutex))
+			return -1;
 	}
 	mutex_unlock(&ashmem_mutex);
 
@@ -415,37 +516,32 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 	struct ashmem_range *range, *next;
 	int ret = ASHMEM_NOT_PURGED;
 
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
+	for (range = range_first_overlap(asma, pgstart, pgend); range;
+	     range = next) {
+		next = range_next_overlap(range, pgend);
+		ret |= range->purged;
+
+
+		if (page_range_subsumes_range(range, pgstart, pgend)) {
+			range_del(range);
+			continue;
+		}
+
 		
-		if (range_before_page(range, pgstart))
-			break;
-
-		if (page_range_in_range(range, pgstart, pgend)) {
-			ret |= range->purged;
-
-			
-			if (page_range_subsumes_range(range, pgstart, pgend)) {
-				range_del(range);
-				continue;
-			}
-
-			
-			if (range->pgstart >= pgstart) {
-				range_shrink(range, pgend + 1, range->pgend);
-				continue;
-			}
-
-			
-			if (range->pgend <= pgend) {
-				range_shrink(range, range->pgstart, pgstart-1);
-				continue;
-			}
-
-			range_alloc(asma, range, range->purged,
-				    pgend + 1, range->pgend);
+		if (range->pgstart >= pgstart) {
+			range_shrink(range, pgend + 1, range->pgend);
+			continue;
+		}
+
+
+		if (range->pgend <= pgend) {
 			range_shrink(range, range->pgstart, pgstart - 1);
-			break;
+			continue;
 		}
+
+		range_alloc(asma, range->purged, pgend + 1, range->pgend);
+		range_shrink(range, range->pgstart, pgstart - 1);
+		break;
 	}
 
 	return ret;
@@ -453,45 +549,27 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
-	struct ashmem_range *range, *next;
+	struct ashmem_range *range;
 	unsigned int purged = ASHMEM_NOT_PURGED;
 
-restart:
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
-		
-		if (range_before_page(range, pgstart))
-			break;
-
+	while ((range = range_first_overlap(asma, pgstart, pgend))) {
 		if (page_range_subsumed_by_range(range, pgstart, pgend))
 			return 0;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			pgstart = min_t(size_t, range->pgstart, pgstart),
-			pgend = max_t(size_t, range->pgend, pgend);
-			purged |= range->purged;
-			range_del(range);
-			goto restart;
-		}
+		pgstart = min_t(size_t, range->pgstart, pgstart);
+		pgend = max_t(size_t, range->pgend, pgend);
+		purged |= range->purged;
+		range_del(range);
 	}
 
-	return range_alloc(asma, range, purged, pgstart, pgend);
+	return range_alloc(asma, purged, pgstart, pgend);
 }
 
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
 {
-	struct ashmem_range *range;
-	int ret = ASHMEM_IS_PINNED;
-
-	list_for_each_entry(range, &asma->unpinned_list, unpinned) {
-		if (range_before_page(range, pgstart))
-			break;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			ret = ASHMEM_IS_UNPINNED;
-			break;
-		}
-	}
-
-	return ret;
+	if (range_first_overlap(asma, pgstart, pgend))
+		return ASHMEM_IS_UNPINNED;
+	return ASHMEM_IS_PINNED;
 }
 
 static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
@@ -524,6 +602,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
 
 	mutex_lock(&ashmem_mutex);
+	wait_event(ashmem_shrink_wait, !atomic_read(&ashmem_shrink_inflight));
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -32,11 +32,23 @@ enum {
 	BINDER_TYPE_HANDLE	= B_PACK_CHARS('s', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_WEAK_HANDLE	= B_PACK_CHARS('w', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_FD		= B_PACK_CHARS('f', 'd', '*', B_TYPE_LARGE),
+	BINDER_TYPE_PTR		= B_PACK_CHARS('p', 't', '*', B_TYPE_LARGE),
 };
 
 enum {
 	FLAT_BINDER_FLAG_PRIORITY_MASK = 0xff,
 	FLAT_BINDER_FLAG_ACCEPTS_FDS = 0x100,
+	/*
+	 * Scheduling policy of the minimum priority in PRIORITY_MASK:
+	 * SCHED_NORMAL, SCHED_FIFO, SCHED_RR or SCHED_BATCH. For
+	 * SCHED_NORMAL and SCHED_BATCH the priority is a nice value,
+	 * otherwise an rt priority.
+	 */
+	FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT = 9,
+	FLAT_BINDER_FLAG_SCHED_POLICY_MASK =
+		3U << FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT,
+	/* let callers with an rt policy pass it on to the node's threads */
+	FLAT_BINDER_FLAG_INHERIT_RT = 0x800,
 };
 
 /*
@@ -61,6 +73,27 @@ struct flat_binder_object {
 	void			*cookie;
 };
 
+enum {
+	BINDER_BUFFER_FLAG_HAS_PARENT = 0x01,
+};
+
+/*
+ * A BINDER_TYPE_PTR object describes a buffer outside the transaction data
+ * which the driver copies straight into the target's transaction buffer,
+ * behind the offsets array, and re-writes 'buffer' to point at the copy.
+ * With BINDER_BUFFER_FLAG_HAS_PARENT set, 'parent' is the index in the
+ * offsets array of an earlier BINDER_TYPE_PTR object, and the pointer at
+ * 'parent_offset' in that buffer is fixed up to point at this one.
+ */
+struct binder_buffer_object {
+	unsigned long		type;
+	unsigned long		flags;
+	void			*buffer;
+	size_t			length;
+	size_t			parent;
+	size_t			parent_offset;
+};
+
 /*
  * On 64-bit platforms where user code may run in 32-bits the driver must
  * translate the buffer (and local binder) addresses apropriately.
@@ -147,6 +180,12 @@ struct binder_transaction_data {
 	} data;
 };
 
+struct binder_transaction_data_sg {
+	struct binder_transaction_data transaction_data;
+	/* total size of the BINDER_TYPE_PTR buffers, each aligned */
+	size_t		buffers_size;
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +363,13 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, with room for
+	 * BINDER_TYPE_PTR buffers.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
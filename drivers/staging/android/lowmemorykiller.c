@@ -41,6 +41,16 @@
 #include <linux/delay.h>
 #include <linux/swap.h>
 #include <linux/fs.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/err.h>
+#include <linux/ktime.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/vmpressure.h>
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/lowmemorykiller.h>
 
 #ifdef CONFIG_HIGHMEM
 	#define _ZONE ZONE_HIGHMEM
@@ -100,6 +110,7 @@ static void dump_tasks(void)
        }
 }
 
+#ifndef CONFIG_ANDROID_LMK_ADJ_RBTREE
 static int test_task_flag(struct task_struct *p, int flag)
 {
 	struct task_struct *t = p;
@@ -115,11 +126,138 @@ static int test_task_flag(struct task_struct *p, int flag)
 
 	return 0;
 }
+#endif
+
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_wait);
+/* set while lowmem_kthread() waits for a dying victim to exit */
+static atomic_t lowmem_victim_wait = ATOMIC_INIT(0);
 
 #ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
-static struct task_struct *pick_next_from_adj_tree(struct task_struct *task);
-static struct task_struct *pick_first_task(void);
-static struct task_struct *pick_last_task(void);
+/*
+ * Thread group leaders indexed by oom_score_adj, highest first, and by rss
+ * within one oom_score_adj, largest first. Both keys are cached in the task
+ * when it is inserted, so the tree stays ordered while the live values
+ * change; the rss is refreshed whenever oom_score_adj is written and when
+ * a task is picked as a victim. lmk_lock nests inside tasklist_lock,
+ * siglock and task_lock, so nothing else may be taken under it.
+ */
+static DEFINE_SPINLOCK(lmk_lock);
+static struct rb_root tasks_scoreadj = RB_ROOT;
+
+static void __add_2_adj_tree(struct task_struct *task)
+{
+	struct rb_node **link = &tasks_scoreadj.rb_node;
+	struct rb_node *parent = NULL;
+	struct task_struct *task_entry;
+
+	while (*link) {
+		parent = *link;
+		task_entry = rb_entry(parent, struct task_struct, adj_node);
+
+		if (task->adj_key < task_entry->adj_key ||
+		    (task->adj_key == task_entry->adj_key &&
+		     task->adj_rss < task_entry->adj_rss))
+			link = &parent->rb_right;
+		else
+			link = &parent->rb_left;
+	}
+
+	rb_link_node(&task->adj_node, parent, link);
+	rb_insert_color(&task->adj_node, &tasks_scoreadj);
+}
+
+static void __delete_from_adj_tree(struct task_struct *task)
+{
+	rb_erase(&task->adj_node, &tasks_scoreadj);
+	RB_CLEAR_NODE(&task->adj_node);
+}
+
+static unsigned long lowmem_task_rss(struct task_struct *task)
+{
+	return task->mm ? get_mm_rss(task->mm) : 0;
+}
+
+/*
+ * Called for a new thread group leader whose mm cannot change under us:
+ * from fork before the child first runs and from de_thread() on current.
+ */
+void add_2_adj_tree(struct task_struct *task)
+{
+	if (task->flags & PF_KTHREAD)
+		return;
+
+	task->adj_key = task->signal->oom_score_adj;
+	task->adj_rss = lowmem_task_rss(task);
+	spin_lock(&lmk_lock);
+	__add_2_adj_tree(task);
+	spin_unlock(&lmk_lock);
+}
+
+void delete_from_adj_tree(struct task_struct *task)
+{
+	spin_lock(&lmk_lock);
+	if (!RB_EMPTY_NODE(&task->adj_node))
+		__delete_from_adj_tree(task);
+	spin_unlock(&lmk_lock);
+
+	/* a group is gone, it may be the victim lowmem_kthread() waits for */
+	if (atomic_xchg(&lowmem_victim_wait, 0))
+		wake_up(&lowmem_wait);
+}
+
+/*
+ * Re-keys the thread group of task after its oom_score_adj was written.
+ * The caller holds task_lock(task) or is task, so task->mm is stable.
+ */
+void update_adj_tree(struct task_struct *task)
+{
+	struct task_struct *leader;
+	unsigned long rss = lowmem_task_rss(task);
+
+	rcu_read_lock();
+	leader = task->group_leader;
+	spin_lock(&lmk_lock);
+	if (!RB_EMPTY_NODE(&leader->adj_node)) {
+		__delete_from_adj_tree(leader);
+		leader->adj_key = leader->signal->oom_score_adj;
+		leader->adj_rss = rss;
+		__add_2_adj_tree(leader);
+	}
+	spin_unlock(&lmk_lock);
+	rcu_read_unlock();
+}
+
+/* Highest oom_score_adj of any indexed task, checked before a full select */
+static int lowmem_top_adj(void)
+{
+	struct rb_node *first;
+	int adj = OOM_SCORE_ADJ_MIN - 1;
+
+	spin_lock(&lmk_lock);
+	first = rb_first(&tasks_scoreadj);
+	if (first)
+		adj = rb_entry(first, struct task_struct, adj_node)->adj_key;
+	spin_unlock(&lmk_lock);
+	return adj;
+}
+
+/* Lockless variant of test_task_flag() for use under lmk_lock */
+static int test_task_flag_rcu(struct task_struct *p, int flag)
+{
+	struct task_struct *t = p;
+
+	do {
+		if (test_tsk_thread_flag(t, flag))
+			return 1;
+	} while_each_thread(p, t);
+
+	return 0;
+}
+#else
+static inline int lowmem_top_adj(void)
+{
+	return OOM_SCORE_ADJ_MAX;
+}
 #endif
 
 static DEFINE_MUTEX(scan_mutex);
@@ -149,100 +287,144 @@ int can_use_cma_pages(gfp_t gfp_mask)
 	return can_use;
 }
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
+/* times a stale index entry may send lowmem_select() back to the top */
+#define LOWMEM_SELECT_RETRIES	8
+
+/*
+ * Returns the task to kill with a reference held, NULL if there is none,
+ * or ERR_PTR(-EBUSY) if an earlier victim is still dying. The index is
+ * walked from the highest oom_score_adj down to min_score_adj, so this
+ * usually stops at the first entry.
+ */
+static struct task_struct *lowmem_select(int min_score_adj, int *tasksize,
+					 int *visited)
 {
-	struct task_struct *tsk;
-	struct task_struct *selected = NULL;
-	int rem = 0;
-	int tasksize;
-	int i;
-	int min_score_adj = OOM_SCORE_ADJ_MAX + 1;
-	int selected_tasksize = 0;
-	int selected_oom_score_adj;
-	int selected_oom_adj = 0;
-	int array_size = ARRAY_SIZE(lowmem_adj);
-	int other_free;
-	int other_file;
-	int reserved_free = 0;
-	int cma_free = 0;
-	unsigned long nr_to_scan = sc->nr_to_scan;
-	struct zone *zone;
-	int use_cma = can_use_cma_pages(sc->gfp_mask);
-
-	if (nr_to_scan > 0) {
-		if (!mutex_trylock(&scan_mutex)) {
-			if (!(lowmem_only_kswapd_sleep && !current_is_kswapd())) {
-				msleep_interruptible(lowmem_sleep_ms);
-			}
-			return 0;
-		}
-	}
-
-	for_each_zone(zone)
-	{
-		if (is_normal(zone))
-			reserved_free = zone->watermark[WMARK_MIN] + zone->lowmem_reserve[_ZONE];
+	struct task_struct *tsk, *p;
+	struct task_struct *skip = NULL;
+	struct rb_node *n;
+	unsigned long rss;
+	int retries = LOWMEM_SELECT_RETRIES;
+	bool stale;
+	bool deathpending = time_before_eq(jiffies,
+					   lowmem_deathpending_timeout);
+
+retry:
+	tsk = NULL;
+	rcu_read_lock();
+	spin_lock(&lmk_lock);
+	/* resume behind a task rejected for having no pages */
+	if (skip && !RB_EMPTY_NODE(&skip->adj_node))
+		n = rb_next(&skip->adj_node);
+	else
+		n = rb_first(&tasks_scoreadj);
+	for (; n; n = rb_next(n)) {
+		struct task_struct *t;
 
-		cma_free += zone_page_state(zone, NR_FREE_CMA_PAGES);
-	}
+		t = rb_entry(n, struct task_struct, adj_node);
+		if (t->adj_key < min_score_adj)
+			break;
+		(*visited)++;
 
+		if (t->flags & PF_KTHREAD)
+			continue;
 
-	other_free = global_page_state(NR_FREE_PAGES);
+		if (deathpending && test_task_flag_rcu(t, TIF_MEMDIE)) {
+			lowmem_print(2, "skipping , waiting for process %d (%s) dead\n",
+				     t->pid, t->comm);
+			spin_unlock(&lmk_lock);
+			rcu_read_unlock();
+			return ERR_PTR(-EBUSY);
+		}
 
-	if (global_page_state(NR_SHMEM) + global_page_state(NR_MLOCK) + total_swapcache_pages <
-		global_page_state(NR_FILE_PAGES))
-		other_file = global_page_state(NR_FILE_PAGES) -
-						global_page_state(NR_SHMEM) -
-						global_page_state(NR_MLOCK) -
-						total_swapcache_pages;
-	else
-		other_file = 0;
+		if (test_task_flag_rcu(t, TIF_MM_RELEASED))
+			continue;
 
-	if (lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
-	for (i = 0; i < array_size; i++) {
-		if ((other_free - reserved_free - (use_cma ? 0 : cma_free)) < lowmem_minfree[i] &&
-		    other_file < lowmem_minfree[i]) {
-			min_score_adj = lowmem_adj[i];
-			break;
-		}
+		tsk = t;
+		get_task_struct(tsk);
+		break;
 	}
-	if (nr_to_scan > 0)
-		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d, rfree %d\n",
-				nr_to_scan, sc->gfp_mask, other_free,
-				other_file, min_score_adj, reserved_free);
-	rem = global_page_state(NR_ACTIVE_ANON) +
-		global_page_state(NR_ACTIVE_FILE) +
-		global_page_state(NR_INACTIVE_ANON) +
-		global_page_state(NR_INACTIVE_FILE);
-	if (nr_to_scan <= 0 || min_score_adj == OOM_SCORE_ADJ_MAX + 1) {
-		lowmem_print(5, "lowmem_shrink %lu, %x, return %d\n",
-			     nr_to_scan, sc->gfp_mask, rem);
+	spin_unlock(&lmk_lock);
+	rcu_read_unlock();
+	if (skip) {
+		put_task_struct(skip);
+		skip = NULL;
+	}
+	if (!tsk)
+		return NULL;
 
-		if (nr_to_scan > 0)
-			mutex_unlock(&scan_mutex);
+	/* the thread list walk of find_lock_task_mm() needs RCU */
+	rcu_read_lock();
+	p = find_lock_task_mm(tsk);
+	if (!p) {
+		rcu_read_unlock();
+		/* every thread is past exit_mm(), the group cannot be killed */
+		delete_from_adj_tree(tsk);
+		goto next;
+	}
+	rss = get_mm_rss(p->mm);
+	get_task_struct(p);
+	task_unlock(p);
+	rcu_read_unlock();
 
-		return rem;
+	/*
+	 * Refresh the cached rss. If it shrank below a peer with the same
+	 * oom_score_adj, that peer is the better victim: start over.
+	 */
+	stale = false;
+	spin_lock(&lmk_lock);
+	if (!RB_EMPTY_NODE(&tsk->adj_node) && tsk->adj_rss != rss) {
+		__delete_from_adj_tree(tsk);
+		tsk->adj_rss = rss;
+		__add_2_adj_tree(tsk);
+		n = rb_prev(&tsk->adj_node);
+		stale = n && rb_entry(n, struct task_struct,
+				      adj_node)->adj_key == tsk->adj_key;
+	}
+	spin_unlock(&lmk_lock);
+	if (stale) {
+		put_task_struct(p);
+		goto next;
+	}
+	if (rss == 0) {
+		put_task_struct(p);
+		skip = tsk;
+		goto retry;
 	}
-	selected_oom_score_adj = min_score_adj;
 
-	rcu_read_lock();
-#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
-	for (tsk = pick_first_task();
-		tsk != pick_last_task();
-		tsk = pick_next_from_adj_tree(tsk)) {
+	put_task_struct(tsk);
+	*tasksize = rss;
+	lowmem_print(2, "select %d (%s), oom_adj %d score_adj %d, size %d, to kill\n",
+		     p->pid, p->comm, p->signal->oom_adj,
+		     p->signal->oom_score_adj, *tasksize);
+	return p;
+
+next:
+	put_task_struct(tsk);
+	if (retries--)
+		goto retry;
+	return NULL;
+}
 #else
+/* Same contract as above, scanning every process. */
+static struct task_struct *lowmem_select(int min_score_adj, int *tasksize,
+					 int *visited)
+{
+	struct task_struct *tsk;
+	struct task_struct *selected = NULL;
+	int selected_tasksize = 0;
+	int selected_oom_score_adj = min_score_adj;
+
+	rcu_read_lock();
 	for_each_process(tsk) {
-#endif
 		struct task_struct *p;
 		int oom_score_adj;
+		int size;
 
+		(*visited)++;
 		if (tsk->flags & PF_KTHREAD)
 			continue;
 
-		
 		if (test_task_flag(tsk, TIF_MM_RELEASED))
 			continue;
 
@@ -251,12 +433,7 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 				lowmem_print(2, "skipping , waiting for process %d (%s) dead\n",
 				tsk->pid, tsk->comm);
 				rcu_read_unlock();
-				
-				if (!(lowmem_only_kswapd_sleep && !current_is_kswapd())) {
-					msleep_interruptible(lowmem_sleep_ms);
-				}
-				mutex_unlock(&scan_mutex);
-				return 0;
+				return ERR_PTR(-EBUSY);
 			}
 		}
 
@@ -267,68 +444,414 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		oom_score_adj = p->signal->oom_score_adj;
 		if (oom_score_adj < min_score_adj) {
 			task_unlock(p);
-#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
-			break;
-#else
 			continue;
-#endif
 		}
-		tasksize = get_mm_rss(p->mm);
+		size = get_mm_rss(p->mm);
 		task_unlock(p);
-		if (tasksize <= 0)
+		if (size <= 0)
 			continue;
 		if (selected) {
 			if (oom_score_adj < selected_oom_score_adj)
-#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
-				break;
-#else
 				continue;
-#endif
 			if (oom_score_adj == selected_oom_score_adj &&
-			    tasksize <= selected_tasksize)
+			    size <= selected_tasksize)
 				continue;
 		}
 		selected = p;
-		selected_tasksize = tasksize;
+		selected_tasksize = size;
 		selected_oom_score_adj = oom_score_adj;
-		selected_oom_adj = p->signal->oom_adj;
 		lowmem_print(2, "select %d (%s), oom_adj %d score_adj %d, size %d, to kill\n",
-			     p->pid, p->comm, selected_oom_adj, oom_score_adj, tasksize);
+			     p->pid, p->comm, p->signal->oom_adj, oom_score_adj, size);
+	}
+	if (selected)
+		get_task_struct(selected);
+	rcu_read_unlock();
+
+	*tasksize = selected_tasksize;
+	return selected;
+}
+#endif
+
+/* Memory the thresholds are compared against, in pages */
+struct lowmem_stats {
+	int other_free;
+	int other_file;
+	int reserved_free;
+	int cma_free;
+	int use_cma;
+	/* parts of other_file added by the cost model */
+	int other_swap;
+	int other_slab;
+};
+
+/*
+ * A cost model adds memory that reclaim can still free cheaply to the
+ * other_file estimate, on top of the unlocked page cache. Pick one with
+ * /sys/module/lowmemorykiller/parameters/cost_model.
+ */
+struct lowmem_cost_model {
+	const char *name;
+	void (*estimate)(struct lowmem_stats *st);
+};
+
+/*
+ * Parameters of the "swap" model: how many uncompressed pages one page of
+ * RAM holds in the swap device (0 if swap does not live in RAM, as with a
+ * disk), and the percentage of reclaimable slab assumed to really free.
+ */
+static uint32_t lowmem_swap_compress_ratio = 3;
+static uint32_t lowmem_slab_reclaim_percent = 50;
+
+/*
+ * Anonymous pages that fit in the free swap space can be pushed out by
+ * reclaim instead of killing their owner. With zram each of them still
+ * costs 1/ratio of a page, which is subtracted from the gain.
+ */
+static void lowmem_cost_swap(struct lowmem_stats *st)
+{
+	long anon, swappable;
+	uint32_t ratio = lowmem_swap_compress_ratio;
+
+	anon = global_page_state(NR_ACTIVE_ANON) +
+		global_page_state(NR_INACTIVE_ANON);
+	swappable = min(anon, get_nr_swap_pages());
+	if (swappable > 0)
+		st->other_swap = ratio ? swappable - swappable / ratio :
+					 swappable;
+
+	st->other_slab = global_page_state(NR_SLAB_RECLAIMABLE) *
+		min(lowmem_slab_reclaim_percent, 100U) / 100;
+
+	st->other_file += st->other_swap + st->other_slab;
+}
+
+static struct lowmem_cost_model lowmem_cost_models[] = {
+	{ .name = "cache" },
+	{ .name = "swap", .estimate = lowmem_cost_swap },
+};
+static struct lowmem_cost_model *lowmem_cost_model = &lowmem_cost_models[0];
+
+static int lowmem_cost_model_set(const char *val,
+				 const struct kernel_param *kp)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(lowmem_cost_models); i++) {
+		if (sysfs_streq(val, lowmem_cost_models[i].name)) {
+			lowmem_cost_model = &lowmem_cost_models[i];
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+static int lowmem_cost_model_get(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%s", lowmem_cost_model->name);
+}
+
+static struct kernel_param_ops lowmem_cost_model_ops = {
+	.set = lowmem_cost_model_set,
+	.get = lowmem_cost_model_get,
+};
+
+/*
+ * Returns the lowest oom_score_adj that may be killed for an allocation
+ * with gfp_mask, or OOM_SCORE_ADJ_MAX + 1 if memory is above all minfree
+ * levels.
+ */
+static int lowmem_min_score_adj(gfp_t gfp_mask, struct lowmem_stats *st)
+{
+	struct zone *zone;
+	int array_size = ARRAY_SIZE(lowmem_adj);
+	int i;
+
+	memset(st, 0, sizeof(*st));
+	st->use_cma = can_use_cma_pages(gfp_mask);
+
+	for_each_zone(zone)
+	{
+		if (is_normal(zone))
+			st->reserved_free = zone->watermark[WMARK_MIN] + zone->lowmem_reserve[_ZONE];
+
+		st->cma_free += zone_page_state(zone, NR_FREE_CMA_PAGES);
 	}
-	if (selected) {
-		bool should_dump_meminfo = false;
-
-		lowmem_print(1, "[%s] send sigkill to %d (%s), oom_adj %d, score_adj %d,"
-			" min_score_adj %d, size %dK, free %dK, file %dK, "
-			" reserved_free %dK, cma_free %dK, use_cma %d\n",
-			     current->comm, selected->pid, selected->comm,
-			     selected_oom_adj, selected_oom_score_adj,
-			     min_score_adj, selected_tasksize << 2,
-			     other_free << 2, other_file << 2, reserved_free << 2, cma_free << 2, use_cma);
-
-		lowmem_deathpending_timeout = jiffies + HZ;
+
+
+	st->other_free = global_page_state(NR_FREE_PAGES);
+
+	if (global_page_state(NR_SHMEM) + global_page_state(NR_MLOCK) + total_swapcache_pages <
+		global_page_state(NR_FILE_PAGES))
+		st->other_file = global_page_state(NR_FILE_PAGES) -
+						global_page_state(NR_SHMEM) -
+						global_page_state(NR_MLOCK) -
+						total_swapcache_pages;
+	else
+		st->other_file = 0;
+
+	if (lowmem_cost_model->estimate)
+		lowmem_cost_model->estimate(st);
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	for (i = 0; i < array_size; i++) {
+		if ((st->other_free - st->reserved_free - (st->use_cma ? 0 : st->cma_free)) < lowmem_minfree[i] &&
+		    st->other_file < lowmem_minfree[i])
+			return lowmem_adj[i];
+	}
+	return OOM_SCORE_ADJ_MAX + 1;
+}
+
+/*
+ * Kills the best victim at or above min_score_adj. Called with scan_mutex
+ * held. Returns the victim's size in pages, 0 if there was nothing to
+ * kill, or -EBUSY if an earlier victim is still dying.
+ */
+static int lowmem_kill(int min_score_adj, struct lowmem_stats *st)
+{
+	struct task_struct *selected;
+	int selected_tasksize = 0;
+	int selected_oom_score_adj;
+	int selected_oom_adj;
+	int visited = 0;
+	bool should_dump_meminfo = false;
+	ktime_t start;
+
+	start = ktime_get();
+	selected = lowmem_select(min_score_adj, &selected_tasksize, &visited);
+	trace_lowmem_select(min_score_adj, visited,
+			    IS_ERR(selected) ? NULL : selected,
+			    selected_tasksize,
+			    ktime_to_ns(ktime_sub(ktime_get(), start)));
+	if (IS_ERR(selected))
+		return PTR_ERR(selected);
+	if (!selected)
+		return 0;
+
+	selected_oom_score_adj = selected->signal->oom_score_adj;
+	selected_oom_adj = selected->signal->oom_adj;
+	lowmem_print(1, "[%s] send sigkill to %d (%s), oom_adj %d, score_adj %d,"
+		" min_score_adj %d, size %dK, free %dK, file %dK, "
+		" reserved_free %dK, cma_free %dK, use_cma %d,"
+		" swap %dK, slab %dK\n",
+		     current->comm, selected->pid, selected->comm,
+		     selected_oom_adj, selected_oom_score_adj,
+		     min_score_adj, selected_tasksize << 2,
+		     st->other_free << 2, st->other_file << 2,
+		     st->reserved_free << 2, st->cma_free << 2, st->use_cma,
+		     st->other_swap << 2, st->other_slab << 2);
+
+	lowmem_deathpending_timeout = jiffies + HZ;
 #ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_AUTODETECT_OOM_ADJ_VALUES
 #define DUMP_INFO_OOM_SCORE_ADJ_THRESHOLD	((7 * OOM_SCORE_ADJ_MAX) / -OOM_DISABLE)
-		if (selected_oom_score_adj < DUMP_INFO_OOM_SCORE_ADJ_THRESHOLD)
+	if (selected_oom_score_adj < DUMP_INFO_OOM_SCORE_ADJ_THRESHOLD)
 #else
-		if (selected->signal->oom_adj < 7)
+	if (selected_oom_adj < 7)
 #endif
-			should_dump_meminfo = true;
-		send_sig(SIGKILL, selected, 0);
-		set_tsk_thread_flag(selected, TIF_MEMDIE);
-		rem -= selected_tasksize;
-		rcu_read_unlock();
+		should_dump_meminfo = true;
+	send_sig(SIGKILL, selected, 0);
+	set_tsk_thread_flag(selected, TIF_MEMDIE);
+	put_task_struct(selected);
+
+	if (should_dump_meminfo) {
+		show_meminfo();
+		dump_tasks();
+	}
+
+	return selected_tasksize;
+}
+
+/*
+ * In vmpressure mode, kills are made by lowmem_kthread() rather than by
+ * whoever happens to be reclaiming. It is woken when the shrinker runs
+ * and when reclaim efficiency drops to vmpressure_medium, and it keeps
+ * killing until memory is back above the minfree levels. At
+ * vmpressure_critical it also kills the highest adj level while memory
+ * is still above all minfree levels, since reclaim is then mostly
+ * thrashing the page cache.
+ */
+static uint32_t lowmem_vmpressure_mode;
+static uint32_t lowmem_vmpressure_medium = 60;
+static uint32_t lowmem_vmpressure_critical = 95;
+
+static struct task_struct *lowmem_task;
+static DEFINE_MUTEX(lowmem_task_lock);
+static bool lowmem_initialized;
+static atomic_t lowmem_kick = ATOMIC_INIT(0);
+static atomic_t lowmem_pressure = ATOMIC_INIT(0);
+static gfp_t lowmem_kick_gfp_mask = GFP_KERNEL;
+
+static void lowmem_wakeup(gfp_t gfp_mask)
+{
+	lowmem_kick_gfp_mask = gfp_mask;
+	atomic_set(&lowmem_kick, 1);
+	wake_up(&lowmem_wait);
+}
+
+static int lowmem_kthread(void *unused)
+{
+	struct lowmem_stats st;
+	int min_score_adj;
+	int array_size;
+	int ret;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(lowmem_wait,
+					 atomic_xchg(&lowmem_kick, 0) ||
+					 kthread_should_stop());
+		if (kthread_should_stop())
+			break;
+
+		mutex_lock(&scan_mutex);
+		min_score_adj = lowmem_min_score_adj(lowmem_kick_gfp_mask, &st);
+		array_size = min(lowmem_adj_size, lowmem_minfree_size);
+		/* a critical report forces at most one kill, it is not sticky */
+		if (atomic_xchg(&lowmem_pressure, 0) >=
+		    lowmem_vmpressure_critical &&
+		    min_score_adj == OOM_SCORE_ADJ_MAX + 1 && array_size > 0)
+			min_score_adj = lowmem_adj[array_size - 1];
+
+		ret = 0;
+		if (min_score_adj <= OOM_SCORE_ADJ_MAX &&
+		    lowmem_top_adj() >= min_score_adj)
+			ret = lowmem_kill(min_score_adj, &st);
+		mutex_unlock(&scan_mutex);
+
+		if (ret == -EBUSY) {
+			long timeout = (long)(lowmem_deathpending_timeout -
+					      jiffies);
+
+			/* kicks are ignored until the victim is gone */
+			if (timeout > 0) {
+				atomic_set(&lowmem_victim_wait, 1);
+				wait_event_interruptible_timeout(lowmem_wait,
+					!atomic_read(&lowmem_victim_wait) ||
+					kthread_should_stop(), timeout);
+				atomic_set(&lowmem_victim_wait, 0);
+			}
+			atomic_set(&lowmem_kick, 1);
+		} else if (ret > 0) {
+			/* look again once the victim had a chance to exit */
+			msleep_interruptible(lowmem_sleep_ms);
+			atomic_set(&lowmem_kick, 1);
+		}
+	}
+
+	return 0;
+}
+
+static int lowmem_vmpressure_notifier(struct notifier_block *nb,
+				      unsigned long pressure, void *data)
+{
+	atomic_set(&lowmem_pressure, pressure);
+	if (lowmem_vmpressure_mode && pressure >= lowmem_vmpressure_medium)
+		lowmem_wakeup(GFP_KERNEL);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_vmpressure_nb = {
+	.notifier_call = lowmem_vmpressure_notifier,
+};
+
+/*
+ * The kill thread is only started once vmpressure mode is enabled, from
+ * lowmem_init() or from a later write of the parameter. It then runs
+ * until the module exits.
+ */
+static void lowmem_start_kthread(void)
+{
+	struct task_struct *task;
+
+	mutex_lock(&lowmem_task_lock);
+	if (!lowmem_initialized || !lowmem_vmpressure_mode || lowmem_task)
+		goto out;
+
+	task = kthread_run(lowmem_kthread, NULL, "lowmemorykiller");
+	if (IS_ERR(task)) {
+		pr_err("lowmemorykiller: kill thread failed to start, "
+		       "vmpressure mode disabled\n");
+		goto out;
+	}
+	lowmem_task = task;
+	vmpressure_register_notifier(&lowmem_vmpressure_nb);
+out:
+	mutex_unlock(&lowmem_task_lock);
+}
+
+static int lowmem_vmpressure_mode_set(const char *val,
+				      const struct kernel_param *kp)
+{
+	int ret;
+
+	ret = param_set_uint(val, kp);
+	if (!ret)
+		lowmem_start_kthread();
+	return ret;
+}
+
+static struct kernel_param_ops lowmem_vmpressure_mode_ops = {
+	.set = lowmem_vmpressure_mode_set,
+	.get = param_get_uint,
+};
+
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	int rem;
+	int ret;
+	int min_score_adj;
+	struct lowmem_stats st;
+	unsigned long nr_to_scan = sc->nr_to_scan;
 
-		if (should_dump_meminfo) {
-			show_meminfo();
-			dump_tasks();
+	rem = global_page_state(NR_ACTIVE_ANON) +
+		global_page_state(NR_ACTIVE_FILE) +
+		global_page_state(NR_INACTIVE_ANON) +
+		global_page_state(NR_INACTIVE_FILE);
+
+	if (lowmem_vmpressure_mode && lowmem_task) {
+		if (nr_to_scan > 0)
+			lowmem_wakeup(sc->gfp_mask);
+		return rem;
+	}
+
+	if (nr_to_scan > 0) {
+		if (!mutex_trylock(&scan_mutex)) {
+			if (!(lowmem_only_kswapd_sleep && !current_is_kswapd())) {
+				msleep_interruptible(lowmem_sleep_ms);
+			}
+			return 0;
 		}
+	}
+
+	min_score_adj = lowmem_min_score_adj(sc->gfp_mask, &st);
+	if (nr_to_scan > 0)
+		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d, rfree %d\n",
+				nr_to_scan, sc->gfp_mask, st.other_free,
+				st.other_file, min_score_adj, st.reserved_free);
+	if (nr_to_scan <= 0 || min_score_adj == OOM_SCORE_ADJ_MAX + 1 ||
+	    lowmem_top_adj() < min_score_adj) {
+		lowmem_print(5, "lowmem_shrink %lu, %x, return %d\n",
+			     nr_to_scan, sc->gfp_mask, rem);
+
+		if (nr_to_scan > 0)
+			mutex_unlock(&scan_mutex);
+
+		return rem;
+	}
 
-		
+	ret = lowmem_kill(min_score_adj, &st);
+	if (ret < 0) {
 		if (!(lowmem_only_kswapd_sleep && !current_is_kswapd()))
 			msleep_interruptible(lowmem_sleep_ms);
-	} else
-		rcu_read_unlock();
+		mutex_unlock(&scan_mutex);
+		return 0;
+	}
+	if (ret > 0) {
+		rem -= ret;
+		if (!(lowmem_only_kswapd_sleep && !current_is_kswapd()))
+			msleep_interruptible(lowmem_sleep_ms);
+	}
 
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     nr_to_scan, sc->gfp_mask, rem);
@@ -343,6 +866,10 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	mutex_lock(&lowmem_task_lock);
+	lowmem_initialized = true;
+	mutex_unlock(&lowmem_task_lock);
+	lowmem_start_kthread();
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
@@ -350,6 +877,10 @@ static int __init lowmem_init(void)
 static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
+	if (lowmem_task) {
+		vmpressure_unregister_notifier(&lowmem_vmpressure_nb);
+		kthread_stop(lowmem_task);
+	}
 }
 
 #ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_AUTODETECT_OOM_ADJ_VALUES
@@ -429,85 +960,6 @@ static const struct kparam_array __param_arr_adj = {
 };
 #endif
 
-#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
-DEFINE_SPINLOCK(lmk_lock);
-struct rb_root tasks_scoreadj = RB_ROOT;
-void add_2_adj_tree(struct task_struct *task)
-{
-	struct rb_node **link = &tasks_scoreadj.rb_node;
-	struct rb_node *parent = NULL;
-	struct task_struct *task_entry;
-	s64 key = task->signal->oom_score_adj;
-	/*
- * 	 * Find the right place in the rbtree:
- * 	 	 */
-	spin_lock(&lmk_lock);
-	while (*link) {
-		parent = *link;
-		task_entry = rb_entry(parent, struct task_struct, adj_node);
-
-		if (key < task_entry->signal->oom_score_adj)
-			link = &parent->rb_right;
-		else
-			link = &parent->rb_left;
-	}
-
-	rb_link_node(&task->adj_node, parent, link);
-	rb_insert_color(&task->adj_node, &tasks_scoreadj);
-	spin_unlock(&lmk_lock);
-}
-
-void delete_from_adj_tree(struct task_struct *task)
-{
-	spin_lock(&lmk_lock);
-	rb_erase(&task->adj_node, &tasks_scoreadj);
-	spin_unlock(&lmk_lock);
-}
-
-
-static struct task_struct *pick_next_from_adj_tree(struct task_struct *task)
-{
-	struct rb_node *next;
-
-	spin_lock(&lmk_lock);
-	next = rb_next(&task->adj_node);
-	spin_unlock(&lmk_lock);
-
-	if (!next)
-		return NULL;
-
-	 return rb_entry(next, struct task_struct, adj_node);
-}
-
-static struct task_struct *pick_first_task(void)
-{
-	struct rb_node *left;
-
-	spin_lock(&lmk_lock);
-	left = rb_first(&tasks_scoreadj);
-	spin_unlock(&lmk_lock);
-
-	if (!left)
-		return NULL;
-
-	return rb_entry(left, struct task_struct, adj_node);
-}
-
-static struct task_struct *pick_last_task(void)
-{
-	struct rb_node *right;
-
-	spin_lock(&lmk_lock);
-	right = rb_last(&tasks_scoreadj);
-	spin_unlock(&lmk_lock);
-
-	if (!right)
-		return NULL;
-
-	return rb_entry(right, struct task_struct, adj_node);
-}
-#endif
-
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
 #ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_AUTODETECT_OOM_ADJ_VALUES
 __module_param_call(MODULE_PARAM_PREFIX, adj,
@@ -522,9 +974,19 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_cb(cost_model, &lowmem_cost_model_ops, NULL, S_IRUGO | S_IWUSR);
+module_param_named(swap_compress_ratio, lowmem_swap_compress_ratio, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(slab_reclaim_percent, lowmem_slab_reclaim_percent, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_cb(vmpressure, &lowmem_vmpressure_mode_ops,
+		&lowmem_vmpressure_mode, S_IRUGO | S_IWUSR);
+module_param_named(vmpressure_medium, lowmem_vmpressure_medium, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(vmpressure_critical, lowmem_vmpressure_critical, uint,
+		   S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
 
 MODULE_LICENSE("GPL");
-
@@ -704,7 +704,7 @@ static struct zv_hdr *zv_create(struct zs_pool *pool, uint32_t pool_id,
 
 	BUG_ON(!irqs_disabled());
 	BUG_ON(chunks >= NCHUNKS);
-	handle = zs_malloc(pool, size);
+	handle = zs_malloc(pool, size, zs_pool_gfp(pool));
 	if (!handle)
 		goto out;
 	atomic_inc(&zv_curr_dist_counts[chunks]);
@@ -973,6 +973,9 @@ int zcache_new_client(uint16_t cli_id)
 {
 	struct zcache_client *cli = NULL;
 	int ret = -1;
+#ifdef CONFIG_FRONTSWAP
+	char name[16];
+#endif
 
 	if (cli_id == LOCAL_CLIENT)
 		cli = &zcache_host;
@@ -984,7 +987,9 @@ int zcache_new_client(uint16_t cli_id)
 		goto out;
 	cli->allocated = 1;
 #ifdef CONFIG_FRONTSWAP
-	cli->zspool = zs_create_pool("zcache", ZCACHE_GFP_MASK);
+	/* the name is the pool's zsmalloc debugfs directory, keep it unique */
+	snprintf(name, sizeof(name), "zcache-%u", cli_id);
+	cli->zspool = zs_create_pool(name, ZCACHE_GFP_MASK);
 	if (cli->zspool == NULL)
 		goto out;
 #endif
@@ -0,0 +1,107 @@
+#ifndef BLK_MQ_H
+#define BLK_MQ_H
+
+#include <linux/blkdev.h>
+
+struct blk_mq_tags;
+
+struct blk_mq_hw_ctx {
+	spinlock_t		lock;
+	struct list_head	dispatch;
+	unsigned long		state;
+	unsigned long		flags;
+
+	struct work_struct	run_work;
+
+	struct request_queue	*queue;
+	void			*driver_data;
+	unsigned int		queue_num;
+
+	unsigned int		nr_ctx;
+	struct blk_mq_ctx	**ctxs;
+	unsigned long		*ctx_map;
+
+	struct blk_mq_tags	*tags;
+	void			*rq_mem;
+	unsigned int		rq_size;
+	unsigned int		queue_depth;
+};
+
+struct blk_mq_reg {
+	struct blk_mq_ops	*ops;
+	unsigned int		nr_hw_queues;
+	unsigned int		queue_depth;
+	unsigned int		cmd_size;	/* per-request driver data */
+	int			numa_node;
+	unsigned int		flags;		/* BLK_MQ_F_* */
+};
+
+typedef int (queue_rq_fn)(struct blk_mq_hw_ctx *, struct request *);
+typedef struct blk_mq_hw_ctx *(map_queue_fn)(struct request_queue *, const int);
+typedef int (init_hctx_fn)(struct blk_mq_hw_ctx *, void *, unsigned int);
+typedef void (exit_hctx_fn)(struct blk_mq_hw_ctx *, unsigned int);
+
+struct blk_mq_ops {
+	/*
+	 * Queue request to the hardware. Called from process context with
+	 * no block layer locks held, so the driver may sleep. On
+	 * BLK_MQ_RQ_QUEUE_BUSY the request is kept on the dispatch list and
+	 * retried on the next run; a driver that is out of resources should
+	 * stop the hardware queue before returning and restart it once
+	 * something completes.
+	 */
+	queue_rq_fn		*queue_rq;
+
+	/*
+	 * Map a software queue (cpu) to a hardware queue, normally
+	 * blk_mq_map_queue
+	 */
+	map_queue_fn		*map_queue;
+
+	init_hctx_fn		*init_hctx;
+	exit_hctx_fn		*exit_hctx;
+};
+
+enum {
+	BLK_MQ_RQ_QUEUE_OK	= 0,	/* queued fine */
+	BLK_MQ_RQ_QUEUE_BUSY	= 1,	/* requeue IO for later */
+	BLK_MQ_RQ_QUEUE_ERROR	= 2,	/* end IO with error */
+
+	BLK_MQ_F_SHOULD_MERGE	= 1 << 0,
+
+	BLK_MQ_S_STOPPED	= 0,
+	BLK_MQ_S_RUNNING	= 1,
+
+	BLK_MQ_MAX_DEPTH	= 2048,
+};
+
+struct request_queue *blk_mq_init_queue(struct blk_mq_reg *, void *);
+
+void blk_mq_end_io(struct request *rq, int error);
+
+struct blk_mq_hw_ctx *blk_mq_map_queue(struct request_queue *, const int cpu);
+
+void blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx, bool async);
+void blk_mq_run_queues(struct request_queue *q, bool async);
+void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *hctx);
+void blk_mq_start_hw_queue(struct blk_mq_hw_ctx *hctx);
+void blk_mq_start_stopped_hw_queues(struct request_queue *q);
+
+/*
+ * Driver command data is immediately after the request. So subtract request
+ * size to get back to the original request.
+ */
+static inline struct request *blk_mq_rq_from_pdu(void *pdu)
+{
+	return pdu - sizeof(struct request);
+}
+static inline void *blk_mq_rq_to_pdu(struct request *rq)
+{
+	return (void *) rq + sizeof(*rq);
+}
+
+#define queue_for_each_hw_ctx(q, hctx, i)				\
+	for ((i) = 0; (i) < (q)->nr_hw_queues &&			\
+	     ({ hctx = (q)->queue_hw_ctx[i]; 1; }); (i)++)
+
+#endif
@@ -33,6 +33,10 @@ struct blk_trace;
 struct request;
 struct sg_io_hdr;
 struct bsg_job;
+struct blk_mq_ops;
+struct blk_lat_hist;
+struct blk_mq_ctx;
+struct blk_mq_hw_ctx;
 
 #define BLKDEV_MIN_RQ	4
 #define BLKDEV_MAX_RQ	128	
@@ -74,6 +78,8 @@ struct request {
 
 	int cpu;
 
+	struct blk_mq_ctx *mq_ctx;
+
 	ktime_t		enter_time;	
 	ktime_t		process_time;	
 	pid_t pid;	
@@ -107,10 +113,8 @@ struct request {
 	struct gendisk *rq_disk;
 	struct hd_struct *part;
 	unsigned long start_time;
-#ifdef CONFIG_BLK_CGROUP
 	unsigned long long start_time_ns;
 	unsigned long long io_start_time_ns;    
-#endif
 	unsigned short nr_phys_segments;
 #if defined(CONFIG_BLK_DEV_INTEGRITY)
 	unsigned short nr_integrity_segments;
@@ -255,6 +259,12 @@ struct request_queue {
 
 	struct delayed_work	delay_work;
 
+	struct blk_mq_ops	*mq_ops;
+	unsigned int		*mq_map;
+	struct blk_mq_ctx __percpu	*queue_ctx;
+	struct blk_mq_hw_ctx	**queue_hw_ctx;
+	unsigned int		nr_hw_queues;
+
 	struct backing_dev_info	backing_dev_info;
 
 	void			*queuedata;
@@ -320,6 +330,8 @@ struct request_queue {
 
 	struct mutex		sysfs_lock;
 
+	struct blk_lat_hist __percpu *lat_hist;
+
 #if defined(CONFIG_BLK_DEV_BSG)
 	bsg_job_fn		*bsg_job_fn;
 	int			bsg_job_size;
@@ -1046,7 +1058,6 @@ int kblockd_schedule_work(struct request_queue *q, struct work_struct *work);
 int kblockd_schedule_delayed_work(struct request_queue *q,
 			struct delayed_work *dwork, unsigned long delay);
 
-#ifdef CONFIG_BLK_CGROUP
 static inline void set_start_time_ns(struct request *req)
 {
 	preempt_disable();
@@ -1070,18 +1081,6 @@ static inline uint64_t rq_io_start_time_ns(struct request *req)
 {
         return req->io_start_time_ns;
 }
-#else
-static inline void set_start_time_ns(struct request *req) {}
-static inline void set_io_start_time_ns(struct request *req) {}
-static inline uint64_t rq_start_time_ns(struct request *req)
-{
-	return 0;
-}
-static inline uint64_t rq_io_start_time_ns(struct request *req)
-{
-	return 0;
-}
-#endif
 
 #define MODULE_ALIAS_BLOCKDEV(major,minor) \
 	MODULE_ALIAS("block-major-" __stringify(major) "-" __stringify(minor))
@@ -1369,7 +1369,10 @@ struct task_struct {
 
 	struct list_head tasks;
 #ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
+	/* lowmemorykiller index, keyed by the values cached at insertion */
 	struct rb_node adj_node;
+	int adj_key;
+	unsigned long adj_rss;
 #endif
 #ifdef CONFIG_SMP
 	struct plist_node pushable_tasks;
@@ -1722,9 +1725,11 @@ static inline struct pid *task_tgid(struct task_struct *task)
 #ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
 extern void add_2_adj_tree(struct task_struct *task);
 extern void delete_from_adj_tree(struct task_struct *task);
+extern void update_adj_tree(struct task_struct *task);
 #else
 static inline void add_2_adj_tree(struct task_struct *task) { }
 static inline void delete_from_adj_tree(struct task_struct *task) { }
+static inline void update_adj_tree(struct task_struct *task) { }
 #endif
 
 /*
@@ -0,0 +1,18 @@
+#ifndef __LINUX_VMPRESSURE_H
+#define __LINUX_VMPRESSURE_H
+
+#include <linux/types.h>
+#include <linux/gfp.h>
+
+struct notifier_block;
+
+/*
+ * Notifiers are called from process context with the pressure of the last
+ * reclaim window, 0 (everything scanned was reclaimed) to 100 (nothing was).
+ */
+extern void vmpressure(gfp_t gfp, unsigned long scanned,
+		       unsigned long reclaimed);
+extern int vmpressure_register_notifier(struct notifier_block *nb);
+extern int vmpressure_unregister_notifier(struct notifier_block *nb);
+
+#endif /* __LINUX_VMPRESSURE_H */
@@ -0,0 +1,40 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_TRACE_LOWMEMORYKILLER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_LOWMEMORYKILLER_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lowmem_select,
+
+	TP_PROTO(int min_score_adj, int visited, struct task_struct *selected,
+		 int tasksize, s64 delta_ns),
+
+	TP_ARGS(min_score_adj, visited, selected, tasksize, delta_ns),
+
+	TP_STRUCT__entry(
+		__field(	int,	min_score_adj	)
+		__field(	int,	visited		)
+		__field(	pid_t,	pid		)
+		__field(	int,	tasksize	)
+		__field(	s64,	delta_ns	)
+	),
+
+	TP_fast_assign(
+		__entry->min_score_adj	= min_score_adj;
+		__entry->visited	= visited;
+		__entry->pid		= selected ? selected->pid : 0;
+		__entry->tasksize	= tasksize;
+		__entry->delta_ns	= delta_ns;
+	),
+
+	TP_printk("min_score_adj=%d visited=%d pid=%d tasksize=%d time=%lldns",
+		__entry->min_score_adj, __entry->visited, __entry->pid,
+		__entry->tasksize, __entry->delta_ns)
+);
+
+#endif /* _TRACE_LOWMEMORYKILLER_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
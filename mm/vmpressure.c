@@ -0,0 +1,96 @@
+/*
+ * linux/mm/vmpressure.c
+ *
+ * Global reclaim pressure estimate. Reclaim reports how many pages it
+ * scanned and how many of those it freed; once a window of pages has been
+ * scanned, the share that could not be reclaimed is passed on as a 0..100
+ * pressure level. Listeners run from a work item, so they may block
+ * without stalling the reclaimer that completed the window.
+ *
+ * This file is released under the GPLv2.
+ */
+#include <linux/kernel.h>
+#include <linux/export.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/notifier.h>
+#include <linux/swap.h>
+#include <linux/vmpressure.h>
+
+/* pages to scan before a pressure level is reported */
+static const unsigned long vmpressure_win = SWAP_CLUSTER_MAX * 16;
+
+static DEFINE_SPINLOCK(vmpressure_lock);
+static unsigned long vmpressure_scanned;
+static unsigned long vmpressure_reclaimed;
+
+static BLOCKING_NOTIFIER_HEAD(vmpressure_notify_list);
+
+static unsigned long vmpressure_calc(unsigned long scanned,
+				     unsigned long reclaimed)
+{
+	if (reclaimed >= scanned)
+		return 0;
+	return 100 - reclaimed * 100 / scanned;
+}
+
+static void vmpressure_work_fn(struct work_struct *work)
+{
+	unsigned long scanned, reclaimed;
+
+	spin_lock(&vmpressure_lock);
+	scanned = vmpressure_scanned;
+	reclaimed = vmpressure_reclaimed;
+	vmpressure_scanned = 0;
+	vmpressure_reclaimed = 0;
+	spin_unlock(&vmpressure_lock);
+
+	if (!scanned)
+		return;
+
+	blocking_notifier_call_chain(&vmpressure_notify_list,
+				     vmpressure_calc(scanned, reclaimed), NULL);
+}
+
+static DECLARE_WORK(vmpressure_work, vmpressure_work_fn);
+
+/**
+ * vmpressure() - account a round of reclaim
+ * @gfp:	reclaimer's gfp mask
+ * @scanned:	pages scanned in this round
+ * @reclaimed:	pages reclaimed in this round
+ *
+ * Called from global reclaim after each zone is shrunk.
+ */
+void vmpressure(gfp_t gfp, unsigned long scanned, unsigned long reclaimed)
+{
+	/*
+	 * Reclaim for allocations that cannot use most of memory, or that
+	 * cannot do I/O, says little about the pressure on the system.
+	 */
+	if (!(gfp & (__GFP_HIGHMEM | __GFP_MOVABLE | __GFP_IO | __GFP_FS)))
+		return;
+	if (!scanned)
+		return;
+
+	spin_lock(&vmpressure_lock);
+	vmpressure_scanned += scanned;
+	vmpressure_reclaimed += reclaimed;
+	scanned = vmpressure_scanned;
+	spin_unlock(&vmpressure_lock);
+
+	if (scanned >= vmpressure_win)
+		schedule_work(&vmpressure_work);
+}
+
+int vmpressure_register_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&vmpressure_notify_list, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_register_notifier);
+
+int vmpressure_unregister_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_unregister(&vmpressure_notify_list, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_unregister_notifier);
@@ -33,13 +33,19 @@
  * is returned (see zs_malloc).
  *
  * Additionally, zs_malloc() does not return a dereferenceable pointer.
- * Instead, it returns an opaque handle (unsigned long) which encodes actual
- * location of the allocated object. The reason for this indirection is that
- * zsmalloc does not keep zspages permanently mapped since that would cause
- * issues on 32-bit systems where the VA region for kernel space mappings
- * is very small. So, before using the allocating memory, the object has to
- * be mapped using zs_map_object() to get a usable pointer and subsequently
- * unmapped using zs_unmap_object().
+ * Instead, it returns an opaque handle (unsigned long) which refers to the
+ * actual location of the allocated object. The reason for this indirection
+ * is that zsmalloc does not keep zspages permanently mapped since that would
+ * cause issues on 32-bit systems where the VA region for kernel space
+ * mappings is very small. So, before using the allocating memory, the object
+ * has to be mapped using zs_map_object() to get a usable pointer and
+ * subsequently unmapped using zs_unmap_object().
+ *
+ * The handle is a small slab allocated word holding the object location,
+ * and each allocated object starts with a copy of its handle. This lets
+ * zs_compact() move objects from sparsely used zspages into fuller ones
+ * of the same class and fix up their handles, freeing the emptied zspages.
+ * An object is pinned, and thus never moved, while it is mapped or freed.
  *
  * Following is how we use various fields and flags of underlying
  * struct page(s) to form a zspage.
@@ -65,6 +71,8 @@
  *	page->lru: links together first pages of various zspages.
  *		Basically forming list of zspages in a fullness group.
  *	page->mapping: class index and fullness group of the zspage
+ *	page->private: handle of the object of a huge class zspage, which
+ *		consists of a single page holding a single object
  *
  * Usage of struct page flags:
  *	PG_private: identifies the first component page
@@ -92,6 +100,10 @@
 #include <linux/hardirq.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/mm.h>
+#include <linux/bit_spinlock.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <linux/zsmalloc.h>
 
 /*
@@ -111,7 +123,7 @@
 
 /*
  * Object location (<PFN>, <obj_idx>) is encoded as
- * as single (unsigned long) handle value.
+ * as single (unsigned long) obj value, stored in the handle.
  *
  * Note that object index <obj_idx> is relative to system
  * page <PFN> it is stored in, so for each sub-page belonging
@@ -132,9 +144,23 @@
 #endif
 #endif
 #define _PFN_BITS		(MAX_PHYSMEM_BITS - PAGE_SHIFT)
-#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS)
+
+/*
+ * The lowest bit of obj is free for tagging: in the handle it is the pin
+ * lock, in the header of an allocated object it tells apart allocated
+ * objects from free ones, whose first word is the freelist link.
+ */
+#define OBJ_TAG_BITS	1
+#define OBJ_TAG_MASK	((_AC(1, UL) << OBJ_TAG_BITS) - 1)
+#define OBJ_ALLOCATED_TAG	1
+#define HANDLE_PIN_BIT	0
+
+#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS - OBJ_TAG_BITS)
 #define OBJ_INDEX_MASK	((_AC(1, UL) << OBJ_INDEX_BITS) - 1)
 
+/* Allocated objects are prefixed with their handle */
+#define ZS_HANDLE_SIZE	(sizeof(unsigned long))
+
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
 /* ZS_MIN_ALLOC_SIZE must be multiple of ZS_ALIGN */
 #define ZS_MIN_ALLOC_SIZE \
@@ -196,11 +222,20 @@ struct size_class {
 
 	/* Number of PAGE_SIZE sized pages to combine to form a 'zspage' */
 	int pages_per_zspage;
+	int objs_per_zspage;
+	/*
+	 * A single object per single page zspage: its handle is kept in
+	 * page->private as there is no room for it in the object.
+	 */
+	bool huge;
 
 	spinlock_t lock;
 
 	/* stats */
 	u64 pages_allocated;
+	unsigned long objs_inuse;
+	/* no. of zspages on each fullness list */
+	unsigned long nr_zspages[_ZS_NR_FULLNESS_GROUPS];
 
 	struct page *fullness_list[_ZS_NR_FULLNESS_GROUPS];
 };
@@ -212,14 +247,27 @@ struct size_class {
  * This must be power of 2 and less than or equal to ZS_ALIGN
  */
 struct link_free {
-	/* Handle of next free chunk (encodes <PFN, obj_idx>) */
-	void *next;
+	union {
+		/* Location of next free chunk (encodes <PFN, obj_idx>) */
+		void *next;
+		/* Handle of allocated chunk, tagged with OBJ_ALLOCATED_TAG */
+		unsigned long handle;
+	};
 };
 
 struct zs_pool {
 	struct size_class size_class[ZS_SIZE_CLASSES];
 
+	const char *name;
 	gfp_t flags;	/* allocation flags used when growing pool */
+
+	/* compacts the pool under memory pressure */
+	struct shrinker shrinker;
+	atomic_long_t pages_compacted;
+
+#ifdef CONFIG_ZSMALLOC_STAT
+	struct dentry *stat_dentry;
+#endif
 };
 
 /*
@@ -245,6 +293,11 @@ struct mapping_area {
 /* per-cpu VM mapping areas for zspage accesses that cross page boundaries */
 static DEFINE_PER_CPU(struct mapping_area, zs_map_area);
 
+static struct kmem_cache *zs_handle_cache;
+
+static int zs_shrinker_shrink(struct shrinker *shrinker,
+				struct shrink_control *sc);
+
 static int is_first_page(struct page *page)
 {
 	return PagePrivate(page);
@@ -292,15 +345,15 @@ static int get_size_class_index(int size)
 		idx = DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
 				ZS_SIZE_CLASS_DELTA);
 
-	return idx;
+	/* objects of the last (huge) class carry their handle out of line */
+	return min_t(int, idx, ZS_SIZE_CLASSES - 1);
 }
 
 /*
  * For each size class, zspages are divided into different groups
  * depending on how "full" they are. This was done so that we could
- * easily find empty or nearly empty zspages when we try to shrink
- * the pool (not yet implemented). This function returns fullness
- * status of the given page.
+ * easily find empty or nearly empty zspages when we try to compact
+ * the pool. This function returns fullness status of the given page.
  */
 static enum fullness_group get_fullness_group(struct page *page)
 {
@@ -344,6 +397,7 @@ static void insert_zspage(struct page *page, struct size_class *class,
 		list_add_tail(&page->lru, &(*head)->lru);
 
 	*head = page;
+	class->nr_zspages[fullness]++;
 }
 
 /*
@@ -369,6 +423,7 @@ static void remove_zspage(struct page *page, struct size_class *class,
 					struct page, lru);
 
 	list_del_init(&page->lru);
+	class->nr_zspages[fullness]--;
 }
 
 /*
@@ -466,36 +521,83 @@ static struct page *get_next_page(struct page *page)
 }
 
 /*
- * Encode <page, obj_idx> as a single handle value.
+ * Encode <page, obj_idx> as a single obj value.
  * On hardware platforms with physical memory starting at 0x0 the pfn
- * could be 0 so we ensure that the handle will never be 0 by adjusting the
+ * could be 0 so we ensure that the obj will never be 0 by adjusting the
  * encoded obj_idx value before encoding.
  */
-static void *obj_location_to_handle(struct page *page, unsigned long obj_idx)
+static void *location_to_obj(struct page *page, unsigned long obj_idx)
 {
-	unsigned long handle;
+	unsigned long obj;
 
 	if (!page) {
 		BUG_ON(obj_idx);
 		return NULL;
 	}
 
-	handle = page_to_pfn(page) << OBJ_INDEX_BITS;
-	handle |= ((obj_idx + 1) & OBJ_INDEX_MASK);
+	obj = page_to_pfn(page) << OBJ_INDEX_BITS;
+	obj |= ((obj_idx + 1) & OBJ_INDEX_MASK);
+	obj <<= OBJ_TAG_BITS;
 
-	return (void *)handle;
+	return (void *)obj;
 }
 
 /*
- * Decode <page, obj_idx> pair from the given object handle. We adjust the
+ * Decode <page, obj_idx> pair from the given obj value. We adjust the
  * decoded obj_idx back to its original value since it was adjusted in
- * obj_location_to_handle().
+ * location_to_obj().
  */
-static void obj_handle_to_location(unsigned long handle, struct page **page,
+static void obj_to_location(unsigned long obj, struct page **page,
 				unsigned long *obj_idx)
 {
-	*page = pfn_to_page(handle >> OBJ_INDEX_BITS);
-	*obj_idx = (handle & OBJ_INDEX_MASK) - 1;
+	obj >>= OBJ_TAG_BITS;
+	*page = pfn_to_page(obj >> OBJ_INDEX_BITS);
+	*obj_idx = (obj & OBJ_INDEX_MASK) - 1;
+}
+
+static unsigned long handle_to_obj(unsigned long handle)
+{
+	return *(unsigned long *)handle & ~OBJ_TAG_MASK;
+}
+
+static void record_obj(unsigned long handle, unsigned long obj)
+{
+	*(unsigned long *)handle = obj;
+}
+
+/* first word of the object at @obj_addr, its tagged handle if allocated */
+static unsigned long obj_to_head(struct size_class *class, struct page *page,
+				void *obj_addr)
+{
+	if (class->huge)
+		return page_private(page) | OBJ_ALLOCATED_TAG;
+	return *(unsigned long *)obj_addr;
+}
+
+static void pin_tag(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_tag(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static void unpin_tag(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static unsigned long cache_alloc_handle(gfp_t gfp)
+{
+	return (unsigned long)kmem_cache_alloc(zs_handle_cache,
+			gfp & ~(__GFP_HIGHMEM | __GFP_MOVABLE));
+}
+
+static void cache_free_handle(unsigned long handle)
+{
+	kmem_cache_free(zs_handle_cache, (void *)handle);
 }
 
 static unsigned long obj_idx_to_offset(struct page *page,
@@ -572,7 +674,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		for (i = 1; i <= objs_on_page; i++) {
 			off += class->size;
 			if (off < PAGE_SIZE) {
-				link->next = obj_location_to_handle(page, i);
+				link->next = location_to_obj(page, i);
 				link += class->size / sizeof(*link);
 			}
 		}
@@ -583,7 +685,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		 * page (if present)
 		 */
 		next_page = get_next_page(page);
-		link->next = obj_location_to_handle(next_page, 0);
+		link->next = location_to_obj(next_page, 0);
 		kunmap_atomic(link);
 		page = next_page;
 		off = (off + class->size) % PAGE_SIZE;
@@ -637,9 +739,9 @@ static struct page *alloc_zspage(struct size_class *class, gfp_t flags)
 
 	init_zspage(first_page, class);
 
-	first_page->freelist = obj_location_to_handle(first_page, 0);
+	first_page->freelist = location_to_obj(first_page, 0);
 	/* Maximum number of objects we can store in this zspage */
-	first_page->objects = class->pages_per_zspage * PAGE_SIZE / class->size;
+	first_page->objects = class->objs_per_zspage;
 
 	error = 0; /* Success */
 
@@ -766,6 +868,11 @@ static void __zs_unmap_object(struct mapping_area *area,
 	if (area->vm_mm == ZS_MM_RO)
 		goto out;
 
+	/* spanning objects are never huge, skip the handle, it can't change */
+	buf += ZS_HANDLE_SIZE;
+	size -= ZS_HANDLE_SIZE;
+	off += ZS_HANDLE_SIZE;
+
 	sizes[0] = PAGE_SIZE - off;
 	sizes[1] = size - sizes[0];
 
@@ -811,6 +918,126 @@ static struct notifier_block zs_cpu_nb = {
 	.notifier_call = zs_cpu_notifier
 };
 
+/* pages compaction of the class could free, class lock held */
+static unsigned long zs_can_compact(struct size_class *class)
+{
+	unsigned long obj_allocated, obj_wasted;
+
+	if (class->huge)
+		return 0;
+
+	obj_allocated = (unsigned long)class->pages_allocated /
+			class->pages_per_zspage * class->objs_per_zspage;
+	obj_wasted = obj_allocated - class->objs_inuse;
+	obj_wasted /= class->objs_per_zspage;
+
+	return obj_wasted * class->pages_per_zspage;
+}
+
+#ifdef CONFIG_ZSMALLOC_STAT
+static struct dentry *zs_stat_root;
+
+static int zs_stats_size_show(struct seq_file *s, void *v)
+{
+	int i;
+	struct zs_pool *pool = s->private;
+	unsigned long almost_full, almost_empty, obj_allocated, obj_used;
+	unsigned long pages_used, freeable;
+	unsigned long total_almost_full = 0, total_almost_empty = 0;
+	unsigned long total_objs = 0, total_used_objs = 0, total_pages = 0;
+	unsigned long total_freeable = 0;
+
+	seq_printf(s, " %5s %5s %11s %12s %13s %10s %10s %16s %8s\n",
+			"class", "size", "almost_full", "almost_empty",
+			"obj_allocated", "obj_used", "pages_used",
+			"pages_per_zspage", "freeable");
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock(&class->lock);
+		almost_full = class->nr_zspages[ZS_ALMOST_FULL];
+		almost_empty = class->nr_zspages[ZS_ALMOST_EMPTY];
+		pages_used = class->pages_allocated;
+		obj_allocated = pages_used / class->pages_per_zspage *
+					class->objs_per_zspage;
+		obj_used = class->objs_inuse;
+		freeable = zs_can_compact(class);
+		spin_unlock(&class->lock);
+
+		seq_printf(s, " %5d %5d %11lu %12lu %13lu %10lu %10lu %16d %8lu\n",
+			i, class->size, almost_full, almost_empty,
+			obj_allocated, obj_used, pages_used,
+			class->pages_per_zspage, freeable);
+
+		total_almost_full += almost_full;
+		total_almost_empty += almost_empty;
+		total_objs += obj_allocated;
+		total_used_objs += obj_used;
+		total_pages += pages_used;
+		total_freeable += freeable;
+	}
+
+	seq_puts(s, "\n");
+	seq_printf(s, " %5s %5s %11lu %12lu %13lu %10lu %10lu %16s %8lu\n",
+			"Total", "", total_almost_full, total_almost_empty,
+			total_objs, total_used_objs, total_pages, "",
+			total_freeable);
+
+	return 0;
+}
+
+static int zs_stats_size_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zs_stats_size_show, inode->i_private);
+}
+
+static const struct file_operations zs_stat_size_ops = {
+	.open		= zs_stats_size_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void zs_stat_init(void)
+{
+	zs_stat_root = debugfs_create_dir("zsmalloc", NULL);
+	if (!zs_stat_root)
+		pr_warn("debugfs 'zsmalloc' stat dir creation failed\n");
+}
+
+static void zs_stat_exit(void)
+{
+	debugfs_remove_recursive(zs_stat_root);
+}
+
+static void zs_pool_stat_create(struct zs_pool *pool)
+{
+	if (IS_ERR_OR_NULL(zs_stat_root))
+		return;
+
+	pool->stat_dentry = debugfs_create_dir(pool->name, zs_stat_root);
+	if (IS_ERR_OR_NULL(pool->stat_dentry)) {
+		pr_warn("debugfs dir <%s> creation failed\n", pool->name);
+		pool->stat_dentry = NULL;
+		return;
+	}
+
+	debugfs_create_file("classes", S_IFREG | S_IRUGO, pool->stat_dentry,
+			pool, &zs_stat_size_ops);
+}
+
+static void zs_pool_stat_destroy(struct zs_pool *pool)
+{
+	debugfs_remove_recursive(pool->stat_dentry);
+}
+#else /* CONFIG_ZSMALLOC_STAT */
+static void zs_stat_init(void) { }
+static void zs_stat_exit(void) { }
+static void zs_pool_stat_create(struct zs_pool *pool) { }
+static void zs_pool_stat_destroy(struct zs_pool *pool) { }
+#endif
+
 static void zs_exit(void)
 {
 	int cpu;
@@ -818,12 +1045,22 @@ static void zs_exit(void)
 	for_each_online_cpu(cpu)
 		zs_cpu_notifier(NULL, CPU_DEAD, (void *)(long)cpu);
 	unregister_cpu_notifier(&zs_cpu_nb);
+	zs_stat_exit();
+	if (zs_handle_cache)
+		kmem_cache_destroy(zs_handle_cache);
 }
 
 static int zs_init(void)
 {
 	int cpu, ret;
 
+	zs_handle_cache = kmem_cache_create("zs_handle", ZS_HANDLE_SIZE,
+					    0, 0, NULL);
+	if (!zs_handle_cache)
+		return -ENOMEM;
+
+	zs_stat_init();
+
 	register_cpu_notifier(&zs_cpu_nb);
 	for_each_online_cpu(cpu) {
 		ret = zs_cpu_notifier(NULL, CPU_UP_PREPARE, (void *)(long)cpu);
@@ -838,6 +1075,7 @@ fail:
 
 /**
  * zs_create_pool - Creates an allocation pool to work from.
+ * @name: pool name, used for its statistics
  * @flags: allocation flags used to allocate pool metadata
  *
  * This function must be called before anything when using
@@ -846,7 +1084,7 @@ fail:
  * On success, a pointer to the newly created pool is returned,
  * otherwise NULL.
  */
-struct zs_pool *zs_create_pool(gfp_t flags)
+struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
 {
 	int i, ovhd_size;
 	struct zs_pool *pool;
@@ -856,6 +1094,12 @@ struct zs_pool *zs_create_pool(gfp_t flags)
 	if (!pool)
 		return NULL;
 
+	pool->name = kstrdup(name, GFP_KERNEL);
+	if (!pool->name) {
+		kfree(pool);
+		return NULL;
+	}
+
 	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
 		int size;
 		struct size_class *class;
@@ -869,11 +1113,20 @@ struct zs_pool *zs_create_pool(gfp_t flags)
 		class->index = i;
 		spin_lock_init(&class->lock);
 		class->pages_per_zspage = get_pages_per_zspage(size);
-
+		class->objs_per_zspage = class->pages_per_zspage *
+						PAGE_SIZE / size;
+		if (class->pages_per_zspage == 1 && class->objs_per_zspage == 1)
+			class->huge = true;
 	}
 
 	pool->flags = flags;
 
+	pool->shrinker.shrink = zs_shrinker_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
+	zs_pool_stat_create(pool);
+
 	return pool;
 }
 EXPORT_SYMBOL_GPL(zs_create_pool);
@@ -882,6 +1135,9 @@ void zs_destroy_pool(struct zs_pool *pool)
 {
 	int i;
 
+	zs_pool_stat_destroy(pool);
+	unregister_shrinker(&pool->shrinker);
+
 	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
 		int fg;
 		struct size_class *class = &pool->size_class[i];
@@ -893,33 +1149,101 @@ void zs_destroy_pool(struct zs_pool *pool)
 			}
 		}
 	}
+	kfree(pool->name);
 	kfree(pool);
 }
 EXPORT_SYMBOL_GPL(zs_destroy_pool);
 
+/* allocation flags the pool was created with */
+gfp_t zs_pool_gfp(struct zs_pool *pool)
+{
+	return pool->flags;
+}
+EXPORT_SYMBOL_GPL(zs_pool_gfp);
+
+/* take a free object off @first_page's freelist, class lock held */
+static unsigned long obj_malloc(struct page *first_page,
+		struct size_class *class, unsigned long handle)
+{
+	unsigned long obj;
+	struct link_free *link;
+	struct page *m_page;
+	unsigned long m_objidx, m_offset;
+	void *vaddr;
+
+	obj = (unsigned long)first_page->freelist;
+	obj_to_location(obj, &m_page, &m_objidx);
+	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
+
+	vaddr = kmap_atomic(m_page);
+	link = (struct link_free *)vaddr + m_offset / sizeof(*link);
+	first_page->freelist = link->next;
+	if (!class->huge)
+		link->handle = handle | OBJ_ALLOCATED_TAG;
+	else
+		set_page_private(first_page, handle);
+	kunmap_atomic(vaddr);
+
+	first_page->inuse++;
+	class->objs_inuse++;
+
+	return obj;
+}
+
+/* put @obj back on its zspage's freelist, class lock held */
+static void obj_free(struct size_class *class, unsigned long obj)
+{
+	struct link_free *link;
+	struct page *first_page, *f_page;
+	unsigned long f_objidx, f_offset;
+	void *vaddr;
+
+	obj_to_location(obj, &f_page, &f_objidx);
+	first_page = get_first_page(f_page);
+	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
+
+	vaddr = kmap_atomic(f_page);
+	link = (struct link_free *)(vaddr + f_offset);
+	link->next = first_page->freelist;
+	if (class->huge)
+		set_page_private(first_page, 0);
+	kunmap_atomic(vaddr);
+	first_page->freelist = (void *)obj;
+
+	first_page->inuse--;
+	class->objs_inuse--;
+}
+
 /**
  * zs_malloc - Allocate block of given size from pool.
  * @pool: pool to allocate from
  * @size: size of block to allocate
+ * @gfp: allocation flags used if the pool has to grow
  *
  * On success, handle to the allocated object is returned,
  * otherwise 0.
  * Allocation requests with size > ZS_MAX_ALLOC_SIZE will fail.
+ *
+ * Callers that cannot sleep (e.g. holding a per-cpu resource) may pass
+ * non-blocking @gfp and retry with the pool default (zs_pool_gfp())
+ * after dropping it.
  */
-unsigned long zs_malloc(struct zs_pool *pool, size_t size)
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t gfp)
 {
-	unsigned long obj;
-	struct link_free *link;
+	unsigned long handle, obj;
 	int class_idx;
 	struct size_class *class;
-
-	struct page *first_page, *m_page;
-	unsigned long m_objidx, m_offset;
+	struct page *first_page;
 
 	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
 		return 0;
 
-	class_idx = get_size_class_index(size);
+	handle = cache_alloc_handle(gfp);
+	if (!handle)
+		return 0;
+
+	/* extra space in chunk to keep the handle */
+	class_idx = get_size_class_index(size + ZS_HANDLE_SIZE);
 	class = &pool->size_class[class_idx];
 	BUG_ON(class_idx != class->index);
 
@@ -928,71 +1252,59 @@ unsigned long zs_malloc(struct zs_pool *pool, size_t size)
 
 	if (!first_page) {
 		spin_unlock(&class->lock);
-		first_page = alloc_zspage(class, pool->flags);
-		if (unlikely(!first_page))
+		first_page = alloc_zspage(class, gfp);
+		if (unlikely(!first_page)) {
+			cache_free_handle(handle);
 			return 0;
+		}
 
 		set_zspage_mapping(first_page, class->index, ZS_EMPTY);
 		spin_lock(&class->lock);
 		class->pages_allocated += class->pages_per_zspage;
 	}
 
-	obj = (unsigned long)first_page->freelist;
-	obj_handle_to_location(obj, &m_page, &m_objidx);
-	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
-
-	link = (struct link_free *)kmap_atomic(m_page) +
-					m_offset / sizeof(*link);
-	first_page->freelist = link->next;
-	memset(link, POISON_INUSE, sizeof(*link));
-	kunmap_atomic(link);
-
-	first_page->inuse++;
+	obj = obj_malloc(first_page, class, handle);
 	/* Now move the zspage to another fullness group, if required */
 	fix_fullness_group(pool, first_page);
+	record_obj(handle, obj);
 	spin_unlock(&class->lock);
 
-	return obj;
+	return handle;
 }
 EXPORT_SYMBOL_GPL(zs_malloc);
 
-void zs_free(struct zs_pool *pool, unsigned long obj)
+void zs_free(struct zs_pool *pool, unsigned long handle)
 {
-	struct link_free *link;
 	struct page *first_page, *f_page;
-	unsigned long f_objidx, f_offset;
+	unsigned long obj, f_objidx;
 
 	int class_idx;
 	struct size_class *class;
 	enum fullness_group fullness;
 
-	if (unlikely(!obj))
+	if (unlikely(!handle))
 		return;
 
-	obj_handle_to_location(obj, &f_page, &f_objidx);
+	/* a pinned object can't be migrated by zs_compact() */
+	pin_tag(handle);
+	obj = handle_to_obj(handle);
+	obj_to_location(obj, &f_page, &f_objidx);
 	first_page = get_first_page(f_page);
 
 	get_zspage_mapping(first_page, &class_idx, &fullness);
 	class = &pool->size_class[class_idx];
-	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
 
 	spin_lock(&class->lock);
-
-	/* Insert this object in containing zspage's freelist */
-	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
-							+ f_offset);
-	link->next = first_page->freelist;
-	kunmap_atomic(link);
-	first_page->freelist = (void *)obj;
-
-	first_page->inuse--;
+	obj_free(class, obj);
 	fullness = fix_fullness_group(pool, first_page);
 
 	if (fullness == ZS_EMPTY)
 		class->pages_allocated -= class->pages_per_zspage;
 
 	spin_unlock(&class->lock);
+	unpin_tag(handle);
 
+	cache_free_handle(handle);
 	if (fullness == ZS_EMPTY)
 		free_zspage(first_page);
 }
@@ -1008,7 +1320,8 @@ EXPORT_SYMBOL_GPL(zs_free);
  * zs_unmap_object.
  *
  * Only one object can be mapped per cpu at a time. There is no protection
- * against nested mappings.
+ * against nested mappings. The object is pinned while mapped, so
+ * concurrent mappings of the same object are serialized.
  *
  * This function returns with preemption and page faults disabled.
  */
@@ -1016,13 +1329,14 @@ void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 			enum zs_mapmode mm)
 {
 	struct page *page;
-	unsigned long obj_idx, off;
+	unsigned long obj, obj_idx, off;
 
 	unsigned int class_idx;
 	enum fullness_group fg;
 	struct size_class *class;
 	struct mapping_area *area;
 	struct page *pages[2];
+	void *ret;
 
 	BUG_ON(!handle);
 
@@ -1033,7 +1347,11 @@ void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 	 */
 	BUG_ON(in_interrupt());
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	/* From now on, migration cannot move the object */
+	pin_tag(handle);
+
+	obj = handle_to_obj(handle);
+	obj_to_location(obj, &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
@@ -1043,7 +1361,8 @@ void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 	if (off + class->size <= PAGE_SIZE) {
 		/* this object is contained entirely within a page */
 		area->vm_addr = kmap_atomic(page);
-		return area->vm_addr + off;
+		ret = area->vm_addr + off;
+		goto out;
 	}
 
 	/* this object spans two pages */
@@ -1051,14 +1370,19 @@ void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 	pages[1] = get_next_page(page);
 	BUG_ON(!pages[1]);
 
-	return __zs_map_object(area, pages, off, class->size);
+	ret = __zs_map_object(area, pages, off, class->size);
+out:
+	if (!class->huge)
+		ret += ZS_HANDLE_SIZE;
+
+	return ret;
 }
 EXPORT_SYMBOL_GPL(zs_map_object);
 
 void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
 {
 	struct page *page;
-	unsigned long obj_idx, off;
+	unsigned long obj, obj_idx, off;
 
 	unsigned int class_idx;
 	enum fullness_group fg;
@@ -1067,7 +1391,8 @@ void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	obj = handle_to_obj(handle);
+	obj_to_location(obj, &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
@@ -1085,9 +1410,316 @@ void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
 		__zs_unmap_object(area, pages, off, class->size);
 	}
 	put_cpu_var(zs_map_area);
+	unpin_tag(handle);
 }
 EXPORT_SYMBOL_GPL(zs_unmap_object);
 
+/* copy the whole chunk, header included, from @src to @dst */
+static void zs_object_copy(unsigned long dst, unsigned long src,
+				struct size_class *class)
+{
+	struct page *s_page, *d_page;
+	unsigned long s_objidx, d_objidx;
+	unsigned long s_off, d_off;
+	void *s_addr, *d_addr;
+	int s_size, d_size, size;
+	int written = 0;
+
+	s_size = d_size = class->size;
+
+	obj_to_location(src, &s_page, &s_objidx);
+	obj_to_location(dst, &d_page, &d_objidx);
+
+	s_off = obj_idx_to_offset(s_page, s_objidx, class->size);
+	d_off = obj_idx_to_offset(d_page, d_objidx, class->size);
+
+	if (s_off + class->size > PAGE_SIZE)
+		s_size = PAGE_SIZE - s_off;
+
+	if (d_off + class->size > PAGE_SIZE)
+		d_size = PAGE_SIZE - d_off;
+
+	s_addr = kmap_atomic(s_page);
+	d_addr = kmap_atomic(d_page);
+
+	while (1) {
+		size = min(s_size, d_size);
+		memcpy(d_addr + d_off, s_addr + s_off, size);
+		written += size;
+
+		if (written == class->size)
+			break;
+
+		s_off += size;
+		s_size -= size;
+		d_off += size;
+		d_size -= size;
+
+		/* kmap_atomic() mappings must be released in reverse order */
+		if (s_off >= PAGE_SIZE) {
+			kunmap_atomic(d_addr);
+			kunmap_atomic(s_addr);
+			s_page = get_next_page(s_page);
+			BUG_ON(!s_page);
+			s_addr = kmap_atomic(s_page);
+			d_addr = kmap_atomic(d_page);
+			s_size = class->size - written;
+			s_off = 0;
+		}
+
+		if (d_off >= PAGE_SIZE) {
+			kunmap_atomic(d_addr);
+			d_page = get_next_page(d_page);
+			BUG_ON(!d_page);
+			d_addr = kmap_atomic(d_page);
+			d_size = class->size - written;
+			d_off = 0;
+		}
+	}
+
+	kunmap_atomic(d_addr);
+	kunmap_atomic(s_addr);
+}
+
+/*
+ * Find the first allocated object starting at object @index of @page and
+ * pin it. Returns its handle, 0 if there are no more unpinned objects
+ * starting in @page.
+ */
+static unsigned long find_alloced_obj(struct size_class *class,
+				struct page *page, unsigned long *index)
+{
+	unsigned long head, handle = 0;
+	unsigned long offset;
+	void *addr;
+
+	offset = obj_idx_to_offset(page, *index, class->size);
+	addr = kmap_atomic(page);
+	while (offset < PAGE_SIZE) {
+		head = obj_to_head(class, page, addr + offset);
+		if (head & OBJ_ALLOCATED_TAG) {
+			handle = head & ~OBJ_ALLOCATED_TAG;
+			if (trypin_tag(handle))
+				break;
+			handle = 0;
+		}
+		offset += class->size;
+		(*index)++;
+	}
+	kunmap_atomic(addr);
+
+	return handle;
+}
+
+struct zs_compact_control {
+	/* component page of the source zspage being scanned */
+	struct page *s_page;
+	/* next object index to scan in s_page */
+	unsigned long index;
+	/* first page of the destination zspage */
+	struct page *d_page;
+};
+
+/*
+ * Move objects from the source zspage to the destination one until either
+ * the source is scanned completely (returns 0) or the destination is full
+ * (returns -ENOMEM). Class lock held.
+ */
+static int migrate_zspage(struct size_class *class,
+				struct zs_compact_control *cc)
+{
+	unsigned long used_obj, free_obj;
+	unsigned long handle;
+	struct page *s_page = cc->s_page;
+	struct page *d_page = cc->d_page;
+	unsigned long index = cc->index;
+	int ret = 0;
+
+	while (1) {
+		handle = find_alloced_obj(class, s_page, &index);
+		if (!handle) {
+			s_page = get_next_page(s_page);
+			if (!s_page)
+				break;
+			index = 0;
+			continue;
+		}
+
+		/* Stop if there is no more space */
+		if (d_page->inuse == d_page->objects) {
+			unpin_tag(handle);
+			ret = -ENOMEM;
+			break;
+		}
+
+		used_obj = handle_to_obj(handle);
+		free_obj = obj_malloc(d_page, class, handle);
+		zs_object_copy(free_obj, used_obj, class);
+		index++;
+		/*
+		 * record_obj() overwrites the pin bit of the handle, keep it
+		 * set until the object is released from the source.
+		 */
+		record_obj(handle, free_obj | BIT(HANDLE_PIN_BIT));
+		unpin_tag(handle);
+		obj_free(class, used_obj);
+	}
+
+	cc->s_page = s_page;
+	cc->index = index;
+
+	return ret;
+}
+
+/* sparsest zspage of the class, taken off its fullness list */
+static struct page *isolate_source_page(struct size_class *class)
+{
+	struct page *page;
+
+	page = class->fullness_list[ZS_ALMOST_EMPTY];
+	if (page)
+		remove_zspage(page, class, ZS_ALMOST_EMPTY);
+
+	return page;
+}
+
+/* fullest zspage of the class with a free object, taken off its list */
+static struct page *isolate_target_page(struct size_class *class)
+{
+	int i;
+	struct page *page = NULL;
+
+	for (i = 0; i < _ZS_NR_FULLNESS_GROUPS; i++) {
+		page = class->fullness_list[i];
+		if (page) {
+			remove_zspage(page, class, i);
+			break;
+		}
+	}
+
+	return page;
+}
+
+/*
+ * Return an isolated zspage to the fullness list matching its current
+ * usage. An emptied zspage isn't listed, the caller must free it.
+ */
+static enum fullness_group putback_zspage(struct size_class *class,
+				struct page *first_page)
+{
+	enum fullness_group fullness;
+
+	fullness = get_fullness_group(first_page);
+	insert_zspage(first_page, class, fullness);
+	set_zspage_mapping(first_page, class->index, fullness);
+
+	return fullness;
+}
+
+static unsigned long __zs_compact(struct zs_pool *pool,
+				struct size_class *class)
+{
+	struct zs_compact_control cc;
+	struct page *src_page;
+	struct page *dst_page = NULL;
+	unsigned long pages_freed = 0;
+
+	spin_lock(&class->lock);
+	while (zs_can_compact(class) &&
+			(src_page = isolate_source_page(class))) {
+		cc.index = 0;
+		cc.s_page = src_page;
+
+		while ((dst_page = isolate_target_page(class))) {
+			cc.d_page = dst_page;
+			/* source scanned completely, dst may have room left */
+			if (!migrate_zspage(class, &cc))
+				break;
+
+			putback_zspage(class, dst_page);
+		}
+
+		/* Stop if we couldn't find slot */
+		if (dst_page == NULL) {
+			putback_zspage(class, src_page);
+			break;
+		}
+
+		putback_zspage(class, dst_page);
+		if (putback_zspage(class, src_page) != ZS_EMPTY) {
+			/* some objects were pinned, try again later */
+			break;
+		}
+
+		class->pages_allocated -= class->pages_per_zspage;
+		pages_freed += class->pages_per_zspage;
+		spin_unlock(&class->lock);
+		free_zspage(src_page);
+		cond_resched();
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return pages_freed;
+}
+
+/**
+ * zs_compact - defragment the pool
+ * @pool: pool to compact
+ *
+ * Moves objects from sparsely used zspages into fuller zspages of the
+ * same size class, updating their handles, and frees the zspages
+ * emptied this way. Objects mapped or being freed meanwhile are left
+ * in place. May sleep.
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long pages_freed = 0;
+
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--)
+		pages_freed += __zs_compact(pool, &pool->size_class[i]);
+
+	atomic_long_add(pages_freed, &pool->pages_compacted);
+
+	return pages_freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+void zs_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+	stats->pages_compacted = atomic_long_read(&pool->pages_compacted);
+}
+EXPORT_SYMBOL_GPL(zs_pool_stats);
+
+/*
+ * Report the pages compaction could free as the cache size and compact
+ * the whole pool when asked to scan: compaction only takes spinlocks and
+ * never allocates, so it is safe from any reclaim context.
+ */
+static int zs_shrinker_shrink(struct shrinker *shrinker,
+				struct shrink_control *sc)
+{
+	int i;
+	unsigned long pages = 0;
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+						shrinker);
+
+	if (sc->nr_to_scan)
+		zs_compact(pool);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock(&class->lock);
+		pages += zs_can_compact(class);
+		spin_unlock(&class->lock);
+	}
+
+	return min_t(unsigned long, pages, INT_MAX);
+}
 u64 zs_get_total_size_bytes(struct zs_pool *pool)
 {
 	int i;
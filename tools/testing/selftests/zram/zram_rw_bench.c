@@ -0,0 +1,201 @@
+/*
+ * zram_rw_bench:
+ *
+ * Microbenchmark of concurrent reads and writes on a zram device. Each
+ * reader and writer thread works on its own range of pages of the device
+ * using O_DIRECT page sized I/O, so threads never touch the same zram
+ * slot and any slowdown of readers while writers run comes from locking
+ * shared by the whole device.
+ *
+ * The device must be initialised (disksize set) and must not be in use,
+ * its content is overwritten. Usage:
+ *
+ *	zram_rw_bench [-d device] [-r readers] [-w writers] [-s seconds]
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#define PAGE_SZ		4096UL
+#define MAX_THREADS	64
+
+struct worker {
+	pthread_t thread;
+	int fd;
+	int write;
+	unsigned long first;	/* first page of the range */
+	unsigned long nr_pages;
+	unsigned long ops;
+};
+
+static volatile int stop;
+
+/* half random, half zero: compressible but not a same filled page */
+static void fill_page(unsigned char *buf, unsigned int seed)
+{
+	unsigned long i;
+
+	for (i = 0; i < PAGE_SZ / 2; i++)
+		buf[i] = rand_r(&seed);
+	memset(buf + PAGE_SZ / 2, 0, PAGE_SZ / 2);
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	unsigned long page = 0;
+	unsigned char *buf;
+	ssize_t ret;
+
+	if (posix_memalign((void **)&buf, PAGE_SZ, PAGE_SZ))
+		return NULL;
+	fill_page(buf, w->first);
+
+	while (!stop) {
+		off_t off = (w->first + page) * PAGE_SZ;
+
+		if (w->write)
+			ret = pwrite(w->fd, buf, PAGE_SZ, off);
+		else
+			ret = pread(w->fd, buf, PAGE_SZ, off);
+		if (ret != (ssize_t)PAGE_SZ) {
+			perror(w->write ? "pwrite" : "pread");
+			break;
+		}
+		w->ops++;
+		if (++page == w->nr_pages)
+			page = 0;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* store data in the reader ranges so reads have something to decompress */
+static int prefill(int fd, unsigned long first, unsigned long nr_pages)
+{
+	unsigned char *buf;
+	unsigned long i;
+	int ret = 0;
+
+	if (posix_memalign((void **)&buf, PAGE_SZ, PAGE_SZ))
+		return -1;
+	fill_page(buf, first);
+
+	for (i = 0; i < nr_pages; i++) {
+		if (pwrite(fd, buf, PAGE_SZ, (first + i) * PAGE_SZ) !=
+				(ssize_t)PAGE_SZ) {
+			perror("pwrite");
+			ret = -1;
+			break;
+		}
+	}
+
+	free(buf);
+	return ret;
+}
+
+static void report(const char *what, struct worker *w, int nr, int seconds)
+{
+	unsigned long ops = 0;
+	int i;
+
+	if (!nr)
+		return;
+	for (i = 0; i < nr; i++)
+		ops += w[i].ops;
+	printf("%-8s %2d threads %10lu ops/s %8.1f MB/s\n", what, nr,
+		ops / seconds, (double)ops * PAGE_SZ / seconds / (1 << 20));
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = "/dev/zram0";
+	int readers = 2, writers = 2, seconds = 10;
+	struct worker w[MAX_THREADS];
+	unsigned long long size;
+	unsigned long per_thread;
+	int fd, opt, i, nr;
+
+	while ((opt = getopt(argc, argv, "d:r:w:s:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 'r':
+			readers = atoi(optarg);
+			break;
+		case 'w':
+			writers = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d device] [-r readers] "
+				"[-w writers] [-s seconds]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	nr = readers + writers;
+	if (readers < 0 || writers < 0 || nr < 1 || nr > MAX_THREADS ||
+			seconds < 1) {
+		fprintf(stderr, "invalid arguments\n");
+		return 1;
+	}
+
+	fd = open(dev, O_RDWR | O_DIRECT);
+	if (fd < 0) {
+		perror(dev);
+		return 1;
+	}
+	if (ioctl(fd, BLKGETSIZE64, &size) < 0) {
+		perror("BLKGETSIZE64");
+		return 1;
+	}
+
+	per_thread = size / PAGE_SZ / nr;
+	if (!per_thread) {
+		fprintf(stderr, "%s too small for %d threads\n", dev, nr);
+		return 1;
+	}
+
+	memset(w, 0, sizeof(w));
+	for (i = 0; i < nr; i++) {
+		w[i].fd = fd;
+		w[i].write = i >= readers;
+		w[i].first = i * per_thread;
+		w[i].nr_pages = per_thread;
+		if (!w[i].write && prefill(fd, w[i].first, per_thread))
+			return 1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		errno = pthread_create(&w[i].thread, NULL, worker_fn, &w[i]);
+		if (errno) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nr; i++)
+		pthread_join(w[i].thread, NULL);
+
+	report("read", w, readers, seconds);
+	report("write", w + readers, writers, seconds);
+
+	close(fd);
+	return 0;
+}